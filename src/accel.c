@@ -6,60 +6,793 @@
 #include <stdio.h>
 #include <logging/log.h>
 #include <drivers/i2c.h>
+#include <drivers/gpio.h>
+#include <sys/byteorder.h>
+#include <string.h>
 
 #include "accel.h"
+#include "accel_emul.h"
+#include "ring.h"
+#include "prof.h"
+#include "timesync.h"
 
 LOG_MODULE_REGISTER(accel);
 
 #define ACCEL                DT_LABEL(DT_INST(0, invensense_mpu6050))
+#define ACCEL_INT_GPIO       DT_GPIO_LABEL(DT_INST(0, invensense_mpu6050), int_gpios)
+#define ACCEL_INT_PIN        DT_GPIO_PIN(DT_INST(0, invensense_mpu6050), int_gpios)
 #define I2C                  DT_LABEL(DT_NODELABEL(i2c0))
 #define PERIOD               K_MSEC(100)
-#define QUEUE_SIZE           10
-#define QUEUE_TIMEOUT        K_MSEC(100)
-#define SAMPLE_RATE_DEVIDER  9
+#define RING_SIZE            64
+#define SAMPLE_RATE_DEVIDER  CONFIG_MOCAP_SAMPLE_RATE_DIVIDER
 #define SAMPLE_RATE_REG_ADDR 0x19
-#define I2C_ACCEL_ADDRESS    0x68
-#define DLPF_VALUE           6
+#define CONFIG_REG_ADDR      0x1A
+#define GYRO_CONFIG_REG_ADDR 0x1B
+#define ACCEL_CONFIG_REG_ADDR 0x1C
+#define FS_SEL_SHIFT         3
+#define FS_SEL_MAX           3
+#define I2C_ACCEL_ADDRESS    0x68 // AD0 low, 0x69 with AD0 high
+#define MUX_ADDRESS          CONFIG_MOCAP_ACCEL_MUX_ADDR
+#define PWR_MGMT_1_REG_ADDR  0x6B
+#define PWR_MGMT_1_CLK_PLL   0x01 // Awake, clocked from the X gyro
+#define DLPF_VALUE           CONFIG_MOCAP_ACCEL_DLPF
+#ifdef CONFIG_MOCAP_DECIM
+#define DECIMATION_VALUE     CONFIG_MOCAP_DECIM_RATIO
+#else
+#define DECIMATION_VALUE     1
+#endif
+#define DEGRADE_HOLDOFF_MS   1000
+#define DELTA_PERIODS_MIN    4 // Periods a delta holds, so a few drops still fit
+#define DATA_REG_ADDR        0x3B
+#define DATA_SIZE            14
+#define DATA_GYRO_OFFSET     8
 
+#define FIFO_EN_REG_ADDR     0x23
+#define FIFO_EN_ACCEL        0x08
+#define FIFO_EN_GYRO         0x70
+#define USER_CTRL_REG_ADDR   0x6A
+#define USER_CTRL_FIFO_EN    0x40
+#define USER_CTRL_FIFO_RESET 0x04
+#define FIFO_COUNT_REG_ADDR  0x72
+#define FIFO_DATA_REG_ADDR   0x74
+#define FIFO_SIZE            1024
+#define FIFO_FRAME_SIZE      12
+#define FIFO_GYRO_OFFSET     6
+#define FIFO_PERIOD_MIN_MS   2
+#define FIFO_PERIOD_MAX_MS   CONFIG_MOCAP_ACCEL_FIFO_PERIOD
+#define FIFO_BURST_FRAMES    CONFIG_MOCAP_ACCEL_FIFO_BURST
+#define SENSOR_BURST_FRAMES  MAX(FIFO_BURST_FRAMES / ACCEL_SENSOR_COUNT, 1)
+#define SKEW_REALIGN_FRAMES  2 // Count reads may straddle one new frame
+#define PERIOD_FIT_MIN_US    USEC_PER_SEC // Shortest span to fit the sensor period over
+#define FIFO_STACK_SIZE      1024
+#define FIFO_PRIORITY        0
+
+#ifdef CONFIG_MPU6050
+#define ACCEL_RANGE          CONFIG_MPU6050_ACCEL_FS
+#define GYRO_RANGE           CONFIG_MPU6050_GYRO_FS
+#else
+/* Sensor power-on defaults */
+#define ACCEL_RANGE          2
+#define GYRO_RANGE           250
+#endif
+#define ACCEL_FS_SEL         (__builtin_ctz(ACCEL_RANGE) - 1)
+#define GYRO_FS_SEL          (__builtin_ctz(GYRO_RANGE / 250))
+
+BUILD_ASSERT(ACCEL_SENSOR_COUNT >= 1, "No MPU6050 in the devicetree");
+BUILD_ASSERT(ACCEL_SENSOR_COUNT == 1 || !IS_ENABLED(CONFIG_MOCAP_OVERRUN_DROP_OLDEST),
+             "Dropping the oldest entry would split multi-sensor samples");
+
+struct accel_sensor
+{
+    uint8_t address;
+    uint8_t channel;       // Mux channel
+    uint16_t pending;      // Frames in the FIFO at the last count read
+    uint32_t count_cycles; // When the count was read
+    struct accel_sensor_stats stats;
+};
+
+#if defined(CONFIG_MOCAP_ACCEL_MUX) || defined(CONFIG_MOCAP_ACCEL_EMUL)
+/* Filled in by accel_init(), two sensors on every mux channel */
+static struct accel_sensor sensors[ACCEL_SENSOR_COUNT];
+#elif defined(CONFIG_MOCAP_ACCEL_FIFO)
+#define SENSOR_INIT(node) { .address = DT_REG_ADDR(node) },
+static struct accel_sensor sensors[ACCEL_SENSOR_COUNT] = {
+    DT_FOREACH_STATUS_OKAY(invensense_mpu6050, SENSOR_INIT)
+};
+#else
+static struct accel_sensor sensors[ACCEL_SENSOR_COUNT] = {
+    { .address = DT_REG_ADDR(DT_INST(0, invensense_mpu6050)) },
+};
+#endif
+
+#ifndef CONFIG_MOCAP_ACCEL_FIFO
 static const struct device *accle_device;
+#endif
 static const struct device *i2c_device;
 static bool is_running = false;
-static uint32_t base_timestamp = 0; // Timestamp whene record was started
-static uint16_t count = 0;
+static uint32_t count = 0;
+static uint64_t start_us = 0; // Device time of the first sample
+static uint64_t last_us = 0;  // Device time of the previous sample, in whole ticks
+static uint16_t tick_us = RECORD_TICK_US; // Delta unit of the next take
+static uint8_t sample_rate_divider = SAMPLE_RATE_DEVIDER; // Live value, may be degraded
+static struct accel_config config = {
+    .divider  = SAMPLE_RATE_DEVIDER,
+    .dlpf     = DLPF_VALUE,
+    .accel_fs = ACCEL_FS_SEL,
+    .gyro_fs  = GYRO_FS_SEL,
+    .decimation = DECIMATION_VALUE,
+};
+static uint32_t lost_pending = 0; // Dropped since the last stored sample
+static uint32_t lost_total = 0;
+static uint32_t degrade_timestamp = 0;
+
+static struct accel_entry ring_buf[RING_SIZE];
+static uint16_t ring_lost[RING_SIZE];
+static struct ring accel_ring;
+
+int accel_sample_rate_set(void);
+
+static uint32_t accel_period_us(uint8_t divider)
+{
+    /* Internal rate is 8kHz with DLPF off, 1kHz otherwise */
+    if(config.dlpf == 0 || config.dlpf == 7)
+    {
+        return (divider + 1) * 125;
+    }
+
+    return (divider + 1) * 1000;
+}
+
+static uint32_t accel_sample_period_us(void)
+{
+    return accel_period_us(sample_rate_divider);
+}
+
+/* Slowest sensor period a take with this config can run at */
+static uint32_t accel_period_max_us(void)
+{
+    uint8_t divider = config.divider;
+
+#ifdef CONFIG_MOCAP_OVERRUN_DEGRADE_RATE
+    /* As accel_rate_degrade() */
+    while(divider <= UINT8_MAX / 2)
+    {
+        divider = divider * 2 + 1;
+    }
+#endif
+
+    return accel_period_us(divider);
+}
+
+/* The finest tick that keeps a delta of the slowest stored period in
+ * 16 bits. A decimated sample covers decimation sensor periods. */
+static void accel_tick_update(void)
+{
+    uint32_t span_us = accel_period_max_us() * config.decimation * DELTA_PERIODS_MIN;
+
+    tick_us = MAX(ceiling_fraction(span_us, UINT16_MAX), RECORD_TICK_US);
+}
+
+#ifdef CONFIG_MOCAP_ACCEL_EMUL
+
+static int accel_reg_write(struct accel_sensor *sensor, uint8_t reg, uint8_t value)
+{
+    return accel_emul_reg_write(sensor - sensors, reg, value);
+}
+
+static int accel_reg_read(struct accel_sensor *sensor, uint8_t reg, uint8_t *data, uint32_t len)
+{
+    int result = 0;
+    uint32_t start = prof_start();
+
+    result = accel_emul_reg_read(sensor - sensors, reg, data, len);
+
+    prof_stop(PROF_SENSOR_READ, start);
+
+    return result;
+}
+
+#else
+
+#ifdef CONFIG_MOCAP_ACCEL_MUX
+static uint8_t mux_channel = UINT8_MAX;
+
+/* Route the bus to the channel of the sensor, if not there already */
+static int accel_mux_select(const struct accel_sensor *sensor)
+{
+    int result = 0;
+    uint8_t mask = BIT(sensor->channel);
+
+    if(sensor->channel == mux_channel)
+    {
+        return 0;
+    }
+
+    result = i2c_write(i2c_device, &mask, sizeof(mask), MUX_ADDRESS);
+
+    mux_channel = (result == 0) ? sensor->channel : UINT8_MAX;
+
+    return result;
+}
+#else
+static int accel_mux_select(const struct accel_sensor *sensor)
+{
+    return 0;
+}
+#endif
+
+static int accel_reg_write(struct accel_sensor *sensor, uint8_t reg, uint8_t value)
+{
+    int result = accel_mux_select(sensor);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    return i2c_reg_write_byte(i2c_device, sensor->address, reg, value);
+}
+
+static int accel_reg_read(struct accel_sensor *sensor, uint8_t reg, uint8_t *data, uint32_t len)
+{
+    int result = 0;
+    uint32_t start = prof_start();
+
+    result = accel_mux_select(sensor);
+    if(result == 0)
+    {
+        result = i2c_burst_read(i2c_device, sensor->address, reg, data, len);
+    }
+
+    prof_stop(PROF_SENSOR_READ, start);
+
+    return result;
+}
+
+#endif /* CONFIG_MOCAP_ACCEL_EMUL */
+
+/* Same register value on every sensor */
+static int accel_reg_write_all(uint8_t reg, uint8_t value)
+{
+    int result = 0;
+
+    for(int i = 0; i < ACCEL_SENSOR_COUNT; i++)
+    {
+        result = accel_reg_write(&sensors[i], reg, value);
+        if(result != 0)
+        {
+            LOG_ERR("Sensor %d register 0x%02x write - fail. Result %d", i, reg, result);
+
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef CONFIG_MOCAP_OVERRUN_DEGRADE_RATE
+/* Halve the output rate, at most once per holdoff period */
+static void accel_rate_degrade(void)
+{
+    int result = 0;
+
+    if(sample_rate_divider > UINT8_MAX / 2 ||
+       k_uptime_get_32() - degrade_timestamp < DEGRADE_HOLDOFF_MS)
+    {
+        return;
+    }
+
+    sample_rate_divider = sample_rate_divider * 2 + 1;
+    degrade_timestamp = k_uptime_get_32();
+
+    result = accel_sample_rate_set();
+    __ASSERT(result == 0, "Failed to set accel sample rate. Result %d", result);
+
+    LOG_WRN("Overrun, sample rate degraded to %d Hz", accel_sample_rate_get());
+}
+#endif
+
+/* Make room for the next sample of all sensors according to the overrun
+ * policy. False means the sample has to be dropped. */
+static bool accel_sample_reserve(void)
+{
+    if(ring_space_get(&accel_ring) >= ACCEL_SENSOR_COUNT)
+    {
+        return true;
+    }
+
+#if defined(CONFIG_MOCAP_OVERRUN_DROP_OLDEST)
+    if(ring_drop_oldest(&accel_ring) == true)
+    {
+        lost_total++;
+
+        return true;
+    }
+#elif defined(CONFIG_MOCAP_OVERRUN_DEGRADE_RATE)
+    accel_rate_degrade();
+#endif
+
+    lost_pending++;
+    lost_total++;
+
+    return false;
+}
+
+/* Undo a rate degraded during the previous record */
+static int accel_rate_restore(void)
+{
+    if(sample_rate_divider == config.divider)
+    {
+        return 0;
+    }
+
+    sample_rate_divider = config.divider;
+
+    return accel_sample_rate_set();
+}
+
+/* Sensor registers are big endian, gyro follows accel at gyro_offset words */
+static void accel_entry_fill(struct accel_entry *entry, const uint8_t *data, int gyro_offset)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        entry->accel[i] = sys_get_be16(&data[i * 2]);
+        entry->gyro[i]  = sys_get_be16(&data[(gyro_offset + i) * 2]);
+    }
+}
+
+/* Time since the previous stored sample, in delta units. Samples dropped in
+ * between are covered, since the time is absolute. */
+static uint16_t accel_delta_get(uint64_t time_us)
+{
+    uint16_t delta = 0;
+
+    if(count == 0)
+    {
+        start_us = time_us;
+        last_us = time_us;
+
+        return 0;
+    }
+
+    if(time_us <= last_us)
+    {
+        /* Never step back, the next sample makes up for it */
+        return 0;
+    }
+
+    /* The remainder is carried on, so the sum of the deltas never drifts */
+    delta = MIN(MIN(time_us - last_us, UINT32_MAX) / tick_us, UINT16_MAX);
+    last_us += (uint64_t)delta * tick_us;
 
-void accel_timer_handler(struct k_timer *timer_id);
+    return delta;
+}
+
+/* Decode straight into the ring, after accel_sample_reserve(). The first
+ * sensor carries the time delta and the loss count for the whole sample. */
+static void accel_entry_put(int sensor, uint16_t delta, const uint8_t *data, int gyro_offset)
+{
+    struct accel_entry *entry = ring_reserve(&accel_ring, K_NO_WAIT);
+
+    entry->delta = (sensor == 0) ? delta : 0;
+
+    accel_entry_fill(entry, data, gyro_offset);
+
+    ring_commit(&accel_ring, (sensor == 0) ? MIN(lost_pending, UINT16_MAX) : 0);
+}
+
+static void accel_sample_commit(void)
+{
+    lost_pending = 0;
+    count++;
+}
+
+#ifdef CONFIG_MOCAP_ACCEL_FIFO
+
+static void accel_fifo_entry(void *p1, void *p2, void *p3);
 
-K_MSGQ_DEFINE(accel_queue, sizeof(struct accel_entry), QUEUE_SIZE, 4);
-K_TIMER_DEFINE(accel_timer, accel_timer_handler, NULL);
+#ifdef CONFIG_MOCAP_PROFILE
+static uint32_t timer_cycles = 0;
+
+static void accel_timer_expired(struct k_timer *timer)
+{
+    timer_cycles = prof_start();
+}
+
+K_TIMER_DEFINE(accel_timer, accel_timer_expired, NULL);
+#else
+K_TIMER_DEFINE(accel_timer, NULL, NULL);
+#endif
+K_SEM_DEFINE(accel_fifo_start, 0, 1);
+K_SEM_DEFINE(accel_fifo_stopped, 0, 1);
+K_THREAD_DEFINE(accel_fifo, FIFO_STACK_SIZE, accel_fifo_entry, NULL, NULL, NULL,
+                FIFO_PRIORITY, 0, 0);
+
+/* One burst per sensor, sensor by sensor */
+static uint8_t fifo_buf[ACCEL_SENSOR_COUNT * SENSOR_BURST_FRAMES * FIFO_FRAME_SIZE];
+
+/* The FIFO holds no timestamps and the sensor clock is off by up to a few
+ * percent. Frame n of the first sensor since the fit origin is timed at
+ * origin + n * period, with the period fitted against the device clock. */
+static uint64_t fit_origin_us = 0;
+static uint32_t fit_frames = 0;     // First sensor frames taken since the origin
+static uint32_t fit_period_us = 0;  // Nominal period the fit started from
+static uint32_t period_q8 = 0;      // Fitted period in 1/256 us
+
+/* Wake up about once per burst worth of frames, but not so rarely
+ * that live preview latency suffers at low rates */
+static k_timeout_t accel_fifo_period(void)
+{
+    uint32_t period_ms = accel_sample_period_us() * SENSOR_BURST_FRAMES / USEC_PER_MSEC;
+
+    return K_MSEC(CLAMP(period_ms, FIFO_PERIOD_MIN_MS, FIFO_PERIOD_MAX_MS));
+}
+
+static uint64_t accel_frame_time(void)
+{
+    return fit_origin_us + (((uint64_t)fit_frames * period_q8) >> 8);
+}
+
+static void accel_fit_reset(uint64_t origin_us)
+{
+    fit_origin_us = origin_us;
+    fit_frames = 0;
+    fit_period_us = accel_sample_period_us();
+    period_q8 = fit_period_us << 8;
+}
+
+/* The newest frame in the FIFO was made within a period before its count
+ * read, about half a period before on average. Over a long span that
+ * uncertainty hardly matters. */
+static void accel_fit_update(void)
+{
+    const struct accel_sensor *first = &sensors[0];
+    uint32_t produced = fit_frames + first->pending;
+    uint64_t span = timesync_cycles_to_us(first->count_cycles) - fit_origin_us;
+
+    /* Rate degraded, frames from here on come at the new period */
+    if(fit_period_us != accel_sample_period_us())
+    {
+        accel_fit_reset(accel_frame_time());
+
+        return;
+    }
+
+    if(span < PERIOD_FIT_MIN_US || produced == 0)
+    {
+        return;
+    }
+
+    period_q8 = ((span << 8) - period_q8 / 2) / produced;
+}
+
+/* Every step is done on all sensors before the next one, so their
+ * FIFOs start filling within a few transfers of each other */
+static int accel_fifo_enable(void)
+{
+    int result = 0;
+
+    /* Reset drops anything left over from a previous record */
+    result = accel_reg_write_all(USER_CTRL_REG_ADDR, USER_CTRL_FIFO_RESET);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    result = accel_reg_write_all(FIFO_EN_REG_ADDR, FIFO_EN_ACCEL | FIFO_EN_GYRO);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    return accel_reg_write_all(USER_CTRL_REG_ADDR, USER_CTRL_FIFO_EN);
+}
+
+static int accel_fifo_disable(void)
+{
+    int result = 0;
+
+    result = accel_reg_write_all(FIFO_EN_REG_ADDR, 0);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    return accel_reg_write_all(USER_CTRL_REG_ADDR, USER_CTRL_FIFO_RESET);
+}
+
+/* Frame index of a burst, from every sensor, makes one sample */
+static void accel_fifo_sample_process(int index, uint16_t burst)
+{
+    uint16_t delta = 0;
+
+    /* Dropped frames still take their time */
+    fit_frames++;
+
+    if(accel_sample_reserve() == false)
+    {
+        return;
+    }
+
+    delta = accel_delta_get(accel_frame_time());
+
+    for(int i = 0; i < ACCEL_SENSOR_COUNT; i++)
+    {
+        accel_entry_put(i, delta, &fifo_buf[(i * burst + index) * FIFO_FRAME_SIZE],
+                        FIFO_GYRO_OFFSET / 2);
+    }
+
+    accel_sample_commit();
+}
+
+/* Frame k of every sensor goes into the same sample. Each sensor runs on its
+ * own clock, so the time between its frame and the one of the first sensor is
+ * the time between the count reads, less its extra pending frames. A sensor
+ * with frames to spare over the slowest one is running ahead, its surplus
+ * is dropped once it is more than the jitter of the count reads. */
+static void accel_fifo_align(uint16_t frames)
+{
+    int result = 0;
+    int32_t skew = 0;
+    uint16_t surplus = 0;
+    uint32_t period = accel_sample_period_us();
+    struct accel_sensor *first = &sensors[0];
+
+    for(int i = 0; i < ACCEL_SENSOR_COUNT; i++)
+    {
+        struct accel_sensor *sensor = &sensors[i];
+
+        skew = (int32_t)k_cyc_to_us_floor32(sensor->count_cycles - first->count_cycles) -
+               ((int32_t)sensor->pending - first->pending) * (int32_t)period;
+
+        sensor->stats.skew_us = skew;
+        sensor->stats.skew_max_us = MAX(sensor->stats.skew_max_us,
+                                        (uint32_t)(skew < 0 ? -skew : skew));
+
+        surplus = sensor->pending - frames;
+        if(surplus < SKEW_REALIGN_FRAMES)
+        {
+            continue;
+        }
+
+        surplus = MIN(surplus - 1, SENSOR_BURST_FRAMES);
+
+        result = accel_reg_read(sensor, FIFO_DATA_REG_ADDR, fifo_buf, surplus * FIFO_FRAME_SIZE);
+        if(result != 0)
+        {
+            LOG_ERR("Sensor %d realign - fail. Result %d", i, result);
+
+            continue;
+        }
+
+        sensor->stats.realigned += surplus;
+
+        if(i == 0)
+        {
+            fit_frames += surplus;
+        }
+    }
+}
+
+/* Read the FIFO counts of all sensors back to back, as close as possible
+ * to one shared point in time. Returns the frames every sensor has. */
+static int accel_fifo_count(uint16_t *frames)
+{
+    int result = 0;
+    uint8_t raw_count[2];
+
+    *frames = UINT16_MAX;
+
+    for(int i = 0; i < ACCEL_SENSOR_COUNT; i++)
+    {
+        struct accel_sensor *sensor = &sensors[i];
+
+        result = accel_reg_read(sensor, FIFO_COUNT_REG_ADDR, raw_count, sizeof(raw_count));
+        if(result != 0)
+        {
+            LOG_ERR("Sensor %d FIFO count read - fail. Result %d", i, result);
+
+            return result;
+        }
+
+        sensor->count_cycles = k_cycle_get_32();
+
+        if(sys_get_be16(raw_count) >= FIFO_SIZE)
+        {
+            LOG_ERR("Sensor %d FIFO overflow", i);
+
+            return -EOVERFLOW;
+        }
+
+        sensor->pending = sys_get_be16(raw_count) / FIFO_FRAME_SIZE;
+        *frames = MIN(*frames, sensor->pending);
+    }
+
+    return 0;
+}
+
+static void accel_fifo_drain(void)
+{
+    int result = 0;
+    uint16_t frames = 0;
+    uint16_t burst = 0;
+
+    result = accel_fifo_count(&frames);
+    if(result == -EOVERFLOW)
+    {
+        /* Frame boundaries are lost on overflow, so start all sensors over.
+         * At least a full FIFO worth of samples is gone. */
+        lost_pending += FIFO_SIZE / FIFO_FRAME_SIZE;
+        lost_total += FIFO_SIZE / FIFO_FRAME_SIZE;
+
+        result = accel_fifo_enable();
+        __ASSERT(result == 0, "FIFO reset - fail. Result %d", result);
+
+        accel_fit_reset(timesync_now_us());
+
+        return;
+    }
+    else if(result != 0)
+    {
+        return;
+    }
+
+    accel_fit_update();
+
+    if(ACCEL_SENSOR_COUNT > 1)
+    {
+        accel_fifo_align(frames);
+    }
+
+    while(frames > 0)
+    {
+        uint32_t start = 0;
+
+        burst = MIN(frames, SENSOR_BURST_FRAMES);
+
+        for(int i = 0; i < ACCEL_SENSOR_COUNT; i++)
+        {
+            result = accel_reg_read(&sensors[i], FIFO_DATA_REG_ADDR,
+                                    &fifo_buf[i * burst * FIFO_FRAME_SIZE],
+                                    burst * FIFO_FRAME_SIZE);
+            if(result != 0)
+            {
+                LOG_ERR("Sensor %d FIFO data read - fail. Result %d", i, result);
+
+                return;
+            }
+        }
+
+        start = prof_start();
+
+        for(int i = 0; i < burst; i++)
+        {
+            accel_fifo_sample_process(i, burst);
+        }
+
+        prof_stop(PROF_BURST, start);
+
+        frames -= burst;
+    }
+}
+
+static void accel_fifo_entry(void *p1, void *p2, void *p3)
+{
+    int result = 0;
+
+    while(true)
+    {
+        k_sem_take(&accel_fifo_start, K_FOREVER);
+
+        while(is_running == true)
+        {
+            k_timer_status_sync(&accel_timer);
+
+#ifdef CONFIG_MOCAP_PROFILE
+            prof_stop(PROF_WAKE, timer_cycles);
+#endif
+
+            accel_fifo_drain();
+        }
+
+        k_timer_stop(&accel_timer);
+
+        result = accel_fifo_disable();
+        __ASSERT(result == 0, "FIFO disable - fail. Result %d", result);
+
+        LOG_INF("Stop");
+
+        k_sem_give(&accel_fifo_stopped);
+    }
+}
+
+int accel_record_start(void)
+{
+    int result     = 0;
+    is_running     = true;
+    count          = 0;
+    lost_pending   = 0;
+    lost_total     = 0;
+
+    for(int i = 0; i < ACCEL_SENSOR_COUNT; i++)
+    {
+        memset(&sensors[i].stats, 0, sizeof(sensors[i].stats));
+    }
+
+    result = accel_rate_restore();
+    if(result != 0)
+    {
+        LOG_ERR("Sample rate restore - fail. Result %d", result);
+
+        return result;
+    }
+
+    result = accel_fifo_enable();
+    if(result != 0)
+    {
+        LOG_ERR("FIFO enable - fail. Result %d", result);
+
+        return result;
+    }
+
+    accel_fit_reset(timesync_now_us());
+
+    ring_reset(&accel_ring);
+    k_timer_start(&accel_timer, accel_fifo_period(), accel_fifo_period());
+    k_sem_give(&accel_fifo_start);
+
+    return result;
+}
+
+/* Returns once the last FIFO burst is in the queue */
+int accel_record_stop(void)
+{
+    is_running = false;
+
+    return k_sem_take(&accel_fifo_stopped, K_FOREVER);
+}
+
+#else
+
+/* The driver only hands data ready over to its thread. This runs
+ * next to its own callback, in the interrupt itself. */
+static struct gpio_callback int_callback;
+static volatile uint32_t int_cycles = 0;
+
+static void accel_int_isr(const struct device *port, struct gpio_callback *cb,
+                          gpio_port_pins_t pins)
+{
+    int_cycles = k_cycle_get_32();
+}
 
 static void accel_trigger_handler(const struct device *dev,
                 struct sensor_trigger *trig)
 {
-    struct accel_entry entry;
+    uint8_t data[DATA_SIZE];
+    uint16_t delta = 0;
+    uint32_t start = 0;
 
     int result = 0;
 
-    /* Get timestamp */
-    entry.timestamp = k_uptime_get_32() - base_timestamp;
+    if(accel_sample_reserve() == false)
+    {
+        goto exit;
+    }
 
-    /* Fetch accelerometr data */
-    result = sensor_sample_fetch(accle_device);
-    __ASSERT(result == 0, "Sensor sample fetch - fail. Result %d", result);
+    delta = accel_delta_get(timesync_cycles_to_us(int_cycles));
 
-    /* Get acceleromiter data */
-    result = sensor_channel_get(accle_device, SENSOR_CHAN_ACCEL_XYZ, entry.accel);
-    __ASSERT(result == 0, "Sensor accel XYZ channel get - fail. Result %d", result);
-    
-    /* Get gyroscope data */
-    result = sensor_channel_get(accle_device, SENSOR_CHAN_GYRO_XYZ, entry.gyro);
-    __ASSERT(result == 0, "Sensor gyro XYZ channel get - fail. Result %d", result);
+    /* Read raw accelerometer, temperature and gyroscope registers at once */
+    result = accel_reg_read(&sensors[0], DATA_REG_ADDR, data, sizeof(data));
+    __ASSERT(result == 0, "Sensor data read - fail. Result %d", result);
 
-    /* Put data to queue */
-    result = k_msgq_put(&accel_queue, &entry, QUEUE_TIMEOUT);
-    __ASSERT(result == 0, "Add data to queue - fail. Result %d", result);
+    start = prof_start();
 
-    count++;
+    /* Publish to the consumer */
+    accel_entry_put(0, delta, data, DATA_GYRO_OFFSET / 2);
+    accel_sample_commit();
 
+    prof_stop(PROF_BURST, start);
+
+exit:
     if (is_running != true) 
     {
         LOG_INF("Stop");
@@ -73,14 +806,25 @@ int accel_record_start(void)
 {
     int result     = 0;
     is_running     = true;
-    base_timestamp = k_uptime_get_32();
     count          = 0;
+    lost_pending   = 0;
+    lost_total     = 0;
 
     static const struct sensor_trigger trigger = {
         .type = SENSOR_TRIG_DATA_READY,
         .chan = SENSOR_CHAN_ALL,
     };
 
+    ring_reset(&accel_ring);
+
+    result = accel_rate_restore();
+    if(result != 0)
+    {
+        LOG_ERR("Sample rate restore - fail. Result %d", result);
+
+        return result;
+    }
+
     result = sensor_trigger_set(accle_device, (struct sensor_trigger *) &trigger, accel_trigger_handler);
     if(result != 0)
     {
@@ -99,47 +843,193 @@ int accel_record_stop(void)
     return 0;
 }
 
-struct k_msgq *accel_queue_get(void)
+#endif /* CONFIG_MOCAP_ACCEL_FIFO */
+
+struct ring *accel_ring_get(void)
 {
-    return &accel_queue;
+    return &accel_ring;
 }
 
-uint16_t accel_count_get(void)
+uint32_t accel_count_get(void)
 {
     return count;
 }
 
+/* Device time of the first sample, the time base of all deltas */
+uint64_t accel_start_time_get(void)
+{
+    return start_us;
+}
+
+int accel_sensor_stats_get(uint8_t sensor, struct accel_sensor_stats *stats)
+{
+    if(sensor >= ACCEL_SENSOR_COUNT)
+    {
+        return -EINVAL;
+    }
+
+    *stats = sensors[sensor].stats;
+
+    return 0;
+}
+
+uint32_t accel_lost_get(void)
+{
+    return lost_total;
+}
+
+/* Sensor period a take starts at, before any degrading */
+uint32_t accel_period_us_get(void)
+{
+    return accel_period_us(config.divider);
+}
+
+uint16_t accel_tick_us_get(void)
+{
+    return tick_us;
+}
+
+uint16_t accel_sample_rate_get(void)
+{
+    return USEC_PER_SEC / accel_sample_period_us();
+}
+
 bool accel_is_running(void)
 {
     return is_running;
 }
 
-int accel_sample_rate_set(const struct device *i2c)
+int accel_sample_rate_set(void)
 {
-    /* Switch on Digital Low-Pass filter (DLPF) to decrease sample rate to 1kHz */
+    int result = 0;
+
     /* Set sample rate devider */
-    uint8_t data[] = { SAMPLE_RATE_REG_ADDR, SAMPLE_RATE_DEVIDER, DLPF_VALUE };
-	struct i2c_msg message = {0};
+    result = accel_reg_write_all(SAMPLE_RATE_REG_ADDR, sample_rate_divider);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    /* Switch on Digital Low-Pass filter (DLPF) to decrease sample rate to 1kHz */
+    return accel_reg_write_all(CONFIG_REG_ADDR, config.dlpf);
+}
+
+static int accel_config_apply(void)
+{
+    int result = 0;
 
-    message.buf   = data;
-	message.len   = sizeof(data);
-	message.flags = I2C_MSG_WRITE | I2C_MSG_STOP;
+    sample_rate_divider = config.divider;
+    accel_tick_update();
+
+    result = accel_sample_rate_set();
+    if(result != 0)
+    {
+        return result;
+    }
+
+    result = accel_reg_write_all(GYRO_CONFIG_REG_ADDR, config.gyro_fs << FS_SEL_SHIFT);
+    if(result != 0)
+    {
+        return result;
+    }
 
-    return i2c_transfer(i2c, &message, 1, I2C_ACCEL_ADDRESS);
+    return accel_reg_write_all(ACCEL_CONFIG_REG_ADDR, config.accel_fs << FS_SEL_SHIFT);
+}
+
+int accel_config_set(const struct accel_config *new_config)
+{
+    int result = 0;
+
+    if(is_running == true)
+    {
+        LOG_ERR("Config change while recording");
+
+        return -EBUSY;
+    }
+
+    if(new_config->dlpf > 7 || new_config->accel_fs > FS_SEL_MAX ||
+       new_config->gyro_fs > FS_SEL_MAX)
+    {
+        return -EINVAL;
+    }
+
+    config = *new_config;
+
+    result = accel_config_apply();
+    if(result != 0)
+    {
+        LOG_ERR("Config apply - fail. Result %d", result);
+
+        return result;
+    }
+
+    LOG_INF("Rate %d Hz, DLPF %d, ranges %d g %d dps, decimation %d", accel_sample_rate_get(),
+            config.dlpf, 2 << config.accel_fs, 250 << config.gyro_fs, config.decimation);
+
+    return result;
+}
+
+void accel_config_get(struct accel_config *out)
+{
+    *out = config;
+}
+
+void accel_header_get(struct record_header *header)
+{
+    header->magic       = RECORD_MAGIC;
+    header->version     = RECORD_VERSION;
+    header->header_size = sizeof(struct record_header);
+    header->entry_size  = sizeof(struct accel_entry);
+    header->sample_rate = accel_sample_rate_get() / config.decimation;
+    header->accel_range = 2 << config.accel_fs;
+    header->gyro_range  = 250 << config.gyro_fs;
+    header->tick_us     = tick_us;
+    header->dlpf        = config.dlpf;
+    header->divider     = sample_rate_divider;
+    header->sensors     = ACCEL_SENSOR_COUNT;
+    header->decimation  = config.decimation;
 }
 
 void accel_init(void)
 {
     int result = 0;
 
+#ifndef CONFIG_MOCAP_ACCEL_EMUL
+#ifndef CONFIG_MOCAP_ACCEL_FIFO
+    const struct device *int_device = NULL;
+
     accle_device = device_get_binding(ACCEL);
     __ASSERT(accle_device != NULL, "Failed to find %s", ACCEL);
 
+    int_device = device_get_binding(ACCEL_INT_GPIO);
+    __ASSERT(int_device != NULL, "Failed to find %s", ACCEL_INT_GPIO);
+
+    gpio_init_callback(&int_callback, accel_int_isr, BIT(ACCEL_INT_PIN));
+
+    result = gpio_add_callback(int_device, &int_callback);
+    __ASSERT(result == 0, "Failed to add data ready callback. Result %d", result);
+#endif
+
     i2c_device = device_get_binding(I2C);
-    __ASSERT(accle_device != NULL, "Failed to find %s", I2C);
+    __ASSERT(i2c_device != NULL, "Failed to find %s", I2C);
+#endif
 
-    result = accel_sample_rate_set(i2c_device);
-    __ASSERT(result == 0, "Failed to set accel sample rate. Result %d", result);
+#if defined(CONFIG_MOCAP_ACCEL_MUX) || defined(CONFIG_MOCAP_ACCEL_EMUL)
+    for(int i = 0; i < ACCEL_SENSOR_COUNT; i++)
+    {
+        sensors[i].address = I2C_ACCEL_ADDRESS + (i & 1);
+        sensors[i].channel = i / 2;
+    }
+#endif
+
+    ring_init(&accel_ring, ring_buf, ring_lost, RING_SIZE);
+
+    /* Sensors other than the first devicetree one are not woken up by the driver */
+    result = accel_reg_write_all(PWR_MGMT_1_REG_ADDR, PWR_MGMT_1_CLK_PLL);
+    __ASSERT(result == 0, "Failed to wake up sensors. Result %d", result);
+
+    result = accel_config_apply();
+    __ASSERT(result == 0, "Failed to set accel config. Result %d", result);
     
-    LOG_INF("Inited successfully");
+    LOG_INF("Inited successfully, %d sensors", ACCEL_SENSOR_COUNT);
 }
\ No newline at end of file
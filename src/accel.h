@@ -3,18 +3,62 @@
 
 #include <drivers/sensor.h>
 
+#include "record.h"
+
+struct ring;
+
+/* Sensors sampled together. A mux or the emulation take the count from
+ * Kconfig, otherwise every MPU6050 in the devicetree is used. Without the
+ * FIFO there is only the triggered sensor. */
+#if defined(CONFIG_MOCAP_ACCEL_MUX) || defined(CONFIG_MOCAP_ACCEL_EMUL)
+#define ACCEL_SENSOR_COUNT CONFIG_MOCAP_ACCEL_COUNT
+#elif defined(CONFIG_MOCAP_ACCEL_FIFO)
+#define ACCEL_SENSOR_COUNT DT_NUM_INST_STATUS_OKAY(invensense_mpu6050)
+#else
+#define ACCEL_SENSOR_COUNT 1
+#endif
+
+/* Raw sensor output, scaled by the ranges in record_header */
 struct accel_entry
 {
-    uint32_t timestamp;
-    struct sensor_value accel[3];
-    struct sensor_value gyro[3];    
+    uint16_t delta; // Time since previous sample, in record_header.tick_us
+    int16_t accel[3];
+    int16_t gyro[3];
+};
+
+/* Alignment of one sensor against the first one. Sensors run on their own
+ * clocks, so the faster ones build up extra frames that are dropped. */
+struct accel_sensor_stats
+{
+    int32_t skew_us;      // Estimated sample time offset at the last drain
+    uint32_t skew_max_us; // Largest offset seen, either way
+    uint32_t realigned;   // Frames dropped to stay in step
+};
+
+/* Output data rate, filter and ranges, changed between records only */
+struct accel_config
+{
+    uint8_t divider;  // Output rate = internal rate / (1 + divider)
+    uint8_t dlpf;     // DLPF_CFG, 0 and 7 switch the internal rate to 8kHz
+    uint8_t accel_fs; // Accel full scale is 2 << accel_fs g
+    uint8_t gyro_fs;  // Gyro full scale is 250 << gyro_fs deg/s
+    uint8_t decimation; // Stored rate = output rate / decimation, 1, 2, 4 or 8
 };
 
 void accel_init(void);
+int accel_config_set(const struct accel_config *config);
+void accel_config_get(struct accel_config *config);
+void accel_header_get(struct record_header *header);
 int accel_record_start(void);
 int accel_record_stop(void);
-struct k_msgq *accel_queue_get(void);
-uint16_t accel_count_get(void);
+struct ring *accel_ring_get(void);
+uint32_t accel_count_get(void);
+uint64_t accel_start_time_get(void);
+int accel_sensor_stats_get(uint8_t sensor, struct accel_sensor_stats *stats);
+uint32_t accel_lost_get(void);
+uint16_t accel_sample_rate_get(void);
+uint16_t accel_tick_us_get(void);
+uint32_t accel_period_us_get(void);
 bool accel_is_running(void);
 
 #endif
\ No newline at end of file
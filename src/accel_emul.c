@@ -0,0 +1,170 @@
+#include <zephyr.h>
+#include <logging/log.h>
+#include <sys/byteorder.h>
+
+#include "accel.h"
+#include "accel_emul.h"
+
+LOG_MODULE_REGISTER(accel_emul);
+
+#define SAMPLE_RATE_REG_ADDR 0x19
+#define CONFIG_REG_ADDR      0x1A
+#define GYRO_CONFIG_REG_ADDR 0x1B
+#define ACCEL_CONFIG_REG_ADDR 0x1C
+#define FIFO_EN_REG_ADDR     0x23
+#define USER_CTRL_REG_ADDR   0x6A
+#define USER_CTRL_FIFO_EN    0x40
+#define USER_CTRL_FIFO_RESET 0x04
+#define FIFO_COUNT_REG_ADDR  0x72
+#define FIFO_DATA_REG_ADDR   0x74
+#define PWR_MGMT_1_REG_ADDR  0x6B
+#define FIFO_SIZE            1024
+#define FIFO_FRAME_SIZE      12
+#define WAVE_PERIOD          512  // Samples per synthetic motion cycle
+#define WAVE_AMPLITUDE       8192
+#define NOISE_MASK           0x3F
+#define CLOCK_DRIFT_PPM      300  // Each further sensor runs this much faster
+
+struct accel_emul
+{
+    uint8_t sample_rate_divider;
+    uint8_t dlpf;
+    bool fifo_enabled;
+    uint32_t last_cycles;
+    uint64_t elapsed_cycles;
+    uint64_t frames_read; // Frames handed out or discarded, since FIFO enable
+};
+
+static struct accel_emul sensors[ACCEL_SENSOR_COUNT];
+static uint32_t noise = 1;
+
+static uint32_t accel_emul_period_us(const struct accel_emul *emul)
+{
+    if(emul->dlpf == 0 || emul->dlpf == 7)
+    {
+        return (emul->sample_rate_divider + 1) * 125;
+    }
+
+    return (emul->sample_rate_divider + 1) * 1000;
+}
+
+/* Frames the sensor would have produced since the FIFO was enabled. Every
+ * sensor has its own clock error, like the internal oscillators of the real part. */
+static uint64_t accel_emul_frames_total(struct accel_emul *emul)
+{
+    uint32_t cycles = k_cycle_get_32();
+    uint32_t rate = USEC_PER_SEC + (emul - sensors) * CLOCK_DRIFT_PPM; // ppm of nominal
+
+    emul->elapsed_cycles += cycles - emul->last_cycles;
+    emul->last_cycles = cycles;
+
+    return k_cyc_to_us_floor64(emul->elapsed_cycles) * rate /
+           ((uint64_t)accel_emul_period_us(emul) * USEC_PER_SEC);
+}
+
+static int16_t accel_emul_wave(uint64_t frame, uint32_t phase)
+{
+    /* Triangle wave plus a little noise, close enough to limb motion */
+    int32_t pos = (frame + phase) % WAVE_PERIOD;
+    int32_t value = (pos < WAVE_PERIOD / 2) ? pos : WAVE_PERIOD - pos;
+
+    noise = noise * 1103515245 + 12345;
+
+    return (value * 4 * WAVE_AMPLITUDE) / WAVE_PERIOD - WAVE_AMPLITUDE +
+           (int32_t)((noise >> 16) & NOISE_MASK) - NOISE_MASK / 2;
+}
+
+/* Sensors see the same motion, each a little further along */
+static void accel_emul_frame_fill(uint8_t *frame, uint64_t index, uint8_t sensor)
+{
+    for(int axis = 0; axis < FIFO_FRAME_SIZE / 2; axis++)
+    {
+        sys_put_be16(accel_emul_wave(index + sensor * WAVE_PERIOD / 16, axis * WAVE_PERIOD / 6),
+                     &frame[axis * 2]);
+    }
+}
+
+static void accel_emul_fifo_reset(struct accel_emul *emul)
+{
+    emul->last_cycles = k_cycle_get_32();
+    emul->elapsed_cycles = 0;
+    emul->frames_read = 0;
+}
+
+int accel_emul_reg_write(uint8_t sensor, uint8_t reg, uint8_t value)
+{
+    struct accel_emul *emul = &sensors[sensor];
+
+    switch(reg)
+    {
+        case SAMPLE_RATE_REG_ADDR:
+            emul->sample_rate_divider = value;
+        break;
+
+        case CONFIG_REG_ADDR:
+            emul->dlpf = value & 0x07;
+        break;
+
+        case GYRO_CONFIG_REG_ADDR:
+        case ACCEL_CONFIG_REG_ADDR:
+        case FIFO_EN_REG_ADDR:
+        case PWR_MGMT_1_REG_ADDR:
+        break;
+
+        case USER_CTRL_REG_ADDR:
+            if(value & USER_CTRL_FIFO_RESET)
+            {
+                accel_emul_fifo_reset(emul);
+            }
+
+            emul->fifo_enabled = (value & USER_CTRL_FIFO_EN) != 0;
+        break;
+
+        default:
+            LOG_ERR("Unsupported register write 0x%02x", reg);
+
+            return -ENOTSUP;
+    }
+
+    return 0;
+}
+
+int accel_emul_reg_read(uint8_t sensor, uint8_t reg, uint8_t *data, uint32_t len)
+{
+    struct accel_emul *emul = &sensors[sensor];
+    uint64_t total = 0;
+    uint32_t pending = 0;
+
+    switch(reg)
+    {
+        case FIFO_COUNT_REG_ADDR:
+            if(len != 2)
+            {
+                return -EINVAL;
+            }
+
+            if(emul->fifo_enabled == true)
+            {
+                total = accel_emul_frames_total(emul);
+                pending = MIN(total - emul->frames_read, FIFO_SIZE / FIFO_FRAME_SIZE + 1);
+            }
+
+            /* Like the real part, the count saturates once the FIFO overflows */
+            sys_put_be16(MIN(pending * FIFO_FRAME_SIZE, FIFO_SIZE), data);
+        break;
+
+        case FIFO_DATA_REG_ADDR:
+            for(uint32_t i = 0; i < len / FIFO_FRAME_SIZE; i++)
+            {
+                accel_emul_frame_fill(&data[i * FIFO_FRAME_SIZE], emul->frames_read++, sensor);
+            }
+        break;
+
+        default:
+            LOG_ERR("Unsupported register read 0x%02x", reg);
+
+            return -ENOTSUP;
+    }
+
+    return 0;
+}
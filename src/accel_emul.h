@@ -0,0 +1,12 @@
+#ifndef ACCEL_EMUL_H
+#define ACCEL_EMUL_H
+
+#include <stdint.h>
+
+/* Register-level MPU6050 stand-in for boards without the sensor. It fills
+ * an emulated FIFO with synthetic frames at the programmed output rate,
+ * for each of the ACCEL_SENSOR_COUNT sensors. */
+int accel_emul_reg_write(uint8_t sensor, uint8_t reg, uint8_t value);
+int accel_emul_reg_read(uint8_t sensor, uint8_t reg, uint8_t *data, uint32_t len);
+
+#endif
@@ -0,0 +1,289 @@
+#include <zephyr.h>
+#include <logging/log.h>
+#include <stdio.h>
+
+#include "accel.h"
+#include "disk_emul.h"
+#include "manager.h"
+#include "ring.h"
+#include "storage.h"
+#include "prof.h"
+
+#ifdef CONFIG_ARCH_POSIX
+#include <posix_board_if.h>
+#endif
+
+LOG_MODULE_REGISTER(bench);
+
+#define BENCH_STACK_SIZE  1024
+#define BENCH_PRIORITY    3
+#define BENCH_START_DELAY 500 // Let the manager thread finish its init
+#define BENCH_DURATION    K_SECONDS(CONFIG_MOCAP_BENCH_DURATION)
+#define BENCH_READ_SIZE   244         // A notification at the largest MTU
+#define BENCH_READ_IDLE   K_MSEC(100) // Caught up, wait for the next checkpoint
+#define BENCH_RATE_MARGIN 2           // % the sample count may miss the nominal rate by
+#define BENCH_CRC_CHUNK   16
+
+static void bench_entry(void *p1, void *p2, void *p3);
+
+#ifdef CONFIG_MOCAP_PROFILE
+static const char *const stage_names[PROF_STAGE_COUNT] = {
+    [PROF_WAKE]          = "wake",
+    [PROF_SENSOR_READ]   = "sensor read",
+    [PROF_BURST]         = "burst",
+    [PROF_DECIM]         = "decimation",
+    [PROF_CODEC]         = "codec",
+    [PROF_SUMMARY]       = "summary",
+    [PROF_FUSION]        = "fusion",
+    [PROF_STREAM]        = "stream",
+    [PROF_STORAGE_WRITE] = "storage write",
+    [PROF_STORAGE_FLUSH] = "storage flush",
+    [PROF_STORAGE_CRC]   = "storage crc",
+    [PROF_LED]           = "led",
+};
+
+static void bench_profile_print(void)
+{
+    struct prof_stats stats = {0};
+
+    for(int i = 0; i < PROF_STAGE_COUNT; i++)
+    {
+        prof_get(i, &stats);
+
+        printf("bench: %-13s calls %u, min/mean/max %u/%u/%u ns\n", stage_names[i],
+               stats.count, stats.min_ns, stats.mean_ns, stats.max_ns);
+    }
+}
+#else
+static void bench_profile_print(void) {}
+#endif
+
+#ifdef CONFIG_MOCAP_BENCH_READ
+/* Read the take back as it grows, the way a host downloads a long take */
+static void bench_wait(void)
+{
+    static uint8_t buf[BENCH_READ_SIZE];
+    int64_t end = k_uptime_get() + CONFIG_MOCAP_BENCH_DURATION * MSEC_PER_SEC;
+    uint32_t offset = 0;
+    int len = 0;
+
+    if(manager_download_begin(0) != 0)
+    {
+        k_sleep(BENCH_DURATION);
+
+        return;
+    }
+
+    while(k_uptime_get() < end)
+    {
+        len = manager_record_read(offset, buf, sizeof(buf));
+        if(len > 0)
+        {
+            offset += len;
+        }
+        else
+        {
+            k_sleep(BENCH_READ_IDLE);
+        }
+    }
+
+    manager_download_end();
+}
+#else
+static void bench_wait(void)
+{
+    k_sleep(BENCH_DURATION);
+}
+#endif
+
+/* The CRC index covers the stored samples in order, without holes */
+static bool bench_order_check(uint16_t id, uint32_t count)
+{
+    static struct record_crc entries[BENCH_CRC_CHUNK];
+    uint32_t first = 0;
+    uint32_t end = 0;
+    int len = 0;
+
+    if(IS_ENABLED(CONFIG_MOCAP_CRC_INDEX) == false)
+    {
+        return true;
+    }
+
+    do
+    {
+        len = manager_crc_get(id, first, entries, BENCH_CRC_CHUNK);
+        if(len < 0)
+        {
+            return false;
+        }
+
+        for(int i = 0; i < len; i++)
+        {
+            /* A sample split over two blocks is in both */
+            if(entries[i].first > end || entries[i].end < end || entries[i].end < entries[i].first)
+            {
+                printf("bench: block %u holds samples %u..%u after %u\n", first + i,
+                       entries[i].first, entries[i].end, end);
+
+                return false;
+            }
+
+            end = entries[i].end;
+        }
+
+        first += len;
+    } while(len == BENCH_CRC_CHUNK);
+
+    return end == count;
+}
+
+/* What has to hold whatever the timing: every sensor sample is stored or
+ * counted as lost, in order, and the sensor kept its rate. Returns the
+ * failed checks. */
+static int bench_check(uint32_t elapsed, const struct storage_stats *storage)
+{
+    int failed = 0;
+    uint32_t count = accel_count_get();
+    uint32_t expected = (uint64_t)accel_sample_rate_get() * elapsed / MSEC_PER_SEC;
+    struct accel_config config = {0};
+    struct storage_session session = {0};
+
+    accel_config_get(&config);
+
+    if(manager_session_get(0, &session) != 0)
+    {
+        printf("bench: check take - FAIL, no session\n");
+
+        return 1;
+    }
+
+    if(accel_lost_get() != 0)
+    {
+        printf("bench: check drops - FAIL, %u lost\n", accel_lost_get());
+        failed++;
+    }
+
+    if(session.meta.count != count / config.decimation)
+    {
+        printf("bench: check samples - FAIL, %u stored of %u\n", session.meta.count,
+               count / config.decimation);
+        failed++;
+    }
+
+    if(session.meta.size != storage->bytes_written)
+    {
+        printf("bench: check size - FAIL, %u bytes of %u\n", session.meta.size,
+               storage->bytes_written);
+        failed++;
+    }
+
+    if(count * 100 < expected * (100 - BENCH_RATE_MARGIN))
+    {
+        printf("bench: check rate - FAIL, %u samples of %u\n", count, expected);
+        failed++;
+    }
+
+    if(bench_order_check(session.id, session.meta.count) == false)
+    {
+        printf("bench: check order - FAIL\n");
+        failed++;
+    }
+
+    printf("bench: checks %s\n", failed == 0 ? "passed" : "failed");
+
+    return failed;
+}
+
+K_THREAD_DEFINE(bench, BENCH_STACK_SIZE, bench_entry, NULL, NULL, NULL,
+                BENCH_PRIORITY, 0, BENCH_START_DELAY);
+
+/* Drive one recording through accel -> manager -> storage and report
+ * how the pipeline kept up */
+static void bench_entry(void *p1, void *p2, void *p3)
+{
+    uint32_t start = 0;
+    uint32_t elapsed = 0;
+    uint32_t count = 0;
+    struct ring_stats ring = {0};
+    struct storage_stats storage = {0};
+    struct accel_sensor_stats sensor = {0};
+    struct disk_emul_stats card_start = {0};
+    struct disk_emul_stats card = {0};
+
+    struct accel_config config = {0};
+
+    accel_config_get(&config);
+
+    printf("bench: %d Hz for %d s, decimation %d\n", accel_sample_rate_get(),
+           CONFIG_MOCAP_BENCH_DURATION, config.decimation);
+    printf("bench: storage %s\n", IS_ENABLED(CONFIG_MOCAP_STORAGE_RAWLOG) ? "raw log" : "fat");
+
+    disk_emul_stats_get(&card_start);
+
+    start = k_uptime_get_32();
+    manager_record_start(k_cycle_get_32());
+
+    bench_wait();
+
+    count = accel_count_get();
+    elapsed = k_uptime_get_32() - start;
+    ring_stats_get(accel_ring_get(), &ring);
+
+    manager_record_stop();
+    storage_stats_get(&storage);
+    disk_emul_stats_get(&card);
+
+    printf("bench: samples %u, %u samples/s\n", count, count * MSEC_PER_SEC / elapsed);
+    printf("bench: %d sensors, %u entries/s aggregate\n", ACCEL_SENSOR_COUNT,
+           count * ACCEL_SENSOR_COUNT * MSEC_PER_SEC / elapsed);
+
+    for(int i = 1; i < ACCEL_SENSOR_COUNT; i++)
+    {
+        accel_sensor_stats_get(i, &sensor);
+
+        printf("bench: sensor %d skew %d us, max %u us, realigned %u\n", i, sensor.skew_us,
+               sensor.skew_max_us, sensor.realigned);
+    }
+    printf("bench: ring high water %u of %u, lost %u\n", ring.high_water, ring.size,
+           accel_lost_get());
+    printf("bench: writes %u, latency min/mean/max %u/%u/%u us\n", storage.flush_count,
+           storage.flush_latency_min, storage.flush_latency_mean, storage.flush_latency_max);
+    printf("bench: %u bytes, write rate %u B/s, throughput %u B/s\n", storage.bytes_written,
+           storage.write_rate, storage.throughput);
+    printf("bench: checkpoints %u, latency mean/max %u/%u us, %u.%u%% of card time\n",
+           storage.checkpoint_count, storage.checkpoint_latency_mean,
+           storage.checkpoint_latency_max, storage.checkpoint_share / 10,
+           storage.checkpoint_share % 10);
+    printf("bench: crc index %u blocks, latency mean/max %u/%u us, %u.%u%% of card time\n",
+           storage.crc_count, storage.crc_latency_mean, storage.crc_latency_max,
+           storage.crc_share / 10, storage.crc_share % 10);
+    if(IS_ENABLED(CONFIG_MOCAP_DISK_EMUL))
+    {
+        printf("bench: card %u writes of %u sectors, %u reads of %u sectors, longest %u us\n",
+               card.write_commands - card_start.write_commands,
+               card.write_sectors - card_start.write_sectors,
+               card.read_commands - card_start.read_commands,
+               card.read_sectors - card_start.read_sectors, card.busy_max_us);
+    }
+    printf("bench: %s worst block write %u us\n",
+           IS_ENABLED(CONFIG_MOCAP_STORAGE_RAWLOG) ? "raw log" : "fat", storage.flush_latency_max);
+    if(IS_ENABLED(CONFIG_MOCAP_BENCH_READ))
+    {
+        printf("bench: read back %u bytes while recording, %u reads held for writes\n",
+               storage.read_bytes, storage.read_waits);
+    }
+    printf("bench: start to first sample %u us\n", manager_start_latency_get());
+    bench_profile_print();
+
+    if(IS_ENABLED(CONFIG_ARCH_POSIX))
+    {
+        /* Simulated time only moves in the sensor and card models */
+        printf("bench: simulated timing, CPU time is not counted\n");
+    }
+
+#ifdef CONFIG_ARCH_POSIX
+    posix_exit(bench_check(elapsed, &storage) == 0 ? 0 : 1);
+#else
+    bench_check(elapsed, &storage);
+#endif
+}
\ No newline at end of file
@@ -3,10 +3,14 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/uuid.h>
 #include <bluetooth/gatt.h>
+#include <sys/byteorder.h>
 
 #include <logging/log.h>
 
 #include "manager.h"
+#include "ble.h"
+#include "trace.h"
+#include "timesync.h"
 
 LOG_MODULE_REGISTER(ble);
 
@@ -16,10 +20,264 @@ enum
     BLE_START_CMD,
     BLE_OPEN_STORAGE_CMD,
     BLE_CLOES_STORAGE_CMD,
-    BLE_GET_META_CMD
+    BLE_GET_META_CMD,
+    BLE_DOWNLOAD_CMD,
+    BLE_STREAM_CMD,
+    BLE_SET_CONFIG_CMD,
+    BLE_GET_CONFIG_CMD,
+    BLE_DELETE_SESSION_CMD,
+    BLE_GET_STATE_CMD,
+    BLE_GET_PROFILE_CMD,
+    BLE_TIME_SYNC_CMD,
+    BLE_GET_SYNC_CMD,
+    BLE_ARM_CMD,
+    BLE_GET_SUMMARY_CMD,
+    BLE_GET_CRC_CMD,
+    BLE_EXPORT_CMD
 };
 
+#define CONTROL_ATTR          (&mocap_service.attrs[2])
+#define RECORD_ATTR           (&mocap_service.attrs[5])
+#define STREAM_ATTR           (&mocap_service.attrs[8])
+#define TRACE_ATTR            (&mocap_service.attrs[11])
+#define ATT_HEADER_SIZE       3
+#define DOWNLOAD_CHUNK_SIZE   (CONFIG_BT_L2CAP_TX_MTU - ATT_HEADER_SIZE)
+#define DOWNLOAD_CREDITS      4
+#define DOWNLOAD_STACK_SIZE   1024
+#define DOWNLOAD_PRIORITY     4 // Below the storage writer, reads never hold up a write
+#define DOWNLOAD_SENT_TIMEOUT K_SECONDS(2) // A notification not sent by then is lost with the link
+#define COMMAND_SIZE_MAX      20 // Longest command, opcode included
+#define COMMAND_QUEUE_SIZE    4
+#define COMMAND_STACK_SIZE    1024
+#define COMMAND_PRIORITY      3
+#define CRC_REPLY_MAX         16 // Index entries per reply, fewer with a small MTU
+
+/* 7.5-15 ms interval while downloading, 30-50 ms otherwise */
+#define FAST_CONN_PARAM       BT_LE_CONN_PARAM(6, 12, 0, 400)
+#define SLOW_CONN_PARAM       BT_LE_CONN_PARAM(24, 40, 0, 400)
+
+#define STREAM_BATCH_MAX      16
+#define STREAM_BATCH_DEFAULT  4
+#define STREAM_MAX_AGE        K_MSEC(50) // Send a partial batch once its first sample is this old
+
+enum
+{
+    BLE_RANGE_BYTES   = 0,
+    BLE_RANGE_SAMPLES = 1, // Timeline sample index, rounded out to whole blocks
+    BLE_RANGE_BLOCKS  = 2, // CRC index blocks, to fetch bad ones again
+};
+
+/* Download command payload, trailing fields may be left out.
+ * A zero length reads to the end of the session. */
+struct ble_download_request
+{
+    uint16_t session;
+    uint8_t unit;
+    uint32_t start;
+    uint32_t length;
+} __packed;
+
+/* Sent on the control characteristic once the range is out.
+ * Offset is the file offset of the first byte sent. */
+struct ble_download_end
+{
+    uint8_t cmd;
+    int8_t status;
+    uint32_t size;
+    uint32_t offset;
+} __packed;
+
+enum
+{
+    BLE_STREAM_OFF     = 0,
+    BLE_STREAM_SAMPLES = 1, // struct accel_entry
+    BLE_STREAM_QUATS   = 2, // struct ble_stream_quat, needs CONFIG_MOCAP_FUSION
+};
+
+/* Live stream notification: index of the first sample since record start,
+ * then count entries of the given type. Entry deltas include the decimated samples. */
+struct ble_stream_header
+{
+    uint32_t index;
+    uint8_t count;
+    uint8_t decimation;
+    uint8_t type;
+} __packed;
+
+struct ble_stream_quat
+{
+    uint16_t delta;
+    struct fusion_quat quat;
+};
+
+struct ble_stream_packet
+{
+    struct ble_stream_header header;
+    union
+    {
+        struct accel_entry entries[STREAM_BATCH_MAX];
+        struct ble_stream_quat quats[STREAM_BATCH_MAX];
+    };
+};
+
+/* Control write, queued from the RX thread to the command thread */
+struct ble_command
+{
+    uint32_t timestamp; // Cycle count when the write came in
+    uint8_t len;
+    uint8_t data[COMMAND_SIZE_MAX];
+};
+
+/* Reply to the commands that have no reply of their own */
+struct ble_command_result
+{
+    uint8_t cmd;
+    int8_t status;
+    uint8_t state;          // enum manager_state after the command
+    uint32_t start_latency; // us from the last start or arm command to its first sample
+    uint32_t trigger_latency; // us from the last trigger to its history being stored
+} __packed;
+
+/* Sent instead of a reply too long for the MTU */
+struct ble_command_error
+{
+    uint8_t cmd;
+    int8_t status;
+} __packed;
+
+/* Reply to the meta and delete commands */
+struct ble_session_reply
+{
+    uint8_t cmd;
+    int8_t status;
+    struct storage_session session;
+} __packed;
+
+/* Reply to the profile command, one pipeline stage per command */
+struct ble_profile_reply
+{
+    uint8_t cmd;
+    int8_t status;
+    uint8_t stage;
+    struct prof_stats stats;
+} __packed;
+
+/* Reply to the time sync command, sent as soon as the request is handled */
+struct ble_timesync_reply
+{
+    uint8_t cmd;
+    struct timesync_reply sync;
+} __packed;
+
+/* Reply to the get sync command, the device's own estimate */
+struct ble_sync_reply
+{
+    uint8_t cmd;
+    int8_t status;
+    struct record_sync sync;
+} __packed;
+
+/* Reply to both config commands, carries the config in effect */
+struct ble_config_reply
+{
+    uint8_t cmd;
+    int8_t status;
+    struct accel_config config;
+} __packed;
+
+/* First reply to the summary command. Point k of the envelope
+ * covers blocks [k * span, (k + 1) * span) of every sensor. */
+struct ble_envelope_reply
+{
+    uint8_t cmd;
+    int8_t status;
+    uint8_t sensors;
+    uint16_t block_samples;
+    uint32_t blocks;
+    uint32_t span;
+    uint8_t count;
+    uint8_t envelope[RECORD_ENVELOPE_SIZE];
+} __packed;
+
+/* Then one reply per sensor, its statistics over the whole take */
+struct ble_summary_reply
+{
+    uint8_t cmd;
+    int8_t status;
+    struct record_stats totals;
+} __packed;
+
+/* CRC index command payload, the first entry may be left out */
+struct ble_crc_request
+{
+    uint16_t session;
+    uint32_t first;
+} __packed;
+
+/* The part of a CRC index entry the host checks blocks with, the sync
+ * point stays on the device */
+struct ble_crc_entry
+{
+    uint32_t crc;
+    uint32_t first;
+    uint32_t end;
+} __packed;
+
+/* Reply to the CRC index command, entries from first on. Fewer than
+ * CRC_REPLY_MAX at the end of the index. */
+struct ble_crc_reply
+{
+    uint8_t cmd;
+    int8_t status;
+    uint8_t count;
+    uint8_t reserved;
+    uint32_t first;
+    struct ble_crc_entry entries[CRC_REPLY_MAX];
+} __packed;
+
+struct ble_stream_config
+{
+    uint8_t mode;
+    uint8_t batch;
+    uint8_t decimation;
+} __packed;
+
 static bool is_connected = false;
+static struct bt_conn *current_conn = NULL;
+static uint8_t download_buf[DOWNLOAD_CHUNK_SIZE];
+
+static struct ble_stream_config stream_config = {
+    .mode       = BLE_STREAM_OFF,
+    .batch      = STREAM_BATCH_DEFAULT,
+    .decimation = 1,
+};
+static struct ble_stream_packet stream_packets[2];
+static struct ble_stream_packet *stream_fill = &stream_packets[0];
+static struct ble_stream_packet *stream_send = NULL;
+static uint32_t stream_index = 0;
+static uint32_t stream_skip = 0;
+static uint32_t stream_delta = 0;
+static uint8_t stream_batch = 0;
+static uint32_t stream_dropped = 0;
+static atomic_t stream_busy = ATOMIC_INIT(0);
+
+static void download_entry(void *p1, void *p2, void *p3);
+static void command_entry(void *p1, void *p2, void *p3);
+static void stream_work_handler(struct k_work *work);
+static void stream_timer_expired(struct k_timer *timer);
+static int ble_stream_config_set(const struct ble_stream_config *config);
+
+K_SEM_DEFINE(download_start, 0, 1);
+K_MSGQ_DEFINE(command_queue, sizeof(struct ble_command), COMMAND_QUEUE_SIZE, 4);
+static struct ble_download_request download_request = {0}; // Written only while not busy
+static atomic_t download_busy = ATOMIC_INIT(0);
+K_SEM_DEFINE(download_credits, DOWNLOAD_CREDITS, DOWNLOAD_CREDITS);
+K_THREAD_DEFINE(ble_download, DOWNLOAD_STACK_SIZE, download_entry, NULL, NULL, NULL,
+                DOWNLOAD_PRIORITY, 0, 0);
+K_THREAD_DEFINE(ble_executor, COMMAND_STACK_SIZE, command_entry, NULL, NULL, NULL,
+                COMMAND_PRIORITY, 0, 0);
+K_WORK_DEFINE(stream_work, stream_work_handler);
+K_TIMER_DEFINE(stream_timer, stream_timer_expired, NULL);
 
 static struct bt_uuid_128 mocap_service_uuid = BT_UUID_INIT_128(
     0x03, 0x00, 0x13, 0xac, 0x42, 0x02, 0xeb, 0x8d,
@@ -33,6 +291,14 @@ static struct bt_uuid_128 record_char_uuid = BT_UUID_INIT_128(
     0x03, 0x00, 0x13, 0xac, 0x42, 0x02, 0xeb, 0x8d,
     0xeb, 0x11, 0xe9, 0x81, 0x9a, 0x82, 0x04, 0x06);
 
+static struct bt_uuid_128 stream_char_uuid = BT_UUID_INIT_128(
+    0x03, 0x00, 0x13, 0xac, 0x42, 0x02, 0xeb, 0x8d,
+    0xeb, 0x11, 0xe9, 0x81, 0x9b, 0x82, 0x04, 0x06);
+
+static struct bt_uuid_128 trace_char_uuid = BT_UUID_INIT_128(
+    0x03, 0x00, 0x13, 0xac, 0x42, 0x02, 0xeb, 0x8d,
+    0xeb, 0x11, 0xe9, 0x81, 0x9c, 0x82, 0x04, 0x06);
+
 /* Propotype of control callback */
 static ssize_t control(struct bt_conn *conn, const struct bt_gatt_attr *attr, 
                        const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
@@ -46,8 +312,15 @@ BT_GATT_PRIMARY_SERVICE(&mocap_service_uuid),
 BT_GATT_CHARACTERISTIC(&control_char_uuid.uuid, BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_NOTIFY,
                        BT_GATT_PERM_WRITE, NULL, control, NULL),
 BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
-BT_GATT_CHARACTERISTIC(&record_char_uuid.uuid, BT_GATT_CHRC_READ,
+BT_GATT_CHARACTERISTIC(&record_char_uuid.uuid, BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
                        BT_GATT_PERM_READ, read, NULL, NULL),
+BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+BT_GATT_CHARACTERISTIC(&stream_char_uuid.uuid, BT_GATT_CHRC_NOTIFY,
+                       BT_GATT_PERM_NONE, NULL, NULL, NULL),
+BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+BT_GATT_CHARACTERISTIC(&trace_char_uuid.uuid, BT_GATT_CHRC_NOTIFY,
+                       BT_GATT_PERM_NONE, NULL, NULL, NULL),
+BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
 );
 
 static const struct bt_data adv[] = 
@@ -56,67 +329,788 @@ static const struct bt_data adv[] =
     BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME, sizeof(CONFIG_BT_DEVICE_NAME) - 1)
 };
 
-static ssize_t control(struct bt_conn *conn, const struct bt_gatt_attr *attr, 
-                       const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+/* Session commands take an optional little endian id, 0 or none is the latest */
+static uint16_t ble_session_id_get(const void *buf, uint16_t len)
+{
+    if(len < 1 + sizeof(uint16_t))
+    {
+        return 0;
+    }
+
+    return sys_get_le16((const uint8_t *)buf + 1);
+}
+
+/* Every reply starts with the command id, and every one that can be
+ * longer than the default MTU with a status. Such a reply would not be
+ * sent at all, so the host gets -EMSGSIZE in a short one instead. */
+static int command_reply(struct bt_conn *conn, const void *data, uint16_t len)
 {
     int result = 0;
-    struct record_meta meta = {0};
+    struct ble_command_error error = {
+        .cmd    = *(const uint8_t *)data,
+        .status = -EMSGSIZE,
+    };
 
-    uint8_t cmd = *(uint8_t *)buf;
+    if(len > bt_gatt_get_mtu(conn) - ATT_HEADER_SIZE)
+    {
+        LOG_ERR("Command reply %d bytes over the MTU", len);
+
+        data = &error;
+        len = sizeof(error);
+        result = -EMSGSIZE;
+    }
 
-    LOG_INF("Control");
+    if(bt_gatt_notify(conn, CONTROL_ATTR, data, len) != 0)
+    {
+        LOG_ERR("Command reply - fail");
+
+        result = -EIO;
+    }
+
+    return result;
+}
+
+/* The envelope, then the totals of every sensor. Only the envelope
+ * reply is sent if the take has no summary. */
+static void command_summary_run(struct bt_conn *conn, uint8_t cmd, uint16_t id)
+{
+    struct record_summary summary = {0};
+    struct record_stats totals = {0};
+    struct ble_envelope_reply envelope_reply = { .cmd = cmd };
+    struct ble_summary_reply summary_reply = { .cmd = cmd };
+
+    envelope_reply.status = manager_summary_get(id, &summary);
+    if(envelope_reply.status == 0)
+    {
+        envelope_reply.sensors = summary.sensors;
+        envelope_reply.block_samples = summary.block_samples;
+        envelope_reply.blocks = summary.blocks;
+        envelope_reply.span = summary.envelope_span;
+        envelope_reply.count = MIN(summary.envelope_count, RECORD_ENVELOPE_SIZE);
+        memcpy(envelope_reply.envelope, summary.envelope, sizeof(envelope_reply.envelope));
+    }
+
+    /* The sensor replies are as long, no use sending them */
+    if(command_reply(conn, &envelope_reply, sizeof(envelope_reply)) == -EMSGSIZE)
+    {
+        return;
+    }
+
+    for(int i = 0; envelope_reply.status == 0 && i < summary.sensors; i++)
+    {
+        summary_reply.status = manager_summary_totals_get(id, i, &totals);
+        summary_reply.totals = totals;
+
+        command_reply(conn, &summary_reply, sizeof(summary_reply));
+    }
+}
+
+/* Only the command thread uses the reply, it is too big for its stack */
+static void command_crc_run(struct bt_conn *conn, uint8_t cmd, const uint8_t *buf, uint16_t len)
+{
+    static struct ble_crc_reply reply;
+    static struct record_crc entries[CRC_REPLY_MAX];
+    struct ble_crc_request request = {0};
+    uint16_t header = offsetof(struct ble_crc_reply, entries);
+    uint8_t count = MIN(CRC_REPLY_MAX, (bt_gatt_get_mtu(conn) - ATT_HEADER_SIZE - header) /
+                                       sizeof(struct ble_crc_entry));
+    int result = 0;
+
+    memcpy(&request, buf + 1, MIN(len - 1, sizeof(request)));
+
+    reply.cmd = cmd;
+    reply.first = request.first;
+    reply.count = 0;
+
+    /* An empty reply would read as the end of the index */
+    result = (count > 0) ? manager_crc_get(request.session, request.first, entries, count) :
+                           -EMSGSIZE;
+    if(result >= 0)
+    {
+        for(int i = 0; i < result; i++)
+        {
+            reply.entries[i].crc = entries[i].crc;
+            reply.entries[i].first = entries[i].first;
+            reply.entries[i].end = entries[i].end;
+        }
+
+        reply.count = result;
+        result = 0;
+    }
+
+    reply.status = result;
+
+    command_reply(conn, &reply, header + reply.count * sizeof(struct ble_crc_entry));
+}
+
+/* Runs in the command thread, so storage and sensor calls may block */
+static void command_run(struct bt_conn *conn, const struct ble_command *command)
+{
+    int result = 0;
+    struct storage_session session = {0};
+    struct ble_session_reply session_reply = {0};
+    struct ble_config_reply reply = {0};
+    struct ble_command_result command_result = {0};
+    struct ble_profile_reply profile_reply = {0};
+    struct prof_stats stats = {0};
+    struct ble_timesync_reply timesync_reply = {0};
+    struct ble_sync_reply sync_reply = {0};
+    struct record_sync sync = {0};
+    struct manager_trigger trigger = {
+        .accel_mg = MANAGER_TRIGGER_ACCEL_MG,
+        .gyro_dps = MANAGER_TRIGGER_GYRO_DPS,
+    };
+    const uint8_t *buf = command->data;
+    uint16_t len = command->len;
+
+    uint8_t cmd = buf[0];
+
+    LOG_INF("Control %d", cmd);
 
     switch(cmd)
     {
         case BLE_STOP_CMD:
-            manager_record_stop();
+            result = manager_record_stop();
         break;
 
         case BLE_START_CMD:
-            manager_record_start();
+            result = manager_record_start(command->timestamp);
+        break;
+
+        case BLE_ARM_CMD:
+            /* Without thresholds the defaults apply */
+            if(len > 1)
+            {
+                memcpy(&trigger, &buf[1], MIN(len - 1, sizeof(trigger)));
+            }
+
+            result = manager_record_arm(command->timestamp, &trigger);
         break;
               
         case BLE_OPEN_STORAGE_CMD:
-            manager_storage_open();
+            result = manager_storage_open(ble_session_id_get(buf, len));
         break;
 
         case BLE_CLOES_STORAGE_CMD:
             manager_storage_close();
         break;
 
+        case BLE_DELETE_SESSION_CMD:
+            session_reply.status = manager_session_delete(ble_session_id_get(buf, len));
+            /* fall through */
+
         case BLE_GET_META_CMD:
-            manager_record_meta_get(&meta);
+            session_reply.cmd = cmd;
+
+            result = manager_session_get(ble_session_id_get(buf, len), &session);
+            if(session_reply.status == 0)
+            {
+                session_reply.status = result;
+            }
+
+            session_reply.session = session;
+
+            command_reply(conn, &session_reply, sizeof(session_reply));
+        return;
+
+        case BLE_DOWNLOAD_CMD:
+            if(len > 1 + sizeof(struct ble_download_request))
+            {
+                result = -EINVAL;
+                break;
+            }
+
+            /* One download at a time, the running one owns the request */
+            if(atomic_cas(&download_busy, 0, 1) == false)
+            {
+                result = -EBUSY;
+                break;
+            }
+
+            /* Download runs in its own thread and replies when the range is out */
+            memset(&download_request, 0, sizeof(download_request));
+            memcpy(&download_request, buf + 1, len - 1);
+            k_sem_give(&download_start);
+        return;
+
+        case BLE_STREAM_CMD:
+            if(len != 1 + sizeof(struct ble_stream_config))
+            {
+                result = -EINVAL;
+                break;
+            }
+
+            result = ble_stream_config_set((const struct ble_stream_config *)(buf + 1));
+        break;
+
+        case BLE_SET_CONFIG_CMD:
+            /* The decimation byte is optional, older clients leave it as is */
+            if(len < 1 + offsetof(struct accel_config, decimation) ||
+               len > 1 + sizeof(struct accel_config))
+            {
+                result = -EINVAL;
+                break;
+            }
+
+            manager_config_get(&reply.config);
+            memcpy(&reply.config, buf + 1, len - 1);
+            reply.status = manager_config_set(&reply.config);
+            /* fall through */
+
+        case BLE_GET_CONFIG_CMD:
+            reply.cmd = cmd;
+            manager_config_get(&reply.config);
+
+            command_reply(conn, &reply, sizeof(reply));
+        return;
 
-            result = bt_gatt_notify(conn, &mocap_service.attrs[2], &meta, sizeof(meta));
-            __ASSERT(result == 0, "Fail to send BLE notify. Result %d", result);
+        case BLE_GET_STATE_CMD:
         break;
 
+        case BLE_GET_PROFILE_CMD:
+            profile_reply.cmd = cmd;
+            profile_reply.stage = len > 1 ? buf[1] : 0;
+            profile_reply.status = manager_profile_get(profile_reply.stage, &stats);
+            profile_reply.stats = stats;
+
+            command_reply(conn, &profile_reply, sizeof(profile_reply));
+        return;
+
+        case BLE_TIME_SYNC_CMD:
+            if(len != 1 + sizeof(struct timesync_request))
+            {
+                result = -EINVAL;
+                break;
+            }
+
+            timesync_reply.cmd = cmd;
+            timesync_request((const struct timesync_request *)(buf + 1), command->timestamp,
+                             &timesync_reply.sync);
+
+            command_reply(conn, &timesync_reply, sizeof(timesync_reply));
+        return;
+
+        case BLE_GET_CRC_CMD:
+            if(len > 1 + sizeof(struct ble_crc_request))
+            {
+                result = -EINVAL;
+                break;
+            }
+
+            command_crc_run(conn, cmd, buf, len);
+        return;
+
+        case BLE_EXPORT_CMD:
+            result = manager_session_export(ble_session_id_get(buf, len));
+        break;
+
+        case BLE_GET_SUMMARY_CMD:
+            command_summary_run(conn, cmd, ble_session_id_get(buf, len));
+        return;
+
+        case BLE_GET_SYNC_CMD:
+            sync_reply.cmd = cmd;
+            sync_reply.status = timesync_get(&sync);
+            sync.start_us = manager_start_time_get();
+            sync_reply.sync = sync;
+
+            command_reply(conn, &sync_reply, sizeof(sync_reply));
+        return;
+
         default:
-            __ASSERT(0, "Unknown commadn, %d", cmd);
+            LOG_ERR("Unknown command %d", cmd);
+
+            result = -ENOTSUP;
     }
 
-    return 0;
+    command_result.cmd = cmd;
+    command_result.status = result;
+    command_result.state = manager_state_get();
+    command_result.start_latency = manager_start_latency_get();
+    command_result.trigger_latency = manager_trigger_latency_get();
+
+    command_reply(conn, &command_result, sizeof(command_result));
+}
+
+/* Called in the Bluetooth RX thread: only queue the command */
+static ssize_t control(struct bt_conn *conn, const struct bt_gatt_attr *attr, 
+                       const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    int result = 0;
+    struct ble_command command = {0};
+
+    if(len == 0 || len > sizeof(command.data))
+    {
+        LOG_ERR("Command length %d", len);
+
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    command.timestamp = k_cycle_get_32();
+    command.len = len;
+    memcpy(command.data, buf, len);
+
+    result = k_msgq_put(&command_queue, &command, K_NO_WAIT);
+    if(result != 0)
+    {
+        LOG_ERR("Command queue full");
+
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+
+    return len;
 }
 
 static ssize_t read(struct bt_conn *conn, const struct bt_gatt_attr *attr,
             void *buf, uint16_t len, uint16_t offset)
 {
-    return (uint16_t)manager_record_read(buf, len);
+    int result = 0;
+    enum manager_state state = manager_state_get();
+
+    /* Runs in the Bluetooth RX thread, which must not wait for the card
+     * while the writer is busy. During a take the download command reads. */
+    if(state != MANAGER_IDLE && state != MANAGER_DOWNLOADING)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+
+    /* Long reads of the opened session, offset is from its first byte */
+    result = manager_record_read(offset, buf, len);
+    if(result < 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+
+    return result;
+}
+
+static void download_sent(struct bt_conn *conn, void *user_data)
+{
+    k_sem_give(&download_credits);
 }
 
+static int download_send(struct bt_conn *conn, const void *data, uint16_t len)
+{
+    int result = 0;
+    struct bt_gatt_notify_params params = {
+        .attr = RECORD_ATTR,
+        .data = data,
+        .len  = len,
+        .func = download_sent,
+    };
+
+    /* Keep a bounded number of notifications in flight */
+    result = k_sem_take(&download_credits, DOWNLOAD_SENT_TIMEOUT);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    result = bt_gatt_notify_cb(conn, &params);
+    if(result != 0)
+    {
+        k_sem_give(&download_credits);
+    }
+
+    return result;
+}
+
+static void download_run(struct bt_conn *conn)
+{
+    int result = 0;
+    int len = 0;
+    uint32_t size = 0;
+    uint32_t offset = 0;
+    uint32_t remain = 0;
+    uint32_t start = k_uptime_get_32();
+    struct ble_download_request request = download_request;
+    struct ble_download_end end = { .cmd = BLE_DOWNLOAD_CMD };
+
+    result = bt_conn_le_param_update(conn, FAST_CONN_PARAM);
+    if(result != 0)
+    {
+        LOG_ERR("Connection parameters update - fail. Result %d", result);
+    }
+
+    result = manager_download_begin(request.session);
+    if(result == 0)
+    {
+        offset = request.start;
+        remain = request.length > 0 ? request.length : UINT32_MAX;
+
+        if(request.unit == BLE_RANGE_SAMPLES)
+        {
+            result = manager_record_range(request.session, request.start, remain, &offset,
+                                              &remain);
+        }
+        else if(request.unit == BLE_RANGE_BLOCKS)
+        {
+            if(request.start > UINT32_MAX / RECORD_CRC_BLOCK_SIZE ||
+               request.length > UINT32_MAX / RECORD_CRC_BLOCK_SIZE)
+            {
+                result = -EINVAL;
+            }
+
+            offset = request.start * RECORD_CRC_BLOCK_SIZE;
+            remain = request.length > 0 ? request.length * RECORD_CRC_BLOCK_SIZE : UINT32_MAX;
+        }
+    }
+
+    end.offset = offset;
+
+    while(result == 0 && remain > 0 && is_connected == true)
+    {
+        len = manager_record_read(offset, download_buf,
+                                  MIN(MIN(bt_gatt_get_mtu(conn) - ATT_HEADER_SIZE, DOWNLOAD_CHUNK_SIZE),
+                                      remain));
+        if(len <= 0)
+        {
+            result = len;
+            break;
+        }
+
+        offset += len;
+        remain -= len;
+
+        result = download_send(conn, download_buf, len);
+        if(result != 0)
+        {
+            LOG_ERR("Download notify - fail. Result %d", result);
+            break;
+        }
+
+        size += len;
+    }
+
+    /* Wait for the last notifications to leave. Their callbacks may
+     * never come if the link dropped, then the credits start over. */
+    for(int i = 0; i < DOWNLOAD_CREDITS; i++)
+    {
+        if(k_sem_take(&download_credits, DOWNLOAD_SENT_TIMEOUT) != 0)
+        {
+            LOG_ERR("Download notifications not sent");
+            break;
+        }
+    }
+
+    k_sem_reset(&download_credits);
+
+    for(int i = 0; i < DOWNLOAD_CREDITS; i++)
+    {
+        k_sem_give(&download_credits);
+    }
+
+    manager_download_end();
+
+    if(is_connected == true)
+    {
+        end.status = result;
+        end.size = size;
+
+        /* The link may drop any time, the host then has no use for the end */
+        result = bt_gatt_notify(conn, CONTROL_ATTR, &end, sizeof(end));
+        if(result != 0)
+        {
+            LOG_ERR("Download end notify - fail. Result %d", result);
+        }
+
+        bt_conn_le_param_update(conn, SLOW_CONN_PARAM);
+    }
+
+    LOG_INF("Download %d bytes in %d ms", size, k_uptime_get_32() - start);
+}
+
+static void download_entry(void *p1, void *p2, void *p3)
+{
+    struct bt_conn *conn = NULL;
+
+    while(true)
+    {
+        k_sem_take(&download_start, K_FOREVER);
+
+        if(current_conn != NULL)
+        {
+            conn = bt_conn_ref(current_conn);
+            download_run(conn);
+            bt_conn_unref(conn);
+        }
+
+        atomic_clear(&download_busy);
+    }
+}
+
+static void command_entry(void *p1, void *p2, void *p3)
+{
+    int result = 0;
+    struct bt_conn *conn = NULL;
+    struct ble_command command = {0};
+
+    while(true)
+    {
+        result = k_msgq_get(&command_queue, &command, K_FOREVER);
+        __ASSERT(result == 0, "Get command - fail. Result %d", result);
+
+        trace_value(TRACE_COMMAND, command.data[0], command.len,
+                    k_cycle_get_32() - command.timestamp);
+
+        conn = current_conn != NULL ? bt_conn_ref(current_conn) : NULL;
+
+        if(conn == NULL)
+        {
+            /* Nobody to reply to, but a stop still has to close the take */
+            if(command.data[0] == BLE_STOP_CMD)
+            {
+                manager_record_stop();
+            }
+
+            continue;
+        }
+
+        command_run(conn, &command);
+        bt_conn_unref(conn);
+    }
+}
+
+static int ble_stream_config_set(const struct ble_stream_config *config)
+{
+    if(config->mode > BLE_STREAM_QUATS ||
+       (config->mode == BLE_STREAM_QUATS && IS_ENABLED(CONFIG_MOCAP_FUSION) == false))
+    {
+        return -ENOTSUP;
+    }
+
+    stream_config.batch      = CLAMP(config->batch, 1, STREAM_BATCH_MAX);
+    stream_config.decimation = MAX(config->decimation, 1);
+    stream_config.mode       = config->mode;
+
+    LOG_INF("Stream mode %d, batch %d, decimation %d", stream_config.mode,
+            stream_config.batch, stream_config.decimation);
+
+    return 0;
+}
+
+static size_t ble_stream_entry_size(uint8_t type)
+{
+    return type == BLE_STREAM_QUATS ? sizeof(struct ble_stream_quat) : sizeof(struct accel_entry);
+}
+
+static void stream_work_handler(struct k_work *work)
+{
+    int result = 0;
+    struct bt_conn *conn = current_conn;
+
+    if(conn != NULL)
+    {
+        result = bt_gatt_notify(conn, STREAM_ATTR, stream_send,
+                                sizeof(struct ble_stream_header) +
+                                stream_send->header.count *
+                                ble_stream_entry_size(stream_send->header.type));
+        if(result != 0)
+        {
+            stream_dropped += stream_send->header.count;
+        }
+    }
+
+    atomic_clear(&stream_busy);
+}
+
+static void ble_stream_submit(void)
+{
+    /* Never wait for the radio: if the previous batch is still going out, drop this one */
+    if(atomic_cas(&stream_busy, 0, 1) == false)
+    {
+        stream_dropped += stream_fill->header.count;
+        stream_fill->header.count = 0;
+
+        return;
+    }
+
+    stream_send = stream_fill;
+    stream_fill = (stream_fill == &stream_packets[0]) ? &stream_packets[1] : &stream_packets[0];
+    stream_fill->header.count = 0;
+
+    k_work_submit(&stream_work);
+}
+
+int ble_trace_send(const void *data, uint16_t len)
+{
+    int result = 0;
+    struct bt_conn *conn = current_conn != NULL ? bt_conn_ref(current_conn) : NULL;
+
+    if(conn == NULL)
+    {
+        return -ENOTCONN;
+    }
+
+    if(bt_gatt_is_subscribed(conn, TRACE_ATTR, BT_GATT_CCC_NOTIFY) == false)
+    {
+        result = -ENOTCONN;
+    }
+    else
+    {
+        result = bt_gatt_notify(conn, TRACE_ATTR, data, len);
+    }
+
+    bt_conn_unref(conn);
+
+    return result;
+}
+
+/* The batch got old before it filled up, also when no sample follows */
+static void stream_timer_expired(struct k_timer *timer)
+{
+    if(stream_fill->header.count > 0)
+    {
+        ble_stream_submit();
+    }
+}
+
+void ble_stream_reset(void)
+{
+    k_timer_stop(&stream_timer);
+
+    stream_index = 0;
+    stream_skip = 0;
+    stream_delta = 0;
+    stream_dropped = 0;
+    stream_fill->header.count = 0;
+}
+
+/* Called from the manager thread for every recorded sample,
+ * quat is the orientation after it or NULL without fusion */
+void ble_stream_put(const struct accel_entry *entry, const struct fusion_quat *quat)
+{
+    struct ble_stream_header *header = NULL;
+    uint8_t type = stream_config.mode;
+    uint16_t mtu = 0;
+    unsigned int key = 0;
+
+    stream_index++;
+    stream_delta += entry->delta;
+
+    if(type == BLE_STREAM_OFF || (type == BLE_STREAM_QUATS && quat == NULL) ||
+       current_conn == NULL ||
+       bt_gatt_is_subscribed(current_conn, STREAM_ATTR, BT_GATT_CCC_NOTIFY) == false)
+    {
+        return;
+    }
+
+    if(++stream_skip < stream_config.decimation)
+    {
+        return;
+    }
+
+    stream_skip = 0;
+    mtu = bt_gatt_get_mtu(current_conn);
+
+    /* The age timer may send the batch from its ISR */
+    key = irq_lock();
+    header = &stream_fill->header;
+
+    /* Mode changed mid batch, the collected entries are of the old type */
+    if(header->count > 0 && header->type != type)
+    {
+        stream_dropped += header->count;
+        header->count = 0;
+    }
+
+    if(header->count == 0)
+    {
+        header->index = stream_index - 1;
+        header->decimation = stream_config.decimation;
+        header->type = type;
+
+        /* A batch has to fit into one notification */
+        stream_batch = MIN(stream_config.batch,
+                           (mtu - ATT_HEADER_SIZE - sizeof(struct ble_stream_header)) /
+                           ble_stream_entry_size(type));
+        stream_batch = MAX(stream_batch, 1);
+
+        k_timer_start(&stream_timer, STREAM_MAX_AGE, K_NO_WAIT);
+    }
+
+    if(type == BLE_STREAM_QUATS)
+    {
+        stream_fill->quats[header->count].delta = MIN(stream_delta, UINT16_MAX);
+        stream_fill->quats[header->count].quat = *quat;
+    }
+    else
+    {
+        stream_fill->entries[header->count] = *entry;
+        stream_fill->entries[header->count].delta = MIN(stream_delta, UINT16_MAX);
+    }
+
+    header->count++;
+    stream_delta = 0;
+
+    if(header->count >= stream_batch)
+    {
+        ble_stream_submit();
+    }
+
+    irq_unlock(key);
+}
+
+uint32_t ble_stream_dropped_get(void)
+{
+    return stream_dropped;
+}
+
+static void mtu_exchanged(struct bt_conn *conn, uint8_t err,
+                          struct bt_gatt_exchange_params *params)
+{
+    LOG_INF("MTU exchange %s, MTU %d", err == 0 ? "done" : "failed", bt_gatt_get_mtu(conn));
+}
+
+static struct bt_gatt_exchange_params mtu_params = {
+    .func = mtu_exchanged,
+};
+
 static void connected(struct bt_conn *conn, uint8_t err)
 {
+    int result = 0;
+
+    if(err != 0)
+    {
+        LOG_ERR("Connection - fail. Error %d", err);
+
+        return;
+    }
+
     LOG_INF("Connected");
+    current_conn = bt_conn_ref(conn);
     is_connected = true;
+
+    /* Ask for the large ATT MTU so downloads move in big notifications */
+    result = bt_gatt_exchange_mtu(conn, &mtu_params);
+    if(result != 0)
+    {
+        LOG_ERR("MTU exchange - fail. Result %d", result);
+    }
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason)
 {
-    /* Stop record first */
-    manager_record_stop();
+    struct ble_command stop = {
+        .timestamp = k_cycle_get_32(),
+        .len       = 1,
+        .data      = { BLE_STOP_CMD },
+    };
+
+    /* Stop record first, in the command thread like any other stop */
+    if(k_msgq_put(&command_queue, &stop, K_NO_WAIT) != 0)
+    {
+        LOG_ERR("Queue stop on disconnect - fail");
+    }
 
     LOG_INF("Disconnected");
     is_connected = false;
+
+    if(current_conn != NULL)
+    {
+        bt_conn_unref(current_conn);
+        current_conn = NULL;
+    }
 }
 
 static struct bt_conn_cb conn_callbacks = {
@@ -1,7 +1,29 @@
 #ifndef BLE_H
 #define BLE_H
 
+#include "accel.h"
+#include "fusion.h"
+
+#ifdef CONFIG_BT
+
 void ble_init(void);
 bool ble_is_connected(void);
+void ble_stream_reset(void);
+void ble_stream_put(const struct accel_entry *entry, const struct fusion_quat *quat);
+uint32_t ble_stream_dropped_get(void);
+int ble_trace_send(const void *data, uint16_t len);
+
+#else
+
+/* Builds without Bluetooth, e.g. the native_posix benchmark */
+static inline void ble_init(void) {}
+static inline bool ble_is_connected(void) { return false; }
+static inline void ble_stream_reset(void) {}
+static inline void ble_stream_put(const struct accel_entry *entry,
+                                  const struct fusion_quat *quat) {}
+static inline uint32_t ble_stream_dropped_get(void) { return 0; }
+static inline int ble_trace_send(const void *data, uint16_t len) { return -ENOTSUP; }
+
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include "codec.h"
+#include "record.h"
+
+/* Worst case: time delta and six axis deltas, 17 bit each after zig-zag */
+#define CODEC_SAMPLE_MAX (7 * 3)
+
+static uint8_t *codec_varint_put(uint8_t *out, uint32_t value)
+{
+    while(value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    *out++ = (uint8_t)value;
+
+    return out;
+}
+
+static uint32_t codec_zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/* Blocks always start with the first sensor */
+void codec_reset(struct codec *codec)
+{
+    codec->len = sizeof(struct record_block);
+    codec->count = 0;
+    codec->sensor = 0;
+}
+
+void codec_put(struct codec *codec, const struct accel_entry *entry)
+{
+    uint8_t *out = &codec->block[codec->len];
+    struct accel_entry *prev = &codec->prev[codec->sensor];
+
+    if(codec->count < ACCEL_SENSOR_COUNT)
+    {
+        /* Key sample */
+        memcpy(out, entry, sizeof(*entry));
+        out += sizeof(*entry);
+    }
+    else
+    {
+        out = codec_varint_put(out, codec_zigzag((int32_t)entry->delta - prev->delta));
+
+        for(int i = 0; i < 3; i++)
+        {
+            out = codec_varint_put(out, codec_zigzag((int32_t)entry->accel[i] - prev->accel[i]));
+        }
+
+        for(int i = 0; i < 3; i++)
+        {
+            out = codec_varint_put(out, codec_zigzag((int32_t)entry->gyro[i] - prev->gyro[i]));
+        }
+    }
+
+    *prev = *entry;
+    codec->len = out - codec->block;
+    codec->count++;
+
+    if(++codec->sensor == ACCEL_SENSOR_COUNT)
+    {
+        codec->sensor = 0;
+    }
+}
+
+/* Full when the next sample of all sensors might not fit */
+bool codec_is_full(const struct codec *codec)
+{
+    return (CODEC_BLOCK_SIZE - codec->len) < CODEC_SAMPLE_MAX * ACCEL_SENSOR_COUNT;
+}
+
+bool codec_is_empty(const struct codec *codec)
+{
+    return codec->count == 0;
+}
+
+/* Fill in the block header and return the block length in bytes */
+size_t codec_block_finish(struct codec *codec)
+{
+    struct record_block header = {
+        .type     = RECORD_BLOCK_SAMPLES,
+        .reserved = 0,
+        .size     = codec->len - sizeof(struct record_block),
+        .count    = codec->count,
+    };
+
+    memcpy(codec->block, &header, sizeof(header));
+
+    return codec->len;
+}
@@ -0,0 +1,32 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "accel.h"
+
+/* 256 bytes for a single sensor, grown so that blocks of more sensors
+ * still hold a few samples */
+#define CODEC_BLOCK_SIZE (128 + 128 * ACCEL_SENSOR_COUNT)
+
+/* Delta + zig-zag varint block encoder. Every block starts with a
+ * record_block header and a verbatim key sample, so it decodes on its own.
+ * Entries are predicted from the previous entry of the same sensor. */
+struct codec
+{
+    uint8_t block[CODEC_BLOCK_SIZE];
+    uint16_t len;
+    uint16_t count;
+    uint8_t sensor; // Sensor of the next entry
+    struct accel_entry prev[ACCEL_SENSOR_COUNT];
+};
+
+void codec_reset(struct codec *codec);
+void codec_put(struct codec *codec, const struct accel_entry *entry);
+bool codec_is_full(const struct codec *codec);
+bool codec_is_empty(const struct codec *codec);
+size_t codec_block_finish(struct codec *codec);
+
+#endif
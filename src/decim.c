@@ -0,0 +1,151 @@
+#include <zephyr.h>
+#include <string.h>
+
+#include "decim.h"
+
+/* Anti-alias FIR and downsampling in one step. The taps are a Hamming
+ * windowed sinc cut off at the output Nyquist frequency, 8 per unit of
+ * ratio, in Q15 and summing to exactly 1. They are symmetric, so input
+ * pairs are added first and only half the taps are stored. An output
+ * is only computed for every ratio-th input. Tables are generated by
+ * tools/decim_ref.py --taps. */
+
+#define DECIM_TAPS_MAX  (8 * DECIM_RATIO_MAX)
+#define DECIM_AXES      6
+
+BUILD_ASSERT(CONFIG_MOCAP_DECIM_RATIO == 1 || CONFIG_MOCAP_DECIM_RATIO == 2 ||
+             CONFIG_MOCAP_DECIM_RATIO == 4 || CONFIG_MOCAP_DECIM_RATIO == 8,
+             "Decimation ratio must be 1, 2, 4 or 8");
+
+static const int16_t taps_2[8] = {
+    -79, -136, 312, 654, -1244, -2280, 4501, 14656,
+};
+static const int16_t taps_4[16] = {
+    -21, -60, -84, -52, 78, 273, 387, 221,
+    -301, -974, -1305, -731, 1017, 3642, 6306, 7988,
+};
+static const int16_t taps_8[32] = {
+    -5, -16, -26, -36, -43, -45, -36, -16,
+    19, 65, 117, 165, 196, 195, 153, 63,
+    -73, -239, -414, -563, -650, -638, -494, -203,
+    239, 810, 1474, 2175, 2849, 3429, 3853, 4079,
+};
+
+struct decim_sensor
+{
+    int16_t history[DECIM_TAPS_MAX][DECIM_AXES];
+    uint8_t pos;      // Next history slot
+    uint8_t phase;    // Inputs since the last output
+    bool primed;
+    uint32_t delta;   // Time since the last output
+    uint32_t lost;    // Inputs lost since the last output, not yet reported
+};
+
+static struct decim_sensor sensors[ACCEL_SENSOR_COUNT];
+static const int16_t *taps = NULL;
+static uint8_t ratio = 1;
+static uint8_t taps_count = 0;
+
+bool decim_ratio_is_valid(uint8_t value)
+{
+    return value == 1 || value == 2 || value == 4 || value == 8;
+}
+
+void decim_reset(uint8_t value)
+{
+    __ASSERT(decim_ratio_is_valid(value), "Decimation %d", value);
+
+    ratio = value;
+    taps_count = 8 * ratio;
+    taps = (ratio == 2) ? taps_2 : (ratio == 4) ? taps_4 : taps_8;
+
+    memset(sensors, 0, sizeof(sensors));
+}
+
+static void decim_axes_get(const struct accel_entry *entry, int16_t *axes)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        axes[i] = entry->accel[i];
+        axes[i + 3] = entry->gyro[i];
+    }
+}
+
+static void decim_axes_set(struct accel_entry *entry, const int32_t *axes)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        entry->accel[i] = CLAMP(axes[i], INT16_MIN, INT16_MAX);
+        entry->gyro[i] = CLAMP(axes[i + 3], INT16_MIN, INT16_MAX);
+    }
+}
+
+/* Entries of a sensor come in at the raw rate. True with an output in out,
+ * timed at the newest input. The filter delays it by (taps - 1) / 2 inputs,
+ * the manager moves the start of the take back by as much. */
+bool decim_put(uint8_t sensor, const struct accel_entry *in, uint16_t lost,
+               struct accel_entry *out, uint16_t *out_lost)
+{
+    struct decim_sensor *state = &sensors[sensor];
+    int16_t axes[DECIM_AXES];
+    int32_t acc[DECIM_AXES];
+    uint8_t mask = taps_count - 1;
+    uint8_t newest = 0;
+
+    if(ratio == 1)
+    {
+        *out = *in;
+        *out_lost = lost;
+
+        return true;
+    }
+
+    decim_axes_get(in, axes);
+
+    /* Start from a steady state, not from zero */
+    if(state->primed == false)
+    {
+        for(int i = 0; i < taps_count; i++)
+        {
+            memcpy(state->history[i], axes, sizeof(state->history[i]));
+        }
+
+        state->primed = true;
+    }
+
+    newest = state->pos;
+    memcpy(state->history[newest], axes, sizeof(state->history[newest]));
+    state->pos = (newest + 1) & mask;
+    state->delta += in->delta;
+    state->lost += lost;
+
+    if(++state->phase < ratio)
+    {
+        return false;
+    }
+
+    state->phase = 0;
+
+    for(int axis = 0; axis < DECIM_AXES; axis++)
+    {
+        acc[axis] = 1 << 14; // Round to nearest
+
+        for(int k = 0; k < taps_count / 2; k++)
+        {
+            acc[axis] += taps[k] * ((int32_t)state->history[(newest - k) & mask][axis] +
+                                    state->history[(newest - (taps_count - 1 - k)) & mask][axis]);
+        }
+
+        acc[axis] >>= 15;
+    }
+
+    decim_axes_set(out, acc);
+
+    out->delta = MIN(state->delta, UINT16_MAX);
+    *out_lost = MIN(state->lost / ratio, UINT16_MAX);
+
+    state->delta = 0;
+    state->lost %= ratio;
+
+    return true;
+}
\ No newline at end of file
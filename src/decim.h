@@ -0,0 +1,45 @@
+#ifndef DECIM_H
+#define DECIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "accel.h"
+
+/* Stored samples per sensor output sample, 1 stores every one */
+#define DECIM_RATIO_MAX 8
+
+/* Group delay of the filter in half input periods, (taps - 1) */
+static inline uint32_t decim_delay_halves(uint8_t ratio)
+{
+    return (ratio == 1) ? 0 : 8 * ratio - 1;
+}
+
+#ifdef CONFIG_MOCAP_DECIM
+
+bool decim_ratio_is_valid(uint8_t ratio);
+void decim_reset(uint8_t ratio);
+bool decim_put(uint8_t sensor, const struct accel_entry *in, uint16_t lost,
+               struct accel_entry *out, uint16_t *out_lost);
+
+#else
+
+static inline bool decim_ratio_is_valid(uint8_t ratio)
+{
+    return ratio == 1;
+}
+
+static inline void decim_reset(uint8_t ratio) {}
+
+static inline bool decim_put(uint8_t sensor, const struct accel_entry *in, uint16_t lost,
+                             struct accel_entry *out, uint16_t *out_lost)
+{
+    *out = *in;
+    *out_lost = lost;
+
+    return true;
+}
+
+#endif
+
+#endif
\ No newline at end of file
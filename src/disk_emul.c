@@ -0,0 +1,158 @@
+#include <zephyr.h>
+#include <init.h>
+#include <drivers/disk.h>
+#include <logging/log.h>
+#include <string.h>
+
+#include "disk_emul.h"
+
+LOG_MODULE_REGISTER(disk_emul);
+
+/* Every command costs a fixed card time, every sector a transfer time.
+ * Both are spent in k_busy_wait(), which moves the simulated clock on, so
+ * measured latencies follow the card operations each backend needs. */
+
+#define DISK_SECTOR_SIZE   512
+#define DISK_ERASE_SECTORS 8192 // A 4 MiB allocation unit
+#define DISK_COMMAND_US    CONFIG_MOCAP_DISK_EMUL_COMMAND_US
+#define DISK_SECTOR_US     CONFIG_MOCAP_DISK_EMUL_SECTOR_US
+
+struct disk_emul
+{
+    struct disk_info info;
+    uint8_t *data;
+    uint32_t sectors;
+};
+
+static uint8_t fat_data[CONFIG_MOCAP_DISK_EMUL_SECTORS * DISK_SECTOR_SIZE];
+#ifdef CONFIG_MOCAP_STORAGE_RAWLOG
+static uint8_t log_data[CONFIG_MOCAP_DISK_EMUL_LOG_SECTORS * DISK_SECTOR_SIZE];
+#endif
+static struct disk_emul_stats stats = {0};
+
+static void disk_emul_busy(uint32_t count)
+{
+    uint32_t busy_us = DISK_COMMAND_US + count * DISK_SECTOR_US;
+
+    stats.busy_max_us = MAX(stats.busy_max_us, busy_us);
+
+    k_busy_wait(busy_us);
+}
+
+static int disk_emul_init(struct disk_info *disk)
+{
+    return 0;
+}
+
+static int disk_emul_status(struct disk_info *disk)
+{
+    return DISK_STATUS_OK;
+}
+
+static int disk_emul_read(struct disk_info *disk, uint8_t *data, uint32_t first, uint32_t count)
+{
+    struct disk_emul *emul = CONTAINER_OF(disk, struct disk_emul, info);
+
+    if(first + count > emul->sectors)
+    {
+        return -EIO;
+    }
+
+    stats.read_commands++;
+    stats.read_sectors += count;
+    disk_emul_busy(count);
+
+    memcpy(data, &emul->data[first * DISK_SECTOR_SIZE], count * DISK_SECTOR_SIZE);
+
+    return 0;
+}
+
+static int disk_emul_write(struct disk_info *disk, const uint8_t *data, uint32_t first,
+                           uint32_t count)
+{
+    struct disk_emul *emul = CONTAINER_OF(disk, struct disk_emul, info);
+
+    if(first + count > emul->sectors)
+    {
+        return -EIO;
+    }
+
+    stats.write_commands++;
+    stats.write_sectors += count;
+    disk_emul_busy(count);
+
+    memcpy(&emul->data[first * DISK_SECTOR_SIZE], data, count * DISK_SECTOR_SIZE);
+
+    return 0;
+}
+
+static int disk_emul_ioctl(struct disk_info *disk, uint8_t cmd, void *buff)
+{
+    struct disk_emul *emul = CONTAINER_OF(disk, struct disk_emul, info);
+
+    switch(cmd)
+    {
+        case DISK_IOCTL_CTRL_SYNC:
+            return 0;
+        case DISK_IOCTL_GET_SECTOR_COUNT:
+            *(uint32_t *)buff = emul->sectors;
+            return 0;
+        case DISK_IOCTL_GET_SECTOR_SIZE:
+            *(uint32_t *)buff = DISK_SECTOR_SIZE;
+            return 0;
+        case DISK_IOCTL_GET_ERASE_BLOCK_SZ:
+            *(uint32_t *)buff = DISK_ERASE_SECTORS;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+static const struct disk_operations disk_emul_ops = {
+    .init   = disk_emul_init,
+    .status = disk_emul_status,
+    .read   = disk_emul_read,
+    .write  = disk_emul_write,
+    .ioctl  = disk_emul_ioctl,
+};
+
+static struct disk_emul disks[] = {
+    {
+        .info = { .name = CONFIG_MOCAP_STORAGE_VOLUME, .ops = &disk_emul_ops },
+        .data = fat_data,
+        .sectors = CONFIG_MOCAP_DISK_EMUL_SECTORS,
+    },
+#ifdef CONFIG_MOCAP_STORAGE_RAWLOG
+    {
+        .info = { .name = DISK_EMUL_LOG_VOLUME, .ops = &disk_emul_ops },
+        .data = log_data,
+        .sectors = CONFIG_MOCAP_DISK_EMUL_LOG_SECTORS,
+    },
+#endif
+};
+
+void disk_emul_stats_get(struct disk_emul_stats *out)
+{
+    *out = stats;
+}
+
+/* Registered before the application threads mount anything */
+static int disk_emul_register(const struct device *dev)
+{
+    int result = 0;
+
+    for(int i = 0; i < ARRAY_SIZE(disks); i++)
+    {
+        result = disk_access_register(&disks[i].info);
+        if(result != 0)
+        {
+            LOG_ERR("Register %s - fail. Result %d", disks[i].info.name, result);
+
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+SYS_INIT(disk_emul_register, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
\ No newline at end of file
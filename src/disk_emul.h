@@ -0,0 +1,31 @@
+#ifndef DISK_EMUL_H
+#define DISK_EMUL_H
+
+#include <stdint.h>
+
+/* RAM disks standing in for the SD card on boards without one. The FAT
+ * volume and the raw log each get a disk, like a card split in two. */
+
+#define DISK_EMUL_LOG_VOLUME "LOG"
+
+/* Card operations, since boot. A command is one read or write call. */
+struct disk_emul_stats
+{
+    uint32_t write_commands;
+    uint32_t write_sectors;
+    uint32_t read_commands;
+    uint32_t read_sectors;
+    uint32_t busy_max_us; // Longest single command
+};
+
+#ifdef CONFIG_MOCAP_DISK_EMUL
+
+void disk_emul_stats_get(struct disk_emul_stats *stats);
+
+#else
+
+static inline void disk_emul_stats_get(struct disk_emul_stats *stats) {}
+
+#endif
+
+#endif
\ No newline at end of file
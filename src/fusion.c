@@ -0,0 +1,156 @@
+#include <zephyr.h>
+
+#include "fusion.h"
+
+/* Mahony filter in Q30 fixed point. Only shifts, adds and multiplies:
+ * the nRF51 has neither an FPU nor a divide instruction. */
+
+#define Q30_ONE              (1L << 30)
+#define FUSION_KP            CONFIG_MOCAP_FUSION_KP
+
+/* Half rotation angle per raw gyro word and microsecond at 250 deg/s
+ * full scale, Q61: 0.5 * 250 / 32768 * pi / 180 * 1e-6 * 2^61 */
+#define GYRO_HALF_ANGLE_Q61  153520785LL
+/* Half angle per unit of error, gain (1/1000 s^-1) and microsecond, Q61 */
+#define GAIN_HALF_Q61        1152921505LL
+/* Keeps a single Newton step enough to renormalize */
+#define HALF_ANGLE_MAX       (Q30_ONE / 2)
+/* |a|^2 below this is close to free fall, gravity is not measurable */
+#define ACCEL_NORM_MIN       (1UL << 20)
+#define INV_SQRT_STEPS       3
+/* Longer steps would overflow the gyro term, and are past a small angle anyway */
+#define DT_MAX_US            UINT16_MAX
+
+static int32_t q[4] = { Q30_ONE, 0, 0, 0 };
+static int64_t gyro_scale = GYRO_HALF_ANGLE_Q61;
+static uint16_t tick = RECORD_TICK_US;
+
+static inline int32_t q30_mul(int32_t a, int32_t b)
+{
+    return (int32_t)(((int64_t)a * b) >> 30);
+}
+
+/* 1 / sqrt(x) as a Q30 value to be shifted right by *shift */
+static int32_t fusion_inv_sqrt(uint32_t x, int *shift)
+{
+    int64_t y = 0;
+    int64_t m = x;
+    int e = 0;
+
+    /* Scale by powers of 4 into [0.25, 1) in Q30 */
+    while(m >= Q30_ONE)
+    {
+        m >>= 2;
+        e--;
+    }
+
+    while(m < Q30_ONE / 4)
+    {
+        m <<= 2;
+        e++;
+    }
+
+    /* Linear first guess, then Newton: y = y * (3 - m * y^2) / 2 */
+    y = (9LL << 28) - m - (m >> 2);
+
+    for(int i = 0; i < INV_SQRT_STEPS; i++)
+    {
+        int64_t y2 = (y * y) >> 30;
+
+        y = (y * ((3LL << 30) - ((m * y2) >> 30))) >> 31;
+    }
+
+    *shift = 15 - e;
+
+    return (int32_t)y;
+}
+
+void fusion_reset(uint8_t gyro_fs, uint16_t tick_us)
+{
+    q[0] = Q30_ONE;
+    q[1] = 0;
+    q[2] = 0;
+    q[3] = 0;
+
+    gyro_scale = GYRO_HALF_ANGLE_Q61 << gyro_fs;
+    tick = tick_us;
+}
+
+void fusion_update(const struct accel_entry *entry)
+{
+    int32_t dt = MIN((uint32_t)entry->delta * tick, DT_MAX_US);
+    int32_t h[3];
+    int32_t a[3];
+    int32_t v[3];
+    int32_t gain = 0;
+    int32_t inv = 0;
+    int32_t y = 0;
+    int64_t n2 = 0;
+    int shift = 0;
+    uint32_t norm = 0;
+    int32_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+
+    /* Half of the angle turned since the previous sample */
+    for(int i = 0; i < 3; i++)
+    {
+        h[i] = ((int64_t)entry->gyro[i] * dt * gyro_scale) >> 31;
+    }
+
+    norm = (uint32_t)(entry->accel[0] * entry->accel[0]) +
+           (uint32_t)(entry->accel[1] * entry->accel[1]) +
+           (uint32_t)(entry->accel[2] * entry->accel[2]);
+
+    if(norm >= ACCEL_NORM_MIN)
+    {
+        inv = fusion_inv_sqrt(norm, &shift);
+
+        for(int i = 0; i < 3; i++)
+        {
+            a[i] = ((int64_t)entry->accel[i] * inv) >> shift;
+        }
+
+        /* Gravity as the current orientation expects it */
+        v[0] = (q30_mul(q1, q3) - q30_mul(q0, q2)) * 2;
+        v[1] = (q30_mul(q0, q1) + q30_mul(q2, q3)) * 2;
+        v[2] = q30_mul(q0, q0) - q30_mul(q1, q1) - q30_mul(q2, q2) + q30_mul(q3, q3);
+
+        /* Turn towards the measured gravity, error is a x v */
+        gain = ((int64_t)FUSION_KP * dt * GAIN_HALF_Q61) >> 31;
+
+        h[0] += q30_mul(gain, q30_mul(a[1], v[2]) - q30_mul(a[2], v[1]));
+        h[1] += q30_mul(gain, q30_mul(a[2], v[0]) - q30_mul(a[0], v[2]));
+        h[2] += q30_mul(gain, q30_mul(a[0], v[1]) - q30_mul(a[1], v[0]));
+    }
+
+    for(int i = 0; i < 3; i++)
+    {
+        h[i] = CLAMP(h[i], -HALF_ANGLE_MAX, HALF_ANGLE_MAX);
+    }
+
+    /* q += q * (0, h) */
+    q[0] += -q30_mul(q1, h[0]) - q30_mul(q2, h[1]) - q30_mul(q3, h[2]);
+    q[1] +=  q30_mul(q0, h[0]) + q30_mul(q2, h[2]) - q30_mul(q3, h[1]);
+    q[2] +=  q30_mul(q0, h[1]) - q30_mul(q1, h[2]) + q30_mul(q3, h[0]);
+    q[3] +=  q30_mul(q0, h[2]) + q30_mul(q1, h[1]) - q30_mul(q2, h[0]);
+
+    /* |q| stays close to 1, so one Newton step y = (3 - |q|^2) / 2 renormalizes */
+    for(int i = 0; i < 4; i++)
+    {
+        n2 += (int64_t)q[i] * q[i];
+    }
+
+    y = Q30_ONE + ((Q30_ONE - (int32_t)(n2 >> 30)) >> 1);
+
+    for(int i = 0; i < 4; i++)
+    {
+        q[i] = q30_mul(q[i], y);
+    }
+}
+
+void fusion_get(struct fusion_quat *quat)
+{
+    quat->w = CLAMP((q[0] + (1 << 15)) >> 16, INT16_MIN, INT16_MAX);
+    quat->x = CLAMP((q[1] + (1 << 15)) >> 16, INT16_MIN, INT16_MAX);
+    quat->y = CLAMP((q[2] + (1 << 15)) >> 16, INT16_MIN, INT16_MAX);
+    quat->z = CLAMP((q[3] + (1 << 15)) >> 16, INT16_MIN, INT16_MAX);
+}
@@ -0,0 +1,31 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <stdint.h>
+
+#include "accel.h"
+
+/* Unit quaternion, Q14 */
+struct fusion_quat
+{
+    int16_t w;
+    int16_t x;
+    int16_t y;
+    int16_t z;
+};
+
+#ifdef CONFIG_MOCAP_FUSION
+
+void fusion_reset(uint8_t gyro_fs, uint16_t tick_us);
+void fusion_update(const struct accel_entry *entry);
+void fusion_get(struct fusion_quat *quat);
+
+#else
+
+static inline void fusion_reset(uint8_t gyro_fs, uint16_t tick_us) {}
+static inline void fusion_update(const struct accel_entry *entry) {}
+static inline void fusion_get(struct fusion_quat *quat) {}
+
+#endif
+
+#endif
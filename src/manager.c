@@ -1,12 +1,19 @@
 #include <zephyr.h>
 #include <drivers/gpio.h>
 #include <logging/log.h>
-#include <stdio.h>
 
 #include "accel.h"
 #include "ble.h"
 #include "storage.h"
 #include "manager.h"
+#include "codec.h"
+#include "ring.h"
+#include "fusion.h"
+#include "prof.h"
+#include "trace.h"
+#include "timesync.h"
+#include "decim.h"
+#include "summary.h"
 
 LOG_MODULE_REGISTER(manager);
 
@@ -18,6 +25,12 @@ LOG_MODULE_REGISTER(manager);
 #define CONNECTION_LED_PIN DT_GPIO_PIN(CONNECTION_LED_NODE, gpios)
 #define SHORT_PHASE K_MSEC(50)
 #define LONG_PHASE  K_MSEC(950)
+#define PROCESS_TIMEOUT K_MSEC(10)
+#define QUAT_BLOCK_COUNT 16
+#define TRACE_SAMPLE_PERIOD 100
+#define CHECKPOINT_PERIOD_MS CONFIG_MOCAP_CHECKPOINT_PERIOD
+#define BLOCK_SPAN_MAX_US (500 * USEC_PER_MSEC) // Low rates write smaller blocks, not older ones
+#define PRETRIGGER_SAMPLES CONFIG_MOCAP_PRETRIGGER_SAMPLES
 
 
 static const struct device *status_led_port = NULL;
@@ -25,6 +38,63 @@ static const struct device *connection_led_port = NULL;
 
 void connection_led_handler(struct k_timer *timer_id);
 K_TIMER_DEFINE(connection_led_timer, connection_led_handler, NULL);
+K_SEM_DEFINE(manager_flushed, 0, 1);
+
+static struct codec codec;
+static bool flush_request = false;
+static size_t record_size = 0;
+static uint32_t codec_cycles = 0;
+static uint64_t record_time = 0; // us since record start
+static uint64_t block_time = 0;  // record_time at the start of the open block
+static uint32_t record_count = 0;
+static uint8_t record_sensor = 0; // Sensor of the next entry
+static uint8_t decim_sensor = 0;  // Sensor of the next raw entry
+static uint8_t record_decimation = 1;
+static uint32_t gap_count = 0;
+static uint32_t gap_lost = 0; // Samples lost in the gaps written so far
+static uint32_t checkpoint_timestamp = 0;
+static atomic_t state = ATOMIC_INIT(MANAGER_IDLE);
+
+#ifdef CONFIG_MOCAP_FUSION
+/* Quaternions are collected into blocks of their own */
+static struct {
+    struct record_block block;
+    struct record_quat quat;
+    struct fusion_quat quats[QUAT_BLOCK_COUNT];
+} __packed quat_block;
+static uint32_t fusion_cycles = 0;
+static uint16_t fusion_skip = 0;
+#endif
+#ifdef CONFIG_MOCAP_PRETRIGGER
+/* The last samples before the trigger, all sensors of each */
+static struct {
+    struct accel_entry entries[ACCEL_SENSOR_COUNT];
+    uint16_t lost;
+} pretrigger[PRETRIGGER_SAMPLES];
+static uint16_t pretrigger_head = 0;
+static uint16_t pretrigger_count = 0;
+static bool pretrigger_fired = false;
+static uint32_t trigger_cycles = 0;
+/* Squared magnitude bounds in raw units, 0 is off */
+static uint32_t trigger_accel_min = 0;
+static uint32_t trigger_accel_max = 0;
+static uint32_t trigger_gyro_max = 0;
+#endif
+static uint32_t start_request = 0; // Cycle count of the start or arm request
+static uint32_t start_latency = 0; // us from the request to the first sample
+static bool start_pending = false; // First sample not seen yet
+static uint32_t trigger_latency = 0; // us from the trigger to its history being written
+static uint16_t record_session = 0;
+static uint64_t record_start_offset = 0; // us from the first sample to the first one kept
+static uint32_t record_delay = 0; // us the filter delays the stored samples by
+
+static void manager_fusion_reset(void);
+static void manager_sync_write(void);
+static void manager_pretrigger_reset(void);
+static void manager_decim_reset(void);
+static void manager_summary_begin(void);
+static void manager_summary_put(const struct accel_entry *entry);
+static void manager_summary_finish(void);
 
 void connection_led_handler(struct k_timer *timer_id)
 {
@@ -62,65 +132,229 @@ void connection_led_handler(struct k_timer *timer_id)
     k_timer_start(&connection_led_timer, phase, K_MSEC(0));
 }
 
-void manager_record_start(void)
+/* Create the take and start sampling, in the sampling state
+ * once the session is ready. Called in the armed state. */
+static int manager_record_begin(uint32_t request, enum manager_state sampling)
 {
     int result = 0;
+    uint16_t id = 0;
+    struct record_header header = {0};
 
-    LOG_INF("Start recording");
+    /* Every take goes to a new session, previous ones stay on the card */
+    result = storage_session_create(k_uptime_get_32(), &id);
+    if(result != 0)
+    {
+        LOG_ERR("Create session - fail. Result %d", result);
+
+        goto exit;
+    }
+
+    /* Describe the raw samples so the host can scale them */
+    accel_header_get(&header);
+
+    result = storage_write(&header, sizeof(header));
+    if(result < 0)
+    {
+        LOG_ERR("Write record header - fail. Result %d", result);
+
+        storage_close();
+
+        goto exit;
+    }
+
+    codec_reset(&codec);
+    manager_fusion_reset();
+    manager_decim_reset();
+    manager_summary_begin();
+    prof_reset();
+    record_size = sizeof(header);
+    codec_cycles = 0;
+    record_time = 0;
+    block_time = 0;
+    record_count = 0;
+    record_sensor = 0;
+    gap_count = 0;
+    gap_lost = 0;
+    checkpoint_timestamp = k_uptime_get_32();
+
+    start_request = request;
+    start_latency = 0;
+    start_pending = true;
+    trigger_latency = 0;
+    record_session = id;
+    record_start_offset = 0;
 
-    /* Open storage */
-    result = storage_open();
-    __ASSERT(result == 0, "Fail to open storage. Result %d", result);
+    ble_stream_reset();
 
-    /* and clear previous data */
-    result = storage_clear();
-    __ASSERT(result == 0, "Fail to clear storage. Result %d", result);
+    atomic_set(&state, sampling);
+    manager_pretrigger_reset();
 
     result = accel_record_start();
-    __ASSERT(result == 0, "Failed to start record. Result %d", result);
+    if(result != 0)
+    {
+        LOG_ERR("Start record - fail. Result %d", result);
+
+        storage_close();
+    }
+
+exit:
+    if(result < 0)
+    {
+        atomic_set(&state, MANAGER_IDLE);
+
+        return result;
+    }
+
+    return 0;
 }
 
-void manager_record_stop(void)
+/* Request is the cycle count when the start command came in */
+int manager_record_start(uint32_t request)
+{
+    if(atomic_cas(&state, MANAGER_IDLE, MANAGER_STARTING) == false)
+    {
+        LOG_ERR("Start in state %d", (int)atomic_get(&state));
+
+        return -EBUSY;
+    }
+
+    LOG_INF("Start recording");
+
+    return manager_record_begin(request, MANAGER_STARTING);
+}
+
+int manager_record_stop(void)
 {
     int result = 0;
     struct record_meta meta = {0};
+    struct storage_stats stats = {0};
+    struct ring_stats ring_stats = {0};
+    struct accel_sensor_stats sensor_stats = {0};
+    bool triggered = true;
+
+    if(atomic_cas(&state, MANAGER_TRIGGER_WAIT, MANAGER_FLUSHING) == true)
+    {
+        triggered = false;
+    }
+    else if(atomic_cas(&state, MANAGER_STARTING, MANAGER_FLUSHING) == false &&
+            atomic_cas(&state, MANAGER_RECORDING, MANAGER_FLUSHING) == false)
+    {
+        return -EALREADY;
+    }
 
     LOG_INF("Stop recording");
 
-    if(accel_is_running() == true)
+    result = accel_record_stop();
+    __ASSERT(result == 0, "Failed to stop record. Result %d", result);
+
+    /* Let the manager thread drain the queue and write the last block */
+    flush_request = true;
+    k_sem_take(&manager_flushed, K_FOREVER);
+
+    manager_sync_write();
+    manager_summary_finish();
+
+    ring_stats_get(accel_ring_get(), &ring_stats);
+
+    /* Calculate size */
+    meta.count = record_count;
+    meta.size = record_size;
+    meta.lost = gap_lost; // As the checkpoint and the gap blocks count it
+    meta.gaps = gap_count;
+    meta.high_water = ring_stats.high_water;
+
+    /* Record the totals in the session index */
+    result = storage_session_finish(&meta);
+    __ASSERT(result == 0, "Failed to finish session. Result %d", result);
+
+    trace_value(TRACE_STOP, meta.count, meta.lost, meta.gaps);
+
+    LOG_INF("Record count %d, Lenght %d", meta.count, meta.size);
+
+    LOG_INF("Live stream dropped %d", ble_stream_dropped_get());
+
+    LOG_INF("Ring high water %d of %d, lost %d in %d gaps, %d sensor samples",
+            ring_stats.high_water, ring_stats.size, meta.lost, meta.gaps, accel_lost_get());
+
+    for(int i = 1; i < ACCEL_SENSOR_COUNT; i++)
     {
-        result = accel_record_stop();
-        __ASSERT(result == 0, "Failed to stop record. Result %d", result);
+        accel_sensor_stats_get(i, &sensor_stats);
 
-        /* Calculate size */
-        meta.count = accel_count_get();
-        meta.size = meta.count * sizeof(struct accel_entry);
+        LOG_INF("Sensor %d skew %d us, max %d us, realigned %d", i, sensor_stats.skew_us,
+                sensor_stats.skew_max_us, sensor_stats.realigned);
+    }
 
-        /* Write meta data to flash */
-        result = storage_meta_write(&meta, sizeof(meta));
-        __ASSERT(result >= 0, "Failed to store meta data. Result %d", result);
+    if(meta.count > 0)
+    {
+        LOG_INF("Compression %d%%, %d ns per sample",
+                (int)(meta.size * 100 / (meta.count * ACCEL_SENSOR_COUNT * sizeof(struct accel_entry))),
+                k_cyc_to_ns_floor32(codec_cycles) / meta.count);
 
-        LOG_INF("Record count %d, Lenght %d", meta.count, 
-                                        meta.count * sizeof(struct accel_entry));
+#ifdef CONFIG_MOCAP_FUSION
+        LOG_INF("Fusion %d ns per sample", k_cyc_to_ns_floor32(fusion_cycles) / meta.count);
+#endif
+    }
+
+    /* Close storage */
+    result = storage_close();
+    __ASSERT(result == 0, "Fail to close storage. Result %d", result);
 
-        /* Close storage */
-        result = storage_close();
-        __ASSERT(result == 0, "Fail to close storage. Result %d", result);
+    /* An arm that never went off leaves no take behind */
+    if(triggered == false && meta.count == 0)
+    {
+        LOG_INF("Not triggered, session %d deleted", record_session);
 
-        /* Set status led to down */
-        result = gpio_pin_set(status_led_port, STATUS_LED_PIN, true);
-        __ASSERT(result == 0, "Failed to set status led. Result %d", result);
+        storage_session_delete(record_session);
+    }
+    else if(trigger_latency != 0)
+    {
+        LOG_INF("Trigger to commit %d us", trigger_latency);
     }
+
+    storage_stats_get(&stats);
+
+    LOG_INF("Flushes %d, latency min/mean/max %d/%d/%d us, throughput %d B/s",
+            stats.flush_count, stats.flush_latency_min, stats.flush_latency_mean,
+            stats.flush_latency_max, stats.throughput);
+
+    LOG_INF("Start latency %d us", start_latency);
+
+    /* Set status led to down */
+    result = gpio_pin_set(status_led_port, STATUS_LED_PIN, true);
+    __ASSERT(result == 0, "Failed to set status led. Result %d", result);
+
+    atomic_set(&state, MANAGER_IDLE);
+
+    return 0;
+}
+
+/* A take is being sampled, its file is open for writing */
+static bool manager_is_sampling(void)
+{
+    enum manager_state current = atomic_get(&state);
+
+    return current == MANAGER_STARTING || current == MANAGER_RECORDING ||
+           current == MANAGER_TRIGGER_WAIT;
 }
 
-void manager_storage_open(void)
+int manager_storage_open(uint16_t id)
 {
     int result = 0;
 
-    LOG_INF("Open storage");
+    LOG_INF("Open session %d", id);
 
-    result = storage_open();
-    __ASSERT(result == 0, "Fail to open storage. Result %d", result);
+    if(atomic_get(&state) != MANAGER_IDLE && manager_is_sampling() == false)
+    {
+        return -EBUSY;
+    }
+
+    result = storage_session_open(id);
+    if(result != 0)
+    {
+        LOG_ERR("Open session - fail. Result %d", result);
+    }
+
+    return result;
 }
 
 void manager_storage_close(void)
@@ -129,61 +363,925 @@ void manager_storage_close(void)
 
     LOG_INF("Close storage");
 
-    result = storage_close();
+    /* The read side only, a take being recorded goes on */
+    result = storage_session_close();
     __ASSERT(result == 0, "Fail to close storage. Result %d", result);
 }
 
-void manager_record_meta_get(struct record_meta *meta)
+/* From idle, recording waits until the take is read out. During a take
+ * the download reads beside the writer, and sees the take being
+ * recorded up to its last checkpoint. */
+int manager_download_begin(uint16_t id)
 {
     int result = 0;
 
-    LOG_INF("Get meta");
+    if(atomic_cas(&state, MANAGER_IDLE, MANAGER_DOWNLOADING) == false &&
+       manager_is_sampling() == false)
+    {
+        return -EBUSY;
+    }
 
-    result = storage_meta_read(meta, sizeof(struct record_meta));
-    __ASSERT(result >= 0, "Fail to read meta. Result %d", result);
+    result = storage_session_open(id);
+    if(result != 0)
+    {
+        LOG_ERR("Open session - fail. Result %d", result);
 
-    LOG_INF("Meta size: %d, count %d", meta->size, meta->count);
+        atomic_cas(&state, MANAGER_DOWNLOADING, MANAGER_IDLE);
+    }
+
+    return result;
 }
 
-int manager_record_read(void *buf, uint16_t len)
+void manager_download_end(void)
 {
-    LOG_INF("Read");
+    manager_storage_close();
 
-    ssize_t result = storage_read(buf, len);
-    __ASSERT(result >= 0, "Storage read - fail. Result %d", result);
+    atomic_cas(&state, MANAGER_DOWNLOADING, MANAGER_IDLE);
+}
 
-    LOG_INF("Len %d",  result);
+enum manager_state manager_state_get(void)
+{
+    return (enum manager_state)atomic_get(&state);
+}
 
-    return result;
+uint32_t manager_start_latency_get(void)
+{
+    return start_latency;
 }
 
-static void manager_entry_process(void)
+/* Stored sample times are those of the signal they hold, before the filter delay */
+uint64_t manager_start_time_get(void)
+{
+    return accel_start_time_get() + record_start_offset - record_delay;
+}
+
+uint32_t manager_trigger_latency_get(void)
+{
+    return trigger_latency;
+}
+
+int manager_profile_get(uint8_t stage, struct prof_stats *stats)
+{
+    return prof_get(stage, stats);
+}
+
+int manager_session_get(uint16_t id, struct storage_session *session)
 {
     int result = 0;
-    struct accel_entry entry;
 
-    /* Get data from queue */
-    result = k_msgq_get(accel_queue_get(), &entry, K_FOREVER);
+    result = storage_session_get(id, session);
     if(result == 0)
     {
-        /* Write to storage */
-        result = storage_write(&entry, sizeof(entry));
-        __ASSERT(result >= 0, "Write accel data to storage - fail. Result %d", result);
+        LOG_INF("Session %d size: %d, count %d", session->id, session->meta.size,
+                session->meta.count);
+    }
+
+    return result;
+}
+
+int manager_session_delete(uint16_t id)
+{
+    LOG_INF("Delete session %d", id);
+
+    return storage_session_delete(id);
+}
+
+/* Copy a take of the raw log to a FAT file. Takes seconds, nothing is
+ * recorded or downloaded meanwhile. */
+int manager_session_export(uint16_t id)
+{
+    int result = 0;
+
+    LOG_INF("Export session %d", id);
+
+    if(atomic_cas(&state, MANAGER_IDLE, MANAGER_DOWNLOADING) == false)
+    {
+        return -EBUSY;
+    }
+
+    result = storage_session_export(id);
+    if(result != 0)
+    {
+        LOG_ERR("Export session - fail. Result %d", result);
+    }
+
+    atomic_set(&state, MANAGER_IDLE);
+
+    return result;
+}
+
+/* The side index of a finished take, -ENODATA if it was never completed */
+int manager_summary_get(uint16_t id, struct record_summary *summary)
+{
+    ssize_t result = 0;
+
+    result = storage_summary_read(id, 0, summary, sizeof(*summary));
+    if(result < 0)
+    {
+        return result;
+    }
+
+    if(result != sizeof(*summary) || summary->magic != RECORD_SUMMARY_MAGIC ||
+       summary->blocks == 0)
+    {
+        return -ENODATA;
+    }
+
+    return 0;
+}
+
+/* Statistics of one sensor over the whole take */
+int manager_summary_totals_get(uint16_t id, uint8_t sensor, struct record_stats *totals)
+{
+    ssize_t result = 0;
+
+    result = storage_summary_read(id, sizeof(struct record_summary) + sensor * sizeof(*totals),
+                                  totals, sizeof(*totals));
+    if(result < 0)
+    {
+        return result;
+    }
+
+    return result == sizeof(*totals) ? 0 : -ENODATA;
+}
+
+/* Entries of a finished take's CRC index from first on, returns how many */
+int manager_crc_get(uint16_t id, uint32_t first, struct record_crc *entries, uint8_t count)
+{
+    ssize_t result = 0;
+
+    result = storage_crc_read(id, first, entries, count);
+    if(result < 0)
+    {
+        return result;
+    }
+
+    return result / sizeof(*entries);
+}
+
+int manager_record_read(uint32_t offset, void *buf, uint16_t len)
+{
+    LOG_DBG("Read %d", offset);
+
+    ssize_t result = storage_read(offset, buf, len);
+    if(result < 0)
+    {
+        LOG_ERR("Storage read - fail. Result %d", result);
+    }
+
+    LOG_DBG("Len %d",  result);
 
-        /* For debug purposes */
-        /* Print data on each 100 records */
-        if(accel_count_get() % 100 == 0)
+    return result;
+}
+
+/* Move pos and index on to the last sync point of the CRC index at or
+ * before timeline sample first. Sync points only move on from block to
+ * block, so a binary search reads a few entries. Left as they are for a
+ * take without an index, like the one being recorded. */
+static void manager_record_seek(uint16_t id, uint32_t first, uint32_t *pos, uint32_t *index)
+{
+    uint32_t low = 0;
+    uint32_t high = 0;
+    uint32_t mid = 0;
+    struct record_crc entry = {0};
+    struct storage_session session = {0};
+
+    if(storage_session_get(id, &session) != 0 || session.state != STORAGE_SESSION_CLOSED)
+    {
+        return;
+    }
+
+    high = ceiling_fraction(session.meta.size, RECORD_CRC_BLOCK_SIZE);
+
+    while(low < high)
+    {
+        mid = low + (high - low) / 2;
+
+        if(storage_crc_read(id, mid, &entry, 1) != sizeof(entry))
         {
-            printf("\r\n[%08d] A: %f %f %f G: %f %f %f\r\n", entry.timestamp,
-                                            sensor_value_to_double(&entry.accel[0]),
-                                            sensor_value_to_double(&entry.accel[1]),
-                                            sensor_value_to_double(&entry.accel[2]),
-                                            sensor_value_to_double(&entry.gyro[0]),
-                                            sensor_value_to_double(&entry.gyro[1]),
-                                            sensor_value_to_double(&entry.gyro[2]));
+            return;
+        }
+
+        if(entry.index <= first)
+        {
+            /* Block 0 may still point at the record header */
+            if(entry.sync > *pos)
+            {
+                *pos = entry.sync;
+                *index = entry.index;
+            }
+
+            low = mid + 1;
         }
+        else
+        {
+            high = mid;
+        }
+    }
+}
+
+/* Find the blocks of the opened session that hold samples [first, first + count).
+ * Samples are counted on the timeline, i.e. including the ones lost in gaps,
+ * so the host gets a time window from index = time * sample rate. A sample
+ * holds an entry of every sensor. The CRC index gives a block near the start,
+ * from there only block headers are read, payloads are skipped. */
+int manager_record_range(uint16_t id, uint32_t first, uint32_t count, uint32_t *offset,
+                         uint32_t *size)
+{
+    int result = 0;
+    uint32_t pos = 0;
+    uint32_t start = 0;
+    uint32_t index = 0;
+    uint32_t next = 0;
+    uint16_t sensors = 1;
+    bool found = false;
+    struct record_header header = {0};
+    struct {
+        struct record_block block;
+        struct record_gap gap;
+    } __packed marker = {0};
+
+    result = storage_read(0, &header, sizeof(header));
+    if(result != sizeof(header) || header.magic != RECORD_MAGIC)
+    {
+        return result < 0 ? result : -EINVAL;
+    }
+
+    /* Single sensor takes from before the sensor count was stored */
+    if(header.header_size >= sizeof(header) && header.sensors > 0)
+    {
+        sensors = header.sensors;
+    }
 
+    pos = header.header_size;
+
+    manager_record_seek(id, first, &pos, &index);
+
+    while(count > 0)
+    {
+        result = storage_read(pos, &marker, sizeof(marker));
+        if(result < (int)sizeof(marker.block))
+        {
+            /* End of the take */
+            break;
+        }
+
+        if(marker.block.type == RECORD_BLOCK_GAP)
+        {
+            next = index + marker.gap.lost;
+        }
+        else if(marker.block.type == RECORD_BLOCK_SAMPLES)
+        {
+            next = index + marker.block.count / sensors;
+        }
+        else
+        {
+            /* Quaternions lie within the samples around them, sync is at the end */
+            next = index;
+        }
+
+        if(found == false && next > first)
+        {
+            start = pos;
+            found = true;
+        }
+
+        pos += sizeof(marker.block) + marker.block.size;
+        index = next;
+
+        if(found == true && index - first >= count)
+        {
+            break;
+        }
+    }
+
+    if(result < 0)
+    {
+        return result;
+    }
+
+    *offset = found ? start : pos;
+    *size = found ? pos - start : 0;
+
+    return 0;
+}
+
+int manager_config_set(const struct accel_config *config)
+{
+    LOG_INF("Set config");
+
+    if(decim_ratio_is_valid(config->decimation) == false)
+    {
+        return -EINVAL;
+    }
+
+    /* Refused while recording, the header describes the whole take */
+    return accel_config_set(config);
+}
+
+void manager_config_get(struct accel_config *config)
+{
+    accel_config_get(config);
+}
+
+/* Blocks end on whole samples, so after one the totals match the file */
+static void manager_checkpoint(void)
+{
+    struct ring_stats ring_stats = {0};
+    struct record_meta meta = {0};
+
+    if(CHECKPOINT_PERIOD_MS == 0 ||
+       k_uptime_get_32() - checkpoint_timestamp < CHECKPOINT_PERIOD_MS)
+    {
+        return;
+    }
+
+    checkpoint_timestamp = k_uptime_get_32();
+
+    ring_stats_get(accel_ring_get(), &ring_stats);
+
+    meta.size = record_size;
+    meta.count = record_count;
+    meta.lost = gap_lost;
+    meta.gaps = gap_count;
+    meta.high_water = ring_stats.high_water;
+
+    storage_checkpoint(&meta);
+}
+
+static void manager_block_write(void)
+{
+    int result = 0;
+    size_t len = codec_block_finish(&codec);
+    uint32_t start = k_cycle_get_32(); // The trace needs it without profiling too
+
+    /* Blocks hold whole samples, the last one is the latest stored */
+    result = storage_samples_write(codec.block, len, record_count - codec.count / ACCEL_SENSOR_COUNT,
+                                   record_count);
+    __ASSERT(result >= 0, "Write accel data to storage - fail. Result %d", result);
+
+    trace_value(TRACE_BLOCK, RECORD_BLOCK_SAMPLES, len, k_cycle_get_32() - start);
+    prof_stop(PROF_STORAGE_WRITE, start);
+
+    record_size += len;
+    block_time = record_time;
+    codec_reset(&codec);
+
+    manager_checkpoint();
+}
+
+/* Mark dropped samples in the recording, after the samples before them */
+static void manager_gap_write(uint16_t lost)
+{
+    int result = 0;
+    struct {
+        struct record_block block;
+        struct record_gap gap;
+    } __packed marker = {
+        .block = {
+            .type  = RECORD_BLOCK_GAP,
+            .size  = sizeof(struct record_gap),
+            .count = 0,
+        },
+        .gap = {
+            .timestamp   = record_time / USEC_PER_MSEC,
+            .index       = record_count,
+            .lost        = lost,
+            .sample_rate = accel_sample_rate_get() / record_decimation,
+        },
+    };
+
+    if(codec_is_empty(&codec) == false)
+    {
+        manager_block_write();
+    }
+
+    result = storage_gap_write(&marker, sizeof(marker), lost);
+    __ASSERT(result >= 0, "Write gap marker - fail. Result %d", result);
+
+    trace_value(TRACE_GAP, record_count, lost, marker.gap.sample_rate);
+
+    record_size += sizeof(marker);
+    gap_count++;
+    gap_lost += lost;
+}
+
+/* Store the clock estimate with the take, so it can be put on the host
+ * time line. Takes made before any sync have no sync block. */
+static void manager_sync_write(void)
+{
+    int result = 0;
+    struct record_sync sync = {0};
+    struct {
+        struct record_block block;
+        struct record_sync sync;
+    } __packed marker = {
+        .block = {
+            .type  = RECORD_BLOCK_SYNC,
+            .size  = sizeof(struct record_sync),
+            .count = 0,
+        },
+    };
+
+    if(record_count == 0 || timesync_get(&sync) != 0)
+    {
+        return;
+    }
+
+    sync.start_us = manager_start_time_get();
+    marker.sync = sync;
+
+    result = storage_write(&marker, sizeof(marker));
+    __ASSERT(result >= 0, "Write sync - fail. Result %d", result);
+
+    record_size += sizeof(marker);
+
+    LOG_INF("Sync offset %lld us, error %d us, drift %d ppb", sync.offset_us, sync.error_us,
+            sync.drift_ppb);
+}
+
+#ifdef CONFIG_MOCAP_FUSION
+static void manager_quat_write(void)
+{
+    int result = 0;
+    size_t size = sizeof(struct record_quat) + quat_block.block.count * sizeof(struct fusion_quat);
+
+    quat_block.block.type = RECORD_BLOCK_QUAT;
+    quat_block.block.size = size;
+
+    result = storage_write(&quat_block, sizeof(struct record_block) + size);
+    __ASSERT(result >= 0, "Write quaternions - fail. Result %d", result);
+
+    record_size += sizeof(struct record_block) + size;
+    quat_block.block.count = 0;
+}
+
+static void manager_fusion_reset(void)
+{
+    struct accel_config config = {0};
+
+    accel_config_get(&config);
+    fusion_reset(config.gyro_fs, accel_tick_us_get());
+
+    memset(&quat_block, 0, sizeof(quat_block));
+    quat_block.quat.decimation = CONFIG_MOCAP_FUSION_DECIMATION;
+    fusion_cycles = 0;
+    fusion_skip = 0;
+}
+
+/* Fuse one sample, keep every decimation-th orientation */
+static void manager_fusion_put(const struct accel_entry *entry, struct fusion_quat *quat)
+{
+    uint32_t start = k_cycle_get_32();
+    uint32_t cycles = 0;
+
+    fusion_update(entry);
+    fusion_get(quat);
+
+    cycles = k_cycle_get_32() - start;
+    fusion_cycles += cycles;
+    prof_add(PROF_FUSION, cycles);
+
+    if(++fusion_skip < CONFIG_MOCAP_FUSION_DECIMATION)
+    {
+        return;
+    }
+
+    fusion_skip = 0;
+
+    if(quat_block.block.count == 0)
+    {
+        quat_block.quat.index = record_count;
+    }
+
+    quat_block.quats[quat_block.block.count++] = *quat;
+}
+
+/* Called on whole samples. A full quaternion block follows the sample
+ * blocks it was taken after, so those are written out first. */
+static void manager_fusion_commit(void)
+{
+    if(quat_block.block.count < QUAT_BLOCK_COUNT)
+    {
+        return;
+    }
+
+    if(codec_is_empty(&codec) == false)
+    {
+        manager_block_write();
+    }
+
+    manager_quat_write();
+}
+
+static void manager_fusion_flush(void)
+{
+    if(quat_block.block.count > 0)
+    {
+        manager_quat_write();
+    }
+}
+#else
+static void manager_fusion_reset(void) {}
+static void manager_fusion_put(const struct accel_entry *entry, struct fusion_quat *quat) {}
+static void manager_fusion_commit(void) {}
+static void manager_fusion_flush(void) {}
+#endif
+
+/* Store one entry of a sample, the first sensor's comes first */
+static void manager_entry_record(const struct accel_entry *entry, uint16_t lost)
+{
+    uint32_t start = 0;
+    uint32_t cycles = 0;
+    struct fusion_quat quat = {0};
+
+    /* Time and losses are carried by the first sensor of a sample */
+    if(record_sensor == 0)
+    {
+        record_time += (uint32_t)entry->delta * accel_tick_us_get();
+
+        if(lost != 0)
+        {
+            manager_gap_write(lost);
+        }
+    }
+
+    /* Compress, and write to storage once a block is complete */
+    start = k_cycle_get_32();
+    codec_put(&codec, entry);
+    cycles = k_cycle_get_32() - start;
+    codec_cycles += cycles;
+    prof_add(PROF_CODEC, cycles);
+
+    manager_summary_put(entry);
+
+    /* Orientation and live preview follow the first sensor */
+    if(record_sensor == 0)
+    {
+        manager_fusion_put(entry, &quat);
+
+        /* Live preview, never blocks the recording */
+        start = prof_start();
+        ble_stream_put(entry, IS_ENABLED(CONFIG_MOCAP_FUSION) ? &quat : NULL);
+        prof_stop(PROF_STREAM, start);
+    }
+
+    if(++record_sensor < ACCEL_SENSOR_COUNT)
+    {
+        return;
+    }
+
+    /* Blocks end on whole samples */
+    record_sensor = 0;
+    record_count++;
+
+    if(codec_is_full(&codec) == true || record_time - block_time >= BLOCK_SPAN_MAX_US)
+    {
+        manager_block_write();
+    }
+
+    manager_fusion_commit();
+}
+
+#ifdef CONFIG_MOCAP_PRETRIGGER
+static bool pretrigger_waiting = false;
+
+static void manager_pretrigger_reset(void)
+{
+    pretrigger_head = 0;
+    pretrigger_count = 0;
+    pretrigger_fired = false;
+    pretrigger_waiting = (atomic_get(&state) == MANAGER_TRIGGER_WAIT);
+}
+
+/* Squared magnitudes, so no square root is needed. Each axis is at most
+ * 2^15, the sum of three squares still fits in 32 bits. */
+static uint32_t manager_magnitude2(const int16_t *axes)
+{
+    uint32_t sum = 0;
+
+    for(int i = 0; i < 3; i++)
+    {
+        sum += (int32_t)axes[i] * axes[i];
+    }
+
+    return sum;
+}
+
+static bool manager_motion_detect(const struct accel_entry *entry)
+{
+    uint32_t accel = 0;
+
+    if(trigger_accel_max != 0)
+    {
+        accel = manager_magnitude2(entry->accel);
+        if(accel > trigger_accel_max || accel < trigger_accel_min)
+        {
+            return true;
+        }
+    }
+
+    return trigger_gyro_max != 0 && manager_magnitude2(entry->gyro) > trigger_gyro_max;
+}
+
+/* Keep the entry in the pre-trigger ring. True once a whole sample
+ * is in and some sensor of it has moved. */
+static bool manager_pretrigger_put(const struct accel_entry *entry, uint16_t lost)
+{
+    if(record_sensor == 0)
+    {
+        /* The oldest sample drops out, the take will start after it */
+        if(pretrigger_count == PRETRIGGER_SAMPLES)
+        {
+            record_start_offset +=
+                pretrigger[pretrigger_head].entries[0].delta * accel_tick_us_get();
+        }
+
+        pretrigger[pretrigger_head].lost = lost;
+    }
+
+    pretrigger[pretrigger_head].entries[record_sensor] = *entry;
+
+    if(pretrigger_fired == false && manager_motion_detect(entry) == true)
+    {
+        pretrigger_fired = true;
+        trigger_cycles = k_cycle_get_32();
+    }
+
+    if(++record_sensor < ACCEL_SENSOR_COUNT)
+    {
+        return false;
+    }
+
+    record_sensor = 0;
+    pretrigger_head = (pretrigger_head + 1) % PRETRIGGER_SAMPLES;
+    pretrigger_count = MIN(pretrigger_count + 1, PRETRIGGER_SAMPLES);
+
+    return pretrigger_fired;
+}
+
+/* Store the history up to the triggering sample as the start of the take,
+ * then hand it to storage right away. Live samples follow without a gap. */
+static void manager_pretrigger_commit(void)
+{
+    uint16_t index = (pretrigger_head + PRETRIGGER_SAMPLES - pretrigger_count) % PRETRIGGER_SAMPLES;
+
+    pretrigger_waiting = false;
+
+    /* A stop may already have moved on to flushing */
+    atomic_cas(&state, MANAGER_TRIGGER_WAIT, MANAGER_RECORDING);
+
+    /* The take starts at the oldest sample kept */
+    record_start_offset += pretrigger[index].entries[0].delta * accel_tick_us_get();
+    pretrigger[index].entries[0].delta = 0;
+    pretrigger[index].lost = 0;
+
+    for(int i = 0; i < pretrigger_count; i++)
+    {
+        for(int sensor = 0; sensor < ACCEL_SENSOR_COUNT; sensor++)
+        {
+            manager_entry_record(&pretrigger[index].entries[sensor],
+                                 sensor == 0 ? pretrigger[index].lost : 0);
+        }
+
+        index = (index + 1) % PRETRIGGER_SAMPLES;
+    }
+
+    if(codec_is_empty(&codec) == false)
+    {
+        manager_block_write();
+    }
+
+    trigger_latency = k_cyc_to_us_floor32(k_cycle_get_32() - trigger_cycles);
+
+    trace_value(TRACE_TRIGGER, record_session, pretrigger_count, trigger_latency);
+
+    LOG_INF("Triggered, %d samples of history, committed after %d us", pretrigger_count,
+            trigger_latency);
+}
+
+/* True while the entry went to the pre-trigger ring instead of the take */
+static bool manager_pretrigger_process(const struct accel_entry *entry, uint16_t lost)
+{
+    if(pretrigger_waiting == false)
+    {
+        return false;
+    }
+
+    if(manager_pretrigger_put(entry, lost) == true)
+    {
+        manager_pretrigger_commit();
+    }
+
+    return true;
+}
+
+/* Thresholds in raw units for the full scale in effect */
+static void manager_trigger_set(const struct manager_trigger *trigger)
+{
+    struct accel_config config = {0};
+    uint32_t one_g = 0;
+    uint32_t accel = 0;
+    uint64_t gyro = 0;
+
+    accel_config_get(&config);
+
+    one_g = 16384 >> config.accel_fs;
+    accel = (uint32_t)trigger->accel_mg * one_g / 1000;
+    gyro = (uint64_t)trigger->gyro_dps * 32768 / (250 << config.gyro_fs);
+
+    trigger_accel_max = 0;
+    trigger_accel_min = 0;
+    trigger_gyro_max = MIN(gyro * gyro, UINT32_MAX);
+
+    if(trigger->accel_mg != 0)
+    {
+        trigger_accel_max = MIN((uint64_t)(one_g + accel) * (one_g + accel), UINT32_MAX);
+        trigger_accel_min = (accel < one_g) ? (one_g - accel) * (one_g - accel) : 0;
+    }
+}
+
+/* Sample into the pre-trigger ring until the motion detector fires */
+int manager_record_arm(uint32_t request, const struct manager_trigger *trigger)
+{
+    if(trigger->accel_mg == 0 && trigger->gyro_dps == 0)
+    {
+        return -EINVAL;
+    }
+
+    if(atomic_cas(&state, MANAGER_IDLE, MANAGER_STARTING) == false)
+    {
+        LOG_ERR("Arm in state %d", (int)atomic_get(&state));
+
+        return -EBUSY;
+    }
+
+    manager_trigger_set(trigger);
+
+    LOG_INF("Armed, %d mg, %d dps", trigger->accel_mg, trigger->gyro_dps);
+
+    return manager_record_begin(request, MANAGER_TRIGGER_WAIT);
+}
+#else
+static void manager_pretrigger_reset(void) {}
+static bool manager_pretrigger_process(const struct accel_entry *entry, uint16_t lost)
+{
+    return false;
+}
+
+int manager_record_arm(uint32_t request, const struct manager_trigger *trigger)
+{
+    return -ENOTSUP;
+}
+#endif
+
+#ifdef CONFIG_MOCAP_SUMMARY
+/* Header and totals of the side index. Written once with no blocks
+ * before the first block record, so the records land after it. */
+static void manager_summary_header_write(void)
+{
+    int result = 0;
+    struct record_summary summary = {0};
+    struct record_stats totals = {0};
+
+    summary_get(&summary);
+
+    result = storage_summary_write(0, &summary, sizeof(summary));
+
+    for(int sensor = 0; result == 0 && sensor < ACCEL_SENSOR_COUNT; sensor++)
+    {
+        summary_totals_get(sensor, &totals);
+
+        result = storage_summary_write(sizeof(summary) + sensor * sizeof(totals), &totals,
+                                       sizeof(totals));
+    }
+
+    if(result != 0)
+    {
+        LOG_ERR("Write summary - fail. Result %d", result);
+    }
+}
+
+static void manager_summary_begin(void)
+{
+    summary_reset();
+    manager_summary_header_write();
+}
+
+static void manager_summary_put(const struct accel_entry *entry)
+{
+    struct record_stats block = {0};
+    uint32_t start = prof_start();
+
+    if(summary_put(record_sensor, entry, &block) == true && storage_summary_put(&block) != 0)
+    {
+        LOG_WRN("Summary of sample %d dropped", block.index);
+    }
+
+    prof_stop(PROF_SUMMARY, start);
+}
+
+static void manager_summary_finish(void)
+{
+    struct record_stats block = {0};
+
+    for(int sensor = 0; sensor < ACCEL_SENSOR_COUNT; sensor++)
+    {
+        if(summary_flush(sensor, &block) == true && storage_summary_put(&block) != 0)
+        {
+            LOG_WRN("Summary of sample %d dropped", block.index);
+        }
+    }
+
+    manager_summary_header_write();
+}
+#else
+static void manager_summary_begin(void) {}
+static void manager_summary_put(const struct accel_entry *entry) {}
+static void manager_summary_finish(void) {}
+#endif
+
+static void manager_decim_reset(void)
+{
+    struct accel_config config = {0};
+
+    accel_config_get(&config);
+
+    record_decimation = config.decimation;
+    record_delay = decim_delay_halves(record_decimation) * accel_period_us_get() / 2;
+    decim_sensor = 0;
+    decim_reset(record_decimation);
+}
+
+static void manager_entry_process(void)
+{
+    uint32_t count = 0;
+    uint32_t start = 0;
+    uint16_t *lost = NULL;
+    uint16_t out_lost = 0;
+    bool emitted = false;
+    struct accel_entry out = {0};
+    struct accel_entry *span = NULL;
+    struct ring *ring = accel_ring_get();
+
+    /* Get a contiguous span of samples, processed in place */
+    count = ring_peek(ring, &span, &lost, PROCESS_TIMEOUT);
+    if(count > 0)
+    {
+        /* A stop may already have moved on to flushing, then this is not the first sample.
+         * An armed take counts its first sample into the pre-trigger ring. */
+        if(start_pending == true &&
+           (atomic_cas(&state, MANAGER_STARTING, MANAGER_RECORDING) == true ||
+            atomic_get(&state) == MANAGER_TRIGGER_WAIT))
+        {
+            start_pending = false;
+            start_latency = k_cyc_to_us_floor32(k_cycle_get_32() - start_request);
+
+            trace_value(TRACE_START, record_session, accel_sample_rate_get(), start_latency);
+
+            LOG_INF("First sample after %d us", start_latency);
+        }
+
+        for(uint32_t i = 0; i < count; i++)
+        {
+            /* Everything past the filter sees the stored rate only */
+            start = prof_start();
+            emitted = decim_put(decim_sensor, &span[i], lost[i], &out, &out_lost);
+            prof_stop(PROF_DECIM, start);
+
+            decim_sensor = (decim_sensor + 1) % ACCEL_SENSOR_COUNT;
+
+            if(emitted == true && manager_pretrigger_process(&out, out_lost) == false)
+            {
+                manager_entry_record(&out, out_lost);
+            }
+        }
+
+        /* Trace the raw axes of about every 100th sample */
+        if(accel_count_get() % TRACE_SAMPLE_PERIOD < count)
+        {
+            trace_put(TRACE_SAMPLE, span[0].accel,
+                      sizeof(struct accel_entry) - offsetof(struct accel_entry, accel));
+        }
+
+        ring_release(ring, count);
+
+        start = prof_start();
         gpio_pin_toggle(status_led_port, STATUS_LED_PIN);
+        prof_stop(PROF_LED, start);
+    }
+    else if(flush_request == true)
+    {
+        /* Ring is drained, write out the partial blocks */
+        if(codec_is_empty(&codec) == false)
+        {
+            manager_block_write();
+        }
+
+        manager_fusion_flush();
+
+        flush_request = false;
+        k_sem_give(&manager_flushed);
     }
 }
 
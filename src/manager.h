@@ -4,19 +4,61 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-struct record_meta
+#include "accel.h"
+#include "storage.h"
+#include "prof.h"
+
+/* Recorder state, commands are accepted only in the states they start from */
+enum manager_state
 {
-    size_t size;
-    uint32_t count;
+    MANAGER_IDLE        = 0,
+    MANAGER_STARTING    = 1, // Take created, waiting for the first sample
+    MANAGER_RECORDING   = 2,
+    MANAGER_FLUSHING    = 3, // Stopping, writing out the last block
+    MANAGER_DOWNLOADING = 4,
+    MANAGER_TRIGGER_WAIT = 5, // Take created, sampling into the pre-trigger ring
 };
 
+/* Motion that starts an armed take. Acceleration triggers when its
+ * magnitude is this far from 1 g, rotation when its magnitude is above
+ * this rate. 0 turns a detector off. */
+struct manager_trigger
+{
+    uint16_t accel_mg;
+    uint16_t gyro_dps;
+} __packed;
+
+#ifdef CONFIG_MOCAP_PRETRIGGER
+#define MANAGER_TRIGGER_ACCEL_MG CONFIG_MOCAP_TRIGGER_ACCEL_MG
+#define MANAGER_TRIGGER_GYRO_DPS CONFIG_MOCAP_TRIGGER_GYRO_DPS
+#else
+#define MANAGER_TRIGGER_ACCEL_MG 0
+#define MANAGER_TRIGGER_GYRO_DPS 0
+#endif
 
-void manager_record_start(void);
-void manager_record_stop(void);
-void manager_storage_open(void);
+int manager_record_start(uint32_t request);
+int manager_record_arm(uint32_t request, const struct manager_trigger *trigger);
+int manager_record_stop(void);
+int manager_storage_open(uint16_t id);
 void manager_storage_close(void);
-void manager_record_meta_get(struct record_meta *meta);
-int manager_record_read(void *buf, uint16_t len);
+int manager_download_begin(uint16_t id);
+void manager_download_end(void);
+enum manager_state manager_state_get(void);
+uint32_t manager_start_latency_get(void);
+uint64_t manager_start_time_get(void);
+uint32_t manager_trigger_latency_get(void);
+int manager_profile_get(uint8_t stage, struct prof_stats *stats);
+int manager_session_get(uint16_t id, struct storage_session *session);
+int manager_session_delete(uint16_t id);
+int manager_session_export(uint16_t id);
+int manager_summary_get(uint16_t id, struct record_summary *summary);
+int manager_summary_totals_get(uint16_t id, uint8_t sensor, struct record_stats *totals);
+int manager_crc_get(uint16_t id, uint32_t first, struct record_crc *entries, uint8_t count);
+int manager_record_read(uint32_t offset, void *buf, uint16_t len);
+int manager_record_range(uint16_t id, uint32_t first, uint32_t count, uint32_t *offset,
+                         uint32_t *size);
+int manager_config_set(const struct accel_config *config);
+void manager_config_get(struct accel_config *config);
 void manager_entry(void *p1, void *p2, void *p3);
 
 #endif
\ No newline at end of file
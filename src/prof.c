@@ -0,0 +1,94 @@
+#include <zephyr.h>
+#include <string.h>
+
+#include "prof.h"
+
+struct prof_stage_data
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint16_t hist[PROF_BUCKETS];
+};
+
+static struct prof_stage_data stages[PROF_STAGE_COUNT];
+
+/* Log2 bucket by shifting, Cortex-M0 has no count leading zeros */
+static uint8_t prof_bucket(uint32_t cycles)
+{
+    uint8_t bucket = 0;
+
+    while(cycles != 0 && bucket < PROF_BUCKETS - 1)
+    {
+        cycles >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+void prof_add(enum prof_stage stage, uint32_t cycles)
+{
+    struct prof_stage_data *data = &stages[stage];
+    uint8_t bucket = prof_bucket(cycles);
+    unsigned int key = 0;
+
+    /* Stages are fed from several threads, the reader wants a consistent copy */
+    key = irq_lock();
+
+    if(data->count == 0 || cycles < data->min)
+    {
+        data->min = cycles;
+    }
+
+    if(cycles > data->max)
+    {
+        data->max = cycles;
+    }
+
+    data->count++;
+    data->total += cycles;
+
+    if(data->hist[bucket] < UINT16_MAX)
+    {
+        data->hist[bucket]++;
+    }
+
+    irq_unlock(key);
+}
+
+void prof_reset(void)
+{
+    unsigned int key = irq_lock();
+
+    memset(stages, 0, sizeof(stages));
+
+    irq_unlock(key);
+}
+
+int prof_get(enum prof_stage stage, struct prof_stats *stats)
+{
+    struct prof_stage_data data = {0};
+    unsigned int key = 0;
+
+    if(stage >= PROF_STAGE_COUNT)
+    {
+        return -EINVAL;
+    }
+
+    key = irq_lock();
+    data = stages[stage];
+    irq_unlock(key);
+
+    /* The counter may be slow (32 kHz RTC on nRF51), but the per-call
+     * quantization error averages out, so the mean stays meaningful */
+    stats->count = data.count;
+    stats->min_ns = k_cyc_to_ns_floor64(data.min);
+    stats->max_ns = k_cyc_to_ns_floor64(data.max);
+    stats->mean_ns = data.count > 0 ? k_cyc_to_ns_floor64(data.total) / data.count : 0;
+    stats->cycles_per_sec = sys_clock_hw_cycles_per_sec();
+    memcpy(stats->hist, data.hist, sizeof(stats->hist));
+
+    return 0;
+}
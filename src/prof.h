@@ -0,0 +1,66 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <zephyr.h>
+#include <stdint.h>
+
+/* Pipeline stages, timed per call with the kernel cycle counter */
+enum prof_stage
+{
+    PROF_WAKE = 0,      // FIFO timer expiry to the FIFO thread running
+    PROF_SENSOR_READ,   // One register transfer
+    PROF_BURST,         // Decode and ring put of one FIFO burst, or one triggered sample
+    PROF_DECIM,         // decim_put() of one raw entry
+    PROF_CODEC,         // codec_put() of one sample
+    PROF_SUMMARY,       // Block statistics of one sample
+    PROF_FUSION,        // Orientation update of one sample
+    PROF_STREAM,        // ble_stream_put() of one sample
+    PROF_STORAGE_WRITE, // storage_write(), waits when the writer is behind
+    PROF_STORAGE_FLUSH, // fs_write() of one block in the writer thread
+    PROF_STORAGE_CRC,   // CRC-32 of one written block
+    PROF_LED,           // gpio_pin_toggle() of the status LED
+    PROF_STAGE_COUNT
+};
+
+/* Bucket 0 counts zero cycles, bucket i durations in [2^(i-1), 2^i) cycles,
+ * the last one everything longer */
+#define PROF_BUCKETS 16
+
+struct prof_stats
+{
+    uint32_t count;
+    uint32_t min_ns;
+    uint32_t max_ns;
+    uint32_t mean_ns;
+    uint32_t cycles_per_sec;
+    uint16_t hist[PROF_BUCKETS];
+};
+
+#ifdef CONFIG_MOCAP_PROFILE
+
+void prof_add(enum prof_stage stage, uint32_t cycles);
+void prof_reset(void);
+int prof_get(enum prof_stage stage, struct prof_stats *stats);
+
+static inline uint32_t prof_start(void)
+{
+    return k_cycle_get_32();
+}
+
+static inline void prof_stop(enum prof_stage stage, uint32_t start)
+{
+    prof_add(stage, k_cycle_get_32() - start);
+}
+
+#else
+
+/* Compiled out, not even the counter is read */
+static inline void prof_add(enum prof_stage stage, uint32_t cycles) {}
+static inline void prof_reset(void) {}
+static inline int prof_get(enum prof_stage stage, struct prof_stats *stats) { return -ENOTSUP; }
+static inline uint32_t prof_start(void) { return 0; }
+static inline void prof_stop(enum prof_stage stage, uint32_t start) {}
+
+#endif
+
+#endif
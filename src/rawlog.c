@@ -0,0 +1,533 @@
+#include <zephyr.h>
+#include <disk/disk_access.h>
+#include <logging/log.h>
+#include <sys/crc.h>
+#include <string.h>
+
+#include "rawlog.h"
+#include "storage.h"
+
+LOG_MODULE_REGISTER(rawlog);
+
+/* Region layout: a superblock in the first sector, a segment table of
+ * RAWLOG_SEGMENTS entries, a sector each so committing one is a single
+ * write, then the data. A segment is one take, its sectors follow those
+ * of the segment before it. Entries of an older generation are free, so
+ * the whole log is reset with one superblock write. All fields are
+ * little endian, tools/rawlog_export.py reads the same layout. */
+
+#define RAWLOG_MAGIC         0x474F4C52 /* "RLOG" */
+#define RAWLOG_SEGMENT_MAGIC 0x544E4753 /* "SGNT" */
+#define RAWLOG_VERSION       1
+#define RAWLOG_SEGMENTS      CONFIG_MOCAP_STORAGE_RAWLOG_SEGMENTS
+#define RAWLOG_TABLE         1 // First sector of the segment table
+#define RAWLOG_DATA          (RAWLOG_TABLE + RAWLOG_SEGMENTS)
+
+struct rawlog_super
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t segments;   /* Segment table entries */
+    uint32_t sectors;    /* Region size, superblock included */
+    uint32_t generation; /* Of the entries in use */
+    uint32_t crc;        /* CRC-32 of everything before it */
+};
+
+struct rawlog_segment
+{
+    uint32_t magic;
+    uint32_t generation;
+    uint16_t id;         /* Session id */
+    uint8_t state;       /* STORAGE_SESSION_* */
+    uint8_t reserved;
+    uint32_t start;      /* First sector, from the start of the region */
+    uint32_t size;       /* Bytes, as of the last sync */
+    uint32_t crc;        /* CRC-32 of everything before it */
+};
+
+static const char *disk_name = NULL;
+static uint32_t region_first = 0;
+static uint32_t region_sectors = 0;
+static uint32_t generation = 0;
+static uint16_t segment_count = 0; // Entries of the current generation
+static uint16_t segment_live = 0;  // Of those, not deleted
+static uint32_t append = RAWLOG_DATA; // First sector after the closed segments
+
+/* Bounce buffer of the partial sector reads and writes */
+static uint8_t sector[RAWLOG_SECTOR_SIZE] __aligned(4);
+
+static int rawlog_sector_read(uint32_t index, void *data)
+{
+    return disk_access_read(disk_name, data, region_first + index, 1);
+}
+
+static int rawlog_sector_write(uint32_t index, const void *data)
+{
+    return disk_access_write(disk_name, data, region_first + index, 1);
+}
+
+static int rawlog_super_write(void)
+{
+    int result = 0;
+    struct rawlog_super super = {
+        .magic      = RAWLOG_MAGIC,
+        .version    = RAWLOG_VERSION,
+        .segments   = RAWLOG_SEGMENTS,
+        .sectors    = region_sectors,
+        .generation = generation,
+    };
+
+    super.crc = crc32_ieee((const uint8_t *)&super, offsetof(struct rawlog_super, crc));
+
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &super, sizeof(super));
+
+    result = rawlog_sector_write(0, sector);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    return disk_access_ioctl(disk_name, DISK_IOCTL_CTRL_SYNC, NULL);
+}
+
+static int rawlog_segment_read(uint16_t slot, struct rawlog_segment *segment)
+{
+    int result = 0;
+
+    result = rawlog_sector_read(RAWLOG_TABLE + slot, sector);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    memcpy(segment, sector, sizeof(*segment));
+
+    if(segment->magic != RAWLOG_SEGMENT_MAGIC || segment->generation != generation ||
+       segment->crc != crc32_ieee((const uint8_t *)segment, offsetof(struct rawlog_segment, crc)))
+    {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+static int rawlog_segment_write(const struct rawlog_file *file, uint8_t state)
+{
+    struct rawlog_segment segment = {
+        .magic      = RAWLOG_SEGMENT_MAGIC,
+        .generation = generation,
+        .id         = file->id,
+        .state      = state,
+        .start      = file->start,
+        .size       = file->size,
+    };
+
+    segment.crc = crc32_ieee((const uint8_t *)&segment, offsetof(struct rawlog_segment, crc));
+
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &segment, sizeof(segment));
+
+    return rawlog_sector_write(RAWLOG_TABLE + file->slot, sector);
+}
+
+/* An empty log, with the table cleared so no entry of an earlier
+ * format can pass for one of this generation */
+static int rawlog_format(void)
+{
+    int result = 0;
+
+    LOG_WRN("No log on %s at sector %u, format", disk_name, region_first);
+
+    memset(sector, 0, sizeof(sector));
+
+    for(int i = 0; i < RAWLOG_SEGMENTS; i++)
+    {
+        result = rawlog_sector_write(RAWLOG_TABLE + i, sector);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+
+    generation = 1;
+
+    return rawlog_super_write();
+}
+
+/* Entries are used in order, the first one that is not valid ends the table */
+static int rawlog_scan(void)
+{
+    int result = 0;
+    struct rawlog_segment segment = {0};
+
+    segment_count = 0;
+    segment_live = 0;
+    append = RAWLOG_DATA;
+
+    while(segment_count < RAWLOG_SEGMENTS)
+    {
+        result = rawlog_segment_read(segment_count, &segment);
+        if(result == -ENOENT)
+        {
+            break;
+        }
+
+        if(result != 0)
+        {
+            return result;
+        }
+
+        segment_count++;
+
+        if(segment.state != STORAGE_SESSION_DELETED)
+        {
+            segment_live++;
+        }
+
+        append = segment.start + ceiling_fraction(segment.size, RAWLOG_SECTOR_SIZE);
+    }
+
+    return 0;
+}
+
+int rawlog_init(const char *disk, uint32_t first, uint32_t sectors)
+{
+    int result = 0;
+    struct rawlog_super super = {0};
+
+    disk_name = disk;
+    region_first = first;
+    region_sectors = sectors;
+
+    if(region_sectors <= RAWLOG_DATA)
+    {
+        return -ENOSPC;
+    }
+
+    result = rawlog_sector_read(0, sector);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    memcpy(&super, sector, sizeof(super));
+
+    if(super.magic != RAWLOG_MAGIC ||
+       super.crc != crc32_ieee((const uint8_t *)&super, offsetof(struct rawlog_super, crc)))
+    {
+        result = rawlog_format();
+    }
+    else if(super.segments != RAWLOG_SEGMENTS || super.sectors != region_sectors)
+    {
+        /* Not reformatted, that would lose every take in it */
+        LOG_ERR("Log of %u sectors, %u segments, expected %u, %u", super.sectors,
+                super.segments, region_sectors, RAWLOG_SEGMENTS);
+
+        result = -EINVAL;
+    }
+    else
+    {
+        generation = super.generation;
+    }
+
+    if(result != 0)
+    {
+        return result;
+    }
+
+    result = rawlog_scan();
+    if(result != 0)
+    {
+        return result;
+    }
+
+    LOG_INF("%u segments, %u of %u sectors used", segment_count, append, region_sectors);
+
+    return 0;
+}
+
+/* A new segment at the end of the log. It may grow up to the end of the
+ * region, its size is only known once it is closed. */
+int rawlog_create(struct rawlog_file *file, uint16_t id)
+{
+    int result = 0;
+
+    /* Every take in the log is gone, start over from the first sector */
+    if(segment_count > 0 && segment_live == 0)
+    {
+        generation++;
+
+        result = rawlog_super_write();
+        if(result != 0)
+        {
+            return result;
+        }
+
+        segment_count = 0;
+        append = RAWLOG_DATA;
+    }
+
+    if(segment_count == RAWLOG_SEGMENTS || append >= region_sectors)
+    {
+        return -ENOSPC;
+    }
+
+    file->id = id;
+    file->slot = segment_count;
+    file->start = append;
+    file->size = 0;
+    file->write = true;
+
+    result = rawlog_segment_write(file, STORAGE_SESSION_RECORDING);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    segment_count++;
+    segment_live++;
+
+    return 0;
+}
+
+/* The newest segment of a take, deleted ones are skipped */
+static int rawlog_find(uint16_t id, uint16_t *slot, struct rawlog_segment *segment)
+{
+    int result = 0;
+
+    for(int i = segment_count - 1; i >= 0; i--)
+    {
+        result = rawlog_segment_read(i, segment);
+        if(result != 0)
+        {
+            return result;
+        }
+
+        if(segment->id == id && segment->state != STORAGE_SESSION_DELETED)
+        {
+            *slot = i;
+
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+int rawlog_open(struct rawlog_file *file, uint16_t id, bool write)
+{
+    int result = 0;
+    uint16_t slot = 0;
+    struct rawlog_segment segment = {0};
+
+    result = rawlog_find(id, &slot, &segment);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    file->id = id;
+    file->slot = slot;
+    file->start = segment.start;
+    file->size = segment.size;
+    file->write = write;
+
+    return 0;
+}
+
+/* Appends only. Whole sectors go straight from data to the card, a
+ * partial one is merged with what the sector already holds. */
+ssize_t rawlog_write(struct rawlog_file *file, const void *data, size_t size)
+{
+    int result = 0;
+    size_t done = 0;
+    size_t chunk = 0;
+    uint32_t offset = 0;
+    uint32_t index = 0;
+
+    /* Only the newest segment has room after it */
+    if(file->write == false || file->slot != segment_count - 1)
+    {
+        return -EBADF;
+    }
+
+    if((uint64_t)file->size + size > (uint64_t)(region_sectors - file->start) * RAWLOG_SECTOR_SIZE)
+    {
+        return -ENOSPC;
+    }
+
+    while(done < size)
+    {
+        index = file->start + file->size / RAWLOG_SECTOR_SIZE;
+        offset = file->size % RAWLOG_SECTOR_SIZE;
+        chunk = MIN(size - done, RAWLOG_SECTOR_SIZE - offset);
+
+        if(chunk == RAWLOG_SECTOR_SIZE)
+        {
+            result = rawlog_sector_write(index, (const uint8_t *)data + done);
+        }
+        else
+        {
+            if(offset > 0)
+            {
+                result = rawlog_sector_read(index, sector);
+            }
+            else
+            {
+                memset(sector, 0, sizeof(sector));
+            }
+
+            if(result == 0)
+            {
+                memcpy(&sector[offset], (const uint8_t *)data + done, chunk);
+                result = rawlog_sector_write(index, sector);
+            }
+        }
+
+        if(result != 0)
+        {
+            return result;
+        }
+
+        file->size += chunk;
+        done += chunk;
+    }
+
+    return done;
+}
+
+ssize_t rawlog_read(struct rawlog_file *file, off_t offset, void *data, size_t size)
+{
+    int result = 0;
+    size_t done = 0;
+    size_t chunk = 0;
+    uint32_t position = 0;
+    uint32_t index = 0;
+
+    if(offset < 0)
+    {
+        return -EINVAL;
+    }
+
+    if((uint32_t)offset >= file->size)
+    {
+        return 0;
+    }
+
+    size = MIN(size, file->size - (uint32_t)offset);
+
+    while(done < size)
+    {
+        position = offset + done;
+        index = file->start + position / RAWLOG_SECTOR_SIZE;
+        chunk = MIN(size - done, RAWLOG_SECTOR_SIZE - position % RAWLOG_SECTOR_SIZE);
+
+        if(chunk == RAWLOG_SECTOR_SIZE)
+        {
+            result = rawlog_sector_read(index, (uint8_t *)data + done);
+        }
+        else
+        {
+            result = rawlog_sector_read(index, sector);
+            if(result == 0)
+            {
+                memcpy((uint8_t *)data + done, &sector[position % RAWLOG_SECTOR_SIZE], chunk);
+            }
+        }
+
+        if(result != 0)
+        {
+            return result;
+        }
+
+        done += chunk;
+    }
+
+    return done;
+}
+
+/* Commit the size, what was written past it is lost on a power loss */
+int rawlog_sync(struct rawlog_file *file)
+{
+    int result = 0;
+
+    if(file->write == false)
+    {
+        return 0;
+    }
+
+    result = rawlog_segment_write(file, STORAGE_SESSION_RECORDING);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    return disk_access_ioctl(disk_name, DISK_IOCTL_CTRL_SYNC, NULL);
+}
+
+/* The sectors stay, the log only ever reuses them after a reset */
+int rawlog_truncate(struct rawlog_file *file, uint32_t size)
+{
+    if(file->write == false)
+    {
+        return -EBADF;
+    }
+
+    file->size = MIN(file->size, size);
+
+    return 0;
+}
+
+int rawlog_close(struct rawlog_file *file)
+{
+    int result = 0;
+
+    if(file->write == false)
+    {
+        return 0;
+    }
+
+    file->write = false;
+
+    result = rawlog_segment_write(file, STORAGE_SESSION_CLOSED);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    if(file->slot == segment_count - 1)
+    {
+        append = file->start + ceiling_fraction(file->size, RAWLOG_SECTOR_SIZE);
+    }
+
+    return disk_access_ioctl(disk_name, DISK_IOCTL_CTRL_SYNC, NULL);
+}
+
+/* Marks the segment only, its space comes back when the log is reset */
+int rawlog_delete(uint16_t id)
+{
+    int result = 0;
+    struct rawlog_file file = {0};
+    struct rawlog_segment segment = {0};
+
+    result = rawlog_find(id, &file.slot, &segment);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    file.id = id;
+    file.start = segment.start;
+    file.size = segment.size;
+
+    result = rawlog_segment_write(&file, STORAGE_SESSION_DELETED);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    segment_live--;
+
+    return 0;
+}
\ No newline at end of file
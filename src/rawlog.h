@@ -0,0 +1,34 @@
+#ifndef RAWLOG_H
+#define RAWLOG_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Takes appended to a reserved run of sectors next to the FAT volume,
+ * written with disk_access only. Not thread safe, storage serializes
+ * every call with its mutex. */
+
+#define RAWLOG_SECTOR_SIZE 512
+
+/* A take in the log, opened like a file */
+struct rawlog_file
+{
+    uint16_t id;
+    uint16_t slot;   /* Segment table entry */
+    uint32_t start;  /* First sector, from the start of the region */
+    uint32_t size;   /* Bytes */
+    bool write;
+};
+
+int rawlog_init(const char *disk, uint32_t first, uint32_t sectors);
+int rawlog_create(struct rawlog_file *file, uint16_t id);
+int rawlog_open(struct rawlog_file *file, uint16_t id, bool write);
+ssize_t rawlog_write(struct rawlog_file *file, const void *data, size_t size);
+ssize_t rawlog_read(struct rawlog_file *file, off_t offset, void *data, size_t size);
+int rawlog_sync(struct rawlog_file *file);
+int rawlog_truncate(struct rawlog_file *file, uint32_t size);
+int rawlog_close(struct rawlog_file *file);
+int rawlog_delete(uint16_t id);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,155 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+/* On-disk layout of a session file: a record_header followed by blocks,
+ * each one a record_block header and its payload. All fields are
+ * little endian. A sample is one accel_entry per sensor, in sensor
+ * order, all taken at the time of the first one. */
+
+#define RECORD_MAGIC   0x5041434D /* "MCAP" */
+#define RECORD_VERSION 3
+#define RECORD_TICK_US 1 // Finest unit of accel_entry.delta, slow takes use record_header.tick_us
+
+enum
+{
+    RECORD_BLOCK_SAMPLES = 1, // Key entry per sensor, then zig-zag varint deltas
+    RECORD_BLOCK_GAP     = 2, // struct record_gap
+    RECORD_BLOCK_QUAT    = 3, // struct record_quat, then count Q14 w, x, y, z quaternions
+    RECORD_BLOCK_SYNC    = 4, // struct record_sync, at the end of a synced take
+};
+
+struct record_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint16_t entry_size;
+    uint16_t sample_rate;   /* Hz, of the stored samples */
+    uint16_t accel_range;   /* Full scale, g */
+    uint16_t gyro_range;    /* Full scale, deg/s */
+    uint16_t tick_us;       /* Unit of accel_entry.delta, us */
+    uint8_t dlpf;
+    uint8_t divider;        /* Sample rate divider at record start */
+    uint16_t sensors;       /* Entries per sample, one per sensor */
+    uint16_t decimation;    /* Output samples per stored one, 0 in older takes */
+};
+
+struct record_block
+{
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t size;  /* Payload bytes after this header */
+    uint16_t count; /* Entries in the payload, whole samples of all sensors */
+};
+
+/* Orientation from the on-device filter. Quaternion k was taken after
+ * stored sample index + k * decimation. */
+struct record_quat
+{
+    uint32_t index;
+    uint16_t decimation;
+    uint16_t reserved;
+};
+
+/* Totals of a take, kept in its session index entry */
+struct record_meta
+{
+    uint32_t size;       /* Bytes in the session file */
+    uint32_t count;      /* Samples stored */
+    uint32_t lost;       /* Stored samples dropped on overrun, the sum of the gap blocks */
+    uint32_t gaps;       /* Gap blocks written */
+    uint32_t high_water; /* Sample ring high water mark */
+};
+
+/* Device clock against the host clock, from the time sync exchange. A device
+ * time t in us maps to host time t + offset_us + (t - sync_us) * drift_ppb / 1e9.
+ * Sample times are start_us plus the sum of the deltas. */
+struct record_sync
+{
+    int64_t offset_us;  /* Host minus device clock at sync_us */
+    uint64_t sync_us;   /* Device time of the measurement */
+    uint64_t start_us;  /* Device time of the first sample */
+    int32_t drift_ppb;  /* Host clock rate against the device, 0 until measured */
+    uint32_t error_us;  /* Bound on the offset error at sync_us */
+};
+
+/* Side index of a take, S<id>.DAT next to its R<id>.DAT: a record_summary,
+ * a record_stats of the whole take per sensor, then a record_stats per
+ * sensor for every block_samples stored samples, in sample order. */
+#define RECORD_SUMMARY_MAGIC   0x4D55534D /* "MSUM" */
+#define RECORD_SUMMARY_VERSION 1
+#define RECORD_ENVELOPE_SIZE   64
+
+/* One axis over a span of stored samples, raw units */
+struct record_axis_stats
+{
+    int16_t min;
+    int16_t max;
+    int16_t mean;
+    uint16_t deviation; /* Standard deviation, its square is the variance */
+};
+
+struct record_stats
+{
+    uint32_t index;    /* First stored sample */
+    uint32_t count;    /* Samples */
+    uint8_t sensor;
+    uint8_t activity;  /* Largest axis deviation, in 1/256 of full scale */
+    uint16_t reserved;
+    struct record_axis_stats axes[6]; /* ax, ay, az, gx, gy, gz */
+};
+
+struct record_summary
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;   /* Bytes before the first block record */
+    uint16_t block_samples; /* Stored samples per block */
+    uint16_t sensors;
+    uint32_t blocks;        /* Block records, 0 until the take is finished */
+    uint32_t envelope_span; /* Blocks per envelope point */
+    uint8_t envelope_count;
+    uint8_t reserved[3];
+    uint8_t envelope[RECORD_ENVELOPE_SIZE]; /* Largest activity of any sensor per point */
+};
+
+/* CRC index of a take, C<id>.DAT next to its R<id>.DAT: a record_crc_header,
+ * then one entry per RECORD_CRC_BLOCK_SIZE bytes of the session file, in
+ * file order. Indexes without the header are not read. Block k
+ * is bytes [k * size, (k + 1) * size), the last one may be shorter.
+ * Samples are stored sample indices, as in record_meta.count. The sync
+ * point lets a reader find a sample without walking the take from its
+ * start. It is 0, the record header, until the first block record. */
+#define RECORD_CRC_MAGIC      0x4352434D /* "MCRC" */
+#define RECORD_CRC_VERSION    1
+#define RECORD_CRC_BLOCK_SIZE 512
+
+struct record_crc_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size; /* sizeof(struct record_crc) */
+};
+
+struct record_crc
+{
+    uint32_t crc;   /* CRC-32 (IEEE) of the block */
+    uint32_t first; /* First sample with bytes in the block */
+    uint32_t end;   /* One past the last one, equal to first if there are none */
+    uint32_t sync;  /* File offset of the last block record starting before the block ends */
+    uint32_t index; /* Samples before that block record, lost ones included */
+};
+
+/* Samples dropped on overrun. The time delta of the next
+ * sample already covers the missing ones. */
+struct record_gap
+{
+    uint32_t timestamp;   /* ms since record start */
+    uint32_t index;       /* Samples stored before the gap */
+    uint16_t lost;
+    uint16_t sample_rate; /* Hz, after the gap */
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include <zephyr.h>
+
+#include "ring.h"
+
+/* Set in tail while the consumer holds a span, so the producer
+ * can not drop slots out from under it */
+#define RING_CLAIMED    BIT(31)
+#define RING_INDEX_MASK (RING_CLAIMED - 1)
+
+static uint32_t ring_tail(struct ring *ring)
+{
+    return (uint32_t)atomic_get(&ring->tail) & RING_INDEX_MASK;
+}
+
+static uint32_t ring_used(struct ring *ring)
+{
+    return ((uint32_t)atomic_get(&ring->head) - ring_tail(ring)) & RING_INDEX_MASK;
+}
+
+void ring_init(struct ring *ring, struct accel_entry *buf, uint16_t *lost, uint32_t size)
+{
+    __ASSERT(IS_POWER_OF_TWO(size), "Ring size %d is not a power of two", size);
+
+    ring->buf = buf;
+    ring->lost = lost;
+    ring->size = size;
+
+    k_sem_init(&ring->data, 0, size);
+    k_sem_init(&ring->space, 0, 1);
+
+    ring_reset(ring);
+}
+
+/* Only safe while neither side is running */
+void ring_reset(struct ring *ring)
+{
+    atomic_set(&ring->head, 0);
+    atomic_set(&ring->tail, 0);
+    ring->high_water = 0;
+
+    k_sem_reset(&ring->data);
+    k_sem_reset(&ring->space);
+}
+
+/* Producer: free slots, at least this many can be reserved without waiting */
+uint32_t ring_space_get(struct ring *ring)
+{
+    return ring->size - ring_used(ring);
+}
+
+/* Producer: get the next free slot, waiting up to timeout for the consumer */
+struct accel_entry *ring_reserve(struct ring *ring, k_timeout_t timeout)
+{
+    while(ring_used(ring) == ring->size)
+    {
+        if(k_sem_take(&ring->space, timeout) != 0)
+        {
+            return NULL;
+        }
+    }
+
+    return &ring->buf[(uint32_t)atomic_get(&ring->head) & (ring->size - 1)];
+}
+
+/* Producer: publish the slot returned by ring_reserve(), noting how many
+ * samples were dropped since the previous one */
+void ring_commit(struct ring *ring, uint16_t lost)
+{
+    uint32_t used = 0;
+
+    ring->lost[(uint32_t)atomic_get(&ring->head) & (ring->size - 1)] = lost;
+
+    atomic_set(&ring->head, ((uint32_t)atomic_get(&ring->head) + 1) & RING_INDEX_MASK);
+
+    used = ring_used(ring);
+    if(used > ring->high_water)
+    {
+        ring->high_water = used;
+    }
+
+    k_sem_give(&ring->data);
+}
+
+/* Producer: discard the oldest sample to make room. Its time delta and loss
+ * count move to the next slot. Fails while the consumer holds a span. */
+bool ring_drop_oldest(struct ring *ring)
+{
+    bool dropped = false;
+    uint32_t tail = 0;
+    uint32_t next = 0;
+    struct accel_entry *survivor = NULL;
+
+    /* The surviving slot and the tail have to change together */
+    unsigned int key = irq_lock();
+
+    tail = (uint32_t)atomic_get(&ring->tail);
+    if((tail & RING_CLAIMED) == 0 && ring_used(ring) > 1)
+    {
+        next = (tail + 1) & (ring->size - 1);
+        survivor = &ring->buf[next];
+
+        survivor->delta = MIN((uint32_t)survivor->delta + ring->buf[tail & (ring->size - 1)].delta,
+                              UINT16_MAX);
+        ring->lost[next] = MIN((uint32_t)ring->lost[next] + ring->lost[tail & (ring->size - 1)] + 1,
+                               UINT16_MAX);
+
+        atomic_set(&ring->tail, (tail + 1) & RING_INDEX_MASK);
+        dropped = true;
+    }
+
+    irq_unlock(key);
+
+    return dropped;
+}
+
+/* Consumer: claim the longest contiguous span of committed samples */
+uint32_t ring_peek(struct ring *ring, struct accel_entry **span, uint16_t **lost,
+                   k_timeout_t timeout)
+{
+    uint32_t tail = 0;
+    uint32_t used = ring_used(ring);
+
+    if(used == 0)
+    {
+        k_sem_take(&ring->data, timeout);
+
+        used = ring_used(ring);
+        if(used == 0)
+        {
+            return 0;
+        }
+    }
+
+    /* Fails only if the producer dropped the oldest sample meanwhile */
+    do
+    {
+        tail = ring_tail(ring);
+    } while(atomic_cas(&ring->tail, tail, tail | RING_CLAIMED) == false);
+
+    used = ring_used(ring);
+    tail &= ring->size - 1;
+
+    *span = &ring->buf[tail];
+    *lost = &ring->lost[tail];
+
+    return MIN(used, ring->size - tail);
+}
+
+/* Consumer: hand count samples back to the producer and drop the claim */
+void ring_release(struct ring *ring, uint32_t count)
+{
+    atomic_set(&ring->tail, (ring_tail(ring) + count) & RING_INDEX_MASK);
+
+    k_sem_give(&ring->space);
+}
+
+void ring_stats_get(struct ring *ring, struct ring_stats *stats)
+{
+    stats->size = ring->size;
+    stats->used = ring_used(ring);
+    stats->high_water = ring->high_water;
+}
@@ -0,0 +1,41 @@
+#ifndef RING_H
+#define RING_H
+
+#include <zephyr.h>
+
+#include "accel.h"
+
+/* Lock-free single-producer/single-consumer ring of samples. The producer
+ * fills slots in place, the consumer works on contiguous spans. Next to
+ * every slot the ring keeps how many samples were lost right before it. */
+struct ring
+{
+    struct accel_entry *buf;
+    uint16_t *lost;
+    uint32_t size;          // Power of two
+    atomic_t head;          // Written by the producer only
+    atomic_t tail;          // Consumer, or the producer when dropping the oldest
+    uint32_t high_water;
+    struct k_sem data;
+    struct k_sem space;
+};
+
+struct ring_stats
+{
+    uint32_t size;
+    uint32_t used;
+    uint32_t high_water;
+};
+
+void ring_init(struct ring *ring, struct accel_entry *buf, uint16_t *lost, uint32_t size);
+void ring_reset(struct ring *ring);
+uint32_t ring_space_get(struct ring *ring);
+struct accel_entry *ring_reserve(struct ring *ring, k_timeout_t timeout);
+void ring_commit(struct ring *ring, uint16_t lost);
+bool ring_drop_oldest(struct ring *ring);
+uint32_t ring_peek(struct ring *ring, struct accel_entry **span, uint16_t **lost,
+                   k_timeout_t timeout);
+void ring_release(struct ring *ring, uint32_t count);
+void ring_stats_get(struct ring *ring, struct ring_stats *stats);
+
+#endif
@@ -5,9 +5,65 @@
 #include <fs/fs.h>
 #include <ff.h>
 #include <sys/types.h>
+#include <sys/crc.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "storage.h"
+#include "accel.h"
+#include "prof.h"
+#include "trace.h"
+#include "rawlog.h"
 
 LOG_MODULE_REGISTER(storage);
 
+#define STORAGE_SECTOR_SIZE       512
+#define STORAGE_BLOCK_SECTORS     1
+#define STORAGE_BLOCK_SIZE        (STORAGE_SECTOR_SIZE * STORAGE_BLOCK_SECTORS)
+#define STORAGE_BLOCK_COUNT       2
+#define STORAGE_WRITER_STACK_SIZE 1024
+#define STORAGE_WRITER_PRIORITY   2
+#define STORAGE_MOUNT_POINT       "/" CONFIG_MOCAP_STORAGE_VOLUME ":"
+#define STORAGE_INDEX_PATH        STORAGE_MOUNT_POINT "/INDEX.DAT"
+#define STORAGE_JOURNAL_PATH      STORAGE_MOUNT_POINT "/JOURNAL.DAT"
+#define STORAGE_JOURNAL_MAGIC     0x4B504348 /* "HCPK" */
+#define STORAGE_JOURNAL_SLOTS     2
+#define STORAGE_SESSION_PATH      STORAGE_MOUNT_POINT "/R%05u.DAT"
+#define STORAGE_SUMMARY_PATH      STORAGE_MOUNT_POINT "/S%05u.DAT"
+#define STORAGE_CRC_PATH          STORAGE_MOUNT_POINT "/C%05u.DAT"
+#define STORAGE_PATH_SIZE         sizeof(STORAGE_MOUNT_POINT "/R00000.DAT")
+#define STORAGE_SUMMARY_QUEUE_SIZE (2 * ACCEL_SENSOR_COUNT) // A block of every sensor, twice
+#define STORAGE_SESSION_MAX       UINT16_MAX
+#define STORAGE_RAWLOG_ALIGN      8192 // Sectors, a 4 MiB SD allocation unit
+#define STORAGE_RAWLOG_VOLUME     CONFIG_MOCAP_STORAGE_RAWLOG_VOLUME
+#define STORAGE_READ_WAIT         K_MSEC(10) // Longest wait for the writer per sector read
+#define STORAGE_CRC_BATCH         8 // CRC entries held back for one index write
+
+struct storage_block
+{
+    uint8_t data[STORAGE_BLOCK_SIZE];
+    size_t len;
+    uint32_t first; // Samples with bytes in the block, for the CRC index
+    uint32_t end;
+    uint32_t sync;  // Sync point of the CRC index, see struct record_crc
+    uint32_t index;
+};
+
+BUILD_ASSERT(STORAGE_BLOCK_SIZE == RECORD_CRC_BLOCK_SIZE, "CRC index block is a storage block");
+
+/* Totals of the take being recorded, as far as the file is synced. The
+ * journal has two slots, each in a sector of its own, written in turn.
+ * A torn write leaves the other slot intact. */
+struct storage_checkpoint
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t id;
+    uint16_t reserved;
+    struct record_meta meta;
+    uint32_t crc; /* CRC-32 of everything before it */
+};
+
 static FATFS fat_fs;
 
 /* mounting info */
@@ -17,141 +73,1640 @@ static struct fs_mount_t mp = {
 };
 
 K_MUTEX_DEFINE(storage_mutex);
+K_MUTEX_DEFINE(storage_block_mutex);
+
+/* Blocks travel between the free queue (owned by writers of samples)
+ * and the flush queue (owned by the writer thread) */
+K_MSGQ_DEFINE(storage_free_queue, sizeof(struct storage_block *), STORAGE_BLOCK_COUNT, 4);
+K_MSGQ_DEFINE(storage_flush_queue, sizeof(struct storage_block *), STORAGE_BLOCK_COUNT, 4);
+
+/* Given by the writer thread when no block is left for the card */
+K_SEM_DEFINE(storage_write_idle, 0, 1);
+
+/* Block records of the side index, appended by the writer thread */
+K_MSGQ_DEFINE(storage_summary_queue, sizeof(struct record_stats), STORAGE_SUMMARY_QUEUE_SIZE, 4);
+
+#ifdef CONFIG_MOCAP_STORAGE_RAWLOG
+typedef struct rawlog_file storage_file_t;
+#else
+typedef struct fs_file_t storage_file_t;
+#endif
+
+/* The take being written, and a take being read with a cursor of its own */
+static storage_file_t storage;
+static storage_file_t reader;
+static struct fs_file_t index_file;
+static struct fs_file_t journal_file;
+static struct fs_file_t summary_file;
+static struct fs_file_t crc_file;
+
+static bool is_opened = false;
+static bool reader_opened = false;
+static bool summary_opened = false;
+static bool crc_opened = false;
+static uint16_t session_count = 0;
+static struct storage_session session = {0}; // Entry of the opened file
+static uint16_t reader_id = 0;
+static uint32_t reader_size = 0; // Bytes the read handle knows of
+static uint32_t reader_end = 0;  // Visible end when it was opened
+
+static struct storage_block blocks[STORAGE_BLOCK_COUNT];
+static struct storage_block *fill_block = NULL;
+static int writer_result = 0;
+static uint32_t open_timestamp = 0;
+static uint64_t flush_latency_total = 0;
+static uint64_t checkpoint_latency_total = 0;
+static uint64_t crc_latency_total = 0;
+static uint32_t samples_end = 0; // End of the samples written so far
+static uint32_t samples_lost = 0; // Samples lost in the gaps written so far
+static uint32_t write_end = 0;    // File offset after the data written so far
+static uint32_t committed = 0;   // Bytes of the take covered by the last checkpoint
+static struct record_crc crc_batch[STORAGE_CRC_BATCH];
+static uint8_t crc_batch_count = 0;
+static struct storage_stats stats = {0};
+
+/* Handed from the manager to the writer thread under irq_lock */
+static struct record_meta checkpoint_meta = {0};
+static bool checkpoint_pending = false;
+static uint32_t checkpoint_seq = 0;
+
+static void storage_writer_entry(void *p1, void *p2, void *p3);
+
+K_THREAD_DEFINE(storage_writer, STORAGE_WRITER_STACK_SIZE, storage_writer_entry,
+                NULL, NULL, NULL, STORAGE_WRITER_PRIORITY, 0, 0);
+
+/* Format is one of the STORAGE_*_PATH names of a take's files */
+static void storage_path(char *path, const char *format, uint16_t id)
+{
+    snprintf(path, STORAGE_PATH_SIZE, format, id);
+}
+
+/* The take itself is a file on the FAT volume or a segment of the raw
+ * log, chosen at build time. The index, the journal and the side files
+ * are on the FAT volume either way. */
+#ifdef CONFIG_MOCAP_STORAGE_RAWLOG
+
+/* The log starts at the first allocation unit boundary after the FAT
+ * volume, so the two never share an erase block. A disk of its own is
+ * all log. */
+static int storage_take_init(void)
+{
+    int result = 0;
+    uint32_t count = 0;
+    uint32_t first = 0;
+    uint32_t sectors = 0;
+
+    if(strcmp(STORAGE_RAWLOG_VOLUME, CONFIG_MOCAP_STORAGE_VOLUME) != 0)
+    {
+        /* FatFs only brings up its own disk */
+        result = disk_access_init(STORAGE_RAWLOG_VOLUME);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    else
+    {
+        first = ROUND_UP(fat_fs.database + (fat_fs.n_fatent - 2) * fat_fs.csize,
+                         STORAGE_RAWLOG_ALIGN);
+    }
+
+    result = disk_access_ioctl(STORAGE_RAWLOG_VOLUME, DISK_IOCTL_GET_SECTOR_COUNT, &count);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    if(first >= count)
+    {
+        LOG_ERR("No room after the FAT volume, %u of %u sectors", first, count);
+
+        return -ENOSPC;
+    }
+
+    sectors = count - first;
+
+    if(CONFIG_MOCAP_STORAGE_RAWLOG_SECTORS > 0)
+    {
+        if(CONFIG_MOCAP_STORAGE_RAWLOG_SECTORS > sectors)
+        {
+            return -ENOSPC;
+        }
+
+        sectors = CONFIG_MOCAP_STORAGE_RAWLOG_SECTORS;
+    }
+
+    return rawlog_init(STORAGE_RAWLOG_VOLUME, first, sectors);
+}
+
+static int storage_take_create(storage_file_t *file, uint16_t id)
+{
+    return rawlog_create(file, id);
+}
+
+static int storage_take_open(storage_file_t *file, uint16_t id, bool write)
+{
+    int result = 0;
+
+    result = rawlog_open(file, id, write);
+    if(result != 0)
+    {
+        LOG_ERR("Open segment of %d - fail. Result %d", id, result);
+    }
+
+    return result;
+}
+
+static ssize_t storage_take_write(storage_file_t *file, const void *data, size_t size)
+{
+    return rawlog_write(file, data, size);
+}
+
+static ssize_t storage_take_read(storage_file_t *file, off_t offset, void *data, size_t size)
+{
+    return rawlog_read(file, offset, data, size);
+}
+
+static int storage_take_sync(storage_file_t *file)
+{
+    return rawlog_sync(file);
+}
+
+/* As of the last sync, a power loss keeps nothing after it */
+static off_t storage_take_size(storage_file_t *file)
+{
+    return file->size;
+}
+
+static int storage_take_truncate(storage_file_t *file, off_t size)
+{
+    return rawlog_truncate(file, size);
+}
+
+static int storage_take_close(storage_file_t *file)
+{
+    return rawlog_close(file);
+}
+
+static int storage_take_remove(uint16_t id)
+{
+    char path[STORAGE_PATH_SIZE];
+
+    /* An exported copy goes with the take */
+    storage_path(path, STORAGE_SESSION_PATH, id);
+    fs_unlink(path);
+
+    return rawlog_delete(id);
+}
+
+#else
+
+static int storage_take_init(void)
+{
+    return 0;
+}
+
+static int storage_take_open(storage_file_t *file, uint16_t id, bool write)
+{
+    int result = 0;
+    char path[STORAGE_PATH_SIZE];
+
+    storage_path(path, STORAGE_SESSION_PATH, id);
+
+    fs_file_t_init(file);
+
+    result = fs_open(file, path, write ? FS_O_RDWR : FS_O_READ);
+    if(result != 0)
+    {
+        LOG_ERR("Open %s - fail. Result %d", path, result);
+    }
+
+    return result;
+}
+
+static int storage_take_create(storage_file_t *file, uint16_t id)
+{
+    int result = 0;
+    char path[STORAGE_PATH_SIZE];
+
+    storage_path(path, STORAGE_SESSION_PATH, id);
+
+    fs_file_t_init(file);
+
+    result = fs_open(file, path, FS_O_RDWR | FS_O_CREATE);
+    if(result != 0)
+    {
+        LOG_ERR("Open %s - fail. Result %d", path, result);
+
+        return result;
+    }
+
+    /* Only a lost index leaves a file behind under a new id */
+    result = fs_seek(file, 0, FS_SEEK_END);
+    if(result == 0 && fs_tell(file) > 0)
+    {
+        LOG_WRN("Session %d file exists, truncate", id);
+
+        fs_seek(file, 0, FS_SEEK_SET);
+        result = fs_truncate(file, 0);
+    }
+
+    if(result != 0)
+    {
+        fs_close(file);
+    }
+
+    return result;
+}
+
+static ssize_t storage_take_write(storage_file_t *file, const void *data, size_t size)
+{
+    return fs_write(file, data, size);
+}
+
+static ssize_t storage_take_read(storage_file_t *file, off_t offset, void *data, size_t size)
+{
+    int result = 0;
+
+    result = fs_seek(file, offset, FS_SEEK_SET);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    return fs_read(file, data, size);
+}
+
+static int storage_take_sync(storage_file_t *file)
+{
+    return fs_sync(file);
+}
+
+/* As far as the directory entry knows, so as of the last sync if
+ * another handle writes the file */
+static off_t storage_take_size(storage_file_t *file)
+{
+    int result = 0;
+
+    result = fs_seek(file, 0, FS_SEEK_END);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    return fs_tell(file);
+}
+
+static int storage_take_truncate(storage_file_t *file, off_t size)
+{
+    return fs_truncate(file, size);
+}
+
+static int storage_take_close(storage_file_t *file)
+{
+    return fs_close(file);
+}
+
+static int storage_take_remove(uint16_t id)
+{
+    char path[STORAGE_PATH_SIZE];
+
+    storage_path(path, STORAGE_SESSION_PATH, id);
+
+    return fs_unlink(path);
+}
+
+#endif /* CONFIG_MOCAP_STORAGE_RAWLOG */
+
+static void storage_stats_update(size_t len, uint32_t latency)
+{
+    stats.flush_count++;
+    stats.bytes_written += len;
+    stats.flush_latency_last = latency;
+    flush_latency_total += latency;
+
+    if(stats.flush_count == 1 || latency < stats.flush_latency_min)
+    {
+        stats.flush_latency_min = latency;
+    }
+
+    if(latency > stats.flush_latency_max)
+    {
+        stats.flush_latency_max = latency;
+    }
+}
+
+static int storage_journal_write(const struct record_meta *meta)
+{
+    int result = 0;
+    struct storage_checkpoint checkpoint = {
+        .magic = STORAGE_JOURNAL_MAGIC,
+        .seq   = checkpoint_seq + 1,
+        .id    = session.id,
+        .meta  = *meta,
+    };
+
+    checkpoint.crc = crc32_ieee((const uint8_t *)&checkpoint, offsetof(struct storage_checkpoint, crc));
+
+    result = fs_seek(&journal_file, (off_t)(checkpoint.seq % STORAGE_JOURNAL_SLOTS) *
+                     STORAGE_SECTOR_SIZE, FS_SEEK_SET);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    result = fs_write(&journal_file, &checkpoint, sizeof(checkpoint));
+    if(result != sizeof(checkpoint))
+    {
+        return result < 0 ? result : -EIO;
+    }
+
+    result = fs_sync(&journal_file);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    checkpoint_seq = checkpoint.seq;
+
+    return 0;
+}
+
+/* Writer thread, with the storage mutex held. Once every byte a pending
+ * checkpoint covers is written, sync the file so its size is on the card,
+ * then journal the totals. */
+static void storage_checkpoint_sync(void)
+{
+    int result = 0;
+    uint32_t start = 0;
+    uint32_t latency = 0;
+    struct record_meta meta = {0};
+    unsigned int key = irq_lock();
+
+    if(checkpoint_pending == false || checkpoint_meta.size > stats.bytes_written ||
+       is_opened == false)
+    {
+        irq_unlock(key);
+
+        return;
+    }
+
+    meta = checkpoint_meta;
+    checkpoint_pending = false;
+
+    irq_unlock(key);
+
+    start = k_cycle_get_32();
+
+    result = storage_take_sync(&storage);
+    if(result == 0)
+    {
+        result = storage_journal_write(&meta);
+    }
+
+    if(result != 0)
+    {
+        LOG_ERR("Checkpoint - fail. Result %d", result);
+
+        return;
+    }
+
+    latency = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    /* Synced and journalled, readers may see it now */
+    committed = meta.size;
+
+    stats.checkpoint_count++;
+    stats.checkpoint_latency_max = MAX(stats.checkpoint_latency_max, latency);
+    checkpoint_latency_total += latency;
+
+    trace_value(TRACE_CHECKPOINT, session.id, meta.size, latency);
+}
+
+/* Append the queued block records to the side index. Called with the
+ * storage mutex held. */
+static void storage_summary_drain(void)
+{
+    int result = 0;
+    struct record_stats block = {0};
+
+    while(k_msgq_get(&storage_summary_queue, &block, K_NO_WAIT) == 0)
+    {
+        if(summary_opened == false)
+        {
+            continue;
+        }
+
+        result = fs_seek(&summary_file, 0, FS_SEEK_END);
+        if(result == 0)
+        {
+            result = fs_write(&summary_file, &block, sizeof(block));
+        }
+
+        if(result != sizeof(block))
+        {
+            LOG_ERR("Summary write - fail. Result %d", result);
+        }
+    }
+}
+
+/* Writer thread, with the storage mutex held. The CRC is taken from
+ * the block buffer once it is on the card, off the sample path. */
+static void storage_crc_put(const struct storage_block *block)
+{
+    uint32_t start = 0;
+    struct record_crc *entry = &crc_batch[crc_batch_count];
+
+    if(crc_opened == false)
+    {
+        return;
+    }
+
+    start = prof_start();
+
+    entry->crc = crc32_ieee(block->data, block->len);
+    entry->first = block->first;
+    entry->end = block->end;
+    entry->sync = block->sync;
+    entry->index = block->index;
+    crc_batch_count++;
+
+    prof_stop(PROF_STORAGE_CRC, start);
+}
+
+/* Append the batched entries to the CRC index. Called with the storage
+ * mutex held. */
+static void storage_crc_drain(void)
+{
+    int result = 0;
+    uint32_t start = 0;
+    uint32_t latency = 0;
+    size_t size = crc_batch_count * sizeof(struct record_crc);
+
+    if(crc_batch_count == 0 || crc_opened == false)
+    {
+        return;
+    }
+
+    start = k_cycle_get_32();
+
+    result = fs_write(&crc_file, crc_batch, size);
+    if(result != size)
+    {
+        LOG_ERR("CRC index write - fail. Result %d", result);
+    }
+
+    latency = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    stats.crc_count += crc_batch_count;
+    stats.crc_latency_max = MAX(stats.crc_latency_max, latency);
+    crc_latency_total += latency;
+    crc_batch_count = 0;
+}
 
-/* pointer to storage descriptor */
-static struct fs_file_t storage;
-static struct fs_file_t meta;
+/* Everything but the take itself: CRC index, checkpoint and side index.
+ * Called with the storage mutex held. */
+static void storage_side_write(void)
+{
+    storage_crc_drain();
+    storage_checkpoint_sync();
+    storage_summary_drain();
+}
+
+static void storage_writer_entry(void *p1, void *p2, void *p3)
+{
+    int result = 0;
+    uint32_t start = 0;
+    uint32_t latency = 0;
+    struct storage_block *block = NULL;
+
+    while(true)
+    {
+        result = k_msgq_get(&storage_flush_queue, &block, K_FOREVER);
+        __ASSERT(result == 0, "Get block to flush - fail. Result %d", result);
+
+        result = k_mutex_lock(&storage_mutex, K_FOREVER);
+        __ASSERT(result == 0, "Lock mutex - fail. Result %d", result);
+
+        start = k_cycle_get_32();
+
+        result = storage_take_write(&storage, block->data, block->len);
+        if(result < 0)
+        {
+            LOG_ERR("Block write - fail. Result %d", result);
+
+            writer_result = result;
+        }
+        else
+        {
+            latency = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+            prof_stop(PROF_STORAGE_FLUSH, start);
+            trace_value(TRACE_FLUSH, block->len, latency, 0);
+            storage_stats_update(block->len, latency);
+
+            storage_crc_put(block);
+        }
+
+        k_mutex_unlock(&storage_mutex);
+
+        block->len = 0;
+
+        /* The block is free again before any other file is touched */
+        result = k_msgq_put(&storage_free_queue, &block, K_NO_WAIT);
+        __ASSERT(result == 0, "Return block - fail. Result %d", result);
+
+        if(k_msgq_num_used_get(&storage_flush_queue) > 0 && crc_batch_count < STORAGE_CRC_BATCH)
+        {
+            continue;
+        }
+
+        /* Side files only while no block waits, or once the batch is full */
+        result = k_mutex_lock(&storage_mutex, K_FOREVER);
+        __ASSERT(result == 0, "Lock mutex - fail. Result %d", result);
+
+        storage_side_write();
+
+        k_mutex_unlock(&storage_mutex);
+
+        if(k_msgq_num_used_get(&storage_flush_queue) == 0)
+        {
+            k_sem_give(&storage_write_idle);
+        }
+    }
+}
+
+/* Hand the partially filled block to the writer thread and wait
+ * until every block is back in the free queue */
+static int storage_flush(void)
+{
+    int result = 0;
+    struct storage_block *idle[STORAGE_BLOCK_COUNT];
+
+    k_mutex_lock(&storage_block_mutex, K_FOREVER);
+
+    if(fill_block != NULL)
+    {
+        if(fill_block->len > 0)
+        {
+            result = k_msgq_put(&storage_flush_queue, &fill_block, K_FOREVER);
+        }
+        else
+        {
+            result = k_msgq_put(&storage_free_queue, &fill_block, K_FOREVER);
+        }
+        __ASSERT(result == 0, "Release fill block - fail. Result %d", result);
+
+        fill_block = NULL;
+    }
+
+    for(int i = 0; i < STORAGE_BLOCK_COUNT; i++)
+    {
+        k_msgq_get(&storage_free_queue, &idle[i], K_FOREVER);
+    }
+
+    for(int i = 0; i < STORAGE_BLOCK_COUNT; i++)
+    {
+        k_msgq_put(&storage_free_queue, &idle[i], K_NO_WAIT);
+    }
+
+    result = writer_result;
+    writer_result = 0;
+
+    k_mutex_unlock(&storage_block_mutex);
+
+    return result;
+}
+
+/* Index entries have a fixed size, so any of them is one seek away */
+static int storage_index_read(uint16_t id, struct storage_session *entry)
+{
+    int result = 0;
+
+    if(id == 0)
+    {
+        id = session_count;
+    }
+
+    if(id == 0 || id > session_count)
+    {
+        return -ENOENT;
+    }
+
+    result = fs_seek(&index_file, (off_t)(id - 1) * sizeof(*entry), FS_SEEK_SET);
+    if(result != 0)
+    {
+        LOG_ERR("Index seek - fail. Result %d", result);
+
+        return result;
+    }
+
+    result = fs_read(&index_file, entry, sizeof(*entry));
+    if(result != sizeof(*entry))
+    {
+        LOG_ERR("Index read - fail. Result %d", result);
+
+        return result < 0 ? result : -EIO;
+    }
+
+    return 0;
+}
+
+static int storage_index_write(const struct storage_session *entry)
+{
+    int result = 0;
+
+    result = fs_seek(&index_file, (off_t)(entry->id - 1) * sizeof(*entry), FS_SEEK_SET);
+    if(result != 0)
+    {
+        LOG_ERR("Index seek - fail. Result %d", result);
+
+        return result;
+    }
+
+    result = fs_write(&index_file, entry, sizeof(*entry));
+    if(result != sizeof(*entry))
+    {
+        LOG_ERR("Index write - fail. Result %d", result);
+
+        return result < 0 ? result : -EIO;
+    }
+
+    /* The index has to survive a power loss even if the take does not */
+    return fs_sync(&index_file);
+}
+
+static int storage_index_open(void)
+{
+    int result = 0;
+    off_t size = 0;
+
+    fs_file_t_init(&index_file);
+
+    result = fs_open(&index_file, STORAGE_INDEX_PATH, FS_O_RDWR | FS_O_CREATE);
+    if(result != 0)
+    {
+        LOG_ERR("Open %s - fail. Result %d", STORAGE_INDEX_PATH, result);
+
+        return result;
+    }
+
+    result = fs_seek(&index_file, 0, FS_SEEK_END);
+    if(result != 0)
+    {
+        LOG_ERR("Index seek - fail. Result %d", result);
+
+        return result;
+    }
+
+    size = fs_tell(&index_file);
+    if(size < 0)
+    {
+        return size;
+    }
+
+    /* A torn entry at the end is ignored and overwritten by the next take */
+    session_count = MIN(size / sizeof(struct storage_session), STORAGE_SESSION_MAX);
+
+    return 0;
+}
+
+/* The newest intact checkpoint, -ENOENT if there is none */
+static int storage_journal_read(struct storage_checkpoint *latest)
+{
+    int result = 0;
+    struct storage_checkpoint checkpoint = {0};
+
+    result = -ENOENT;
+
+    for(int i = 0; i < STORAGE_JOURNAL_SLOTS; i++)
+    {
+        if(fs_seek(&journal_file, (off_t)i * STORAGE_SECTOR_SIZE, FS_SEEK_SET) != 0 ||
+           fs_read(&journal_file, &checkpoint, sizeof(checkpoint)) != sizeof(checkpoint))
+        {
+            continue;
+        }
+
+        if(checkpoint.magic != STORAGE_JOURNAL_MAGIC ||
+           checkpoint.crc != crc32_ieee((const uint8_t *)&checkpoint,
+                                        offsetof(struct storage_checkpoint, crc)))
+        {
+            continue;
+        }
+
+        if(result != 0 || checkpoint.seq > latest->seq)
+        {
+            *latest = checkpoint;
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
+static int storage_journal_open(void)
+{
+    int result = 0;
+    struct storage_checkpoint checkpoint = {0};
+
+    fs_file_t_init(&journal_file);
+
+    result = fs_open(&journal_file, STORAGE_JOURNAL_PATH, FS_O_RDWR | FS_O_CREATE);
+    if(result != 0)
+    {
+        LOG_ERR("Open %s - fail. Result %d", STORAGE_JOURNAL_PATH, result);
+
+        return result;
+    }
+
+    if(storage_journal_read(&checkpoint) == 0)
+    {
+        checkpoint_seq = checkpoint.seq;
+    }
+
+    return 0;
+}
+
+/* Walk the block headers from a known good offset to the end of the
+ * file, adding up what they hold. Stops at a block cut off by the
+ * power loss, which is where the take ends. */
+static int storage_recover_walk(struct record_meta *meta, off_t end)
+{
+    int result = 0;
+    uint16_t sensors = 1;
+    struct record_header header = {0};
+    struct {
+        struct record_block block;
+        struct record_gap gap;
+    } __packed marker = {0};
+
+    result = storage_take_read(&storage, 0, &header, sizeof(header));
+    if(result != sizeof(header) || header.magic != RECORD_MAGIC)
+    {
+        /* Lost before the header made it, nothing to keep */
+        memset(meta, 0, sizeof(*meta));
+
+        return result < 0 ? result : 0;
+    }
+
+    if(header.header_size >= sizeof(header) && header.sensors > 0)
+    {
+        sensors = header.sensors;
+    }
+
+    /* No checkpoint of this take, or one the file does not reach */
+    if(meta->size < header.header_size || meta->size > end)
+    {
+        memset(meta, 0, sizeof(*meta));
+        meta->size = header.header_size;
+    }
+
+    while((off_t)(meta->size + sizeof(marker.block)) <= end)
+    {
+        result = storage_take_read(&storage, meta->size, &marker, sizeof(marker));
+        if(result < (int)sizeof(marker.block))
+        {
+            return result < 0 ? result : 0;
+        }
+
+        if((off_t)(meta->size + sizeof(marker.block) + marker.block.size) > end)
+        {
+            break;
+        }
+
+        if(marker.block.type == RECORD_BLOCK_SAMPLES)
+        {
+            meta->count += marker.block.count / sensors;
+        }
+        else if(marker.block.type == RECORD_BLOCK_GAP)
+        {
+            meta->lost += marker.gap.lost;
+            meta->gaps++;
+        }
+
+        meta->size += sizeof(marker.block) + marker.block.size;
+    }
+
+    return 0;
+}
+
+/* A take still marked recording was cut off. Its totals are rebuilt from
+ * the last checkpoint and the blocks written after it, the file is cut
+ * to whole blocks and the take is closed, so it can be downloaded. */
+static int storage_recover(void)
+{
+    int result = 0;
+    off_t end = 0;
+    struct storage_session entry = {0};
+    struct storage_checkpoint checkpoint = {0};
+
+    result = storage_index_read(0, &entry);
+    if(result != 0 || entry.state != STORAGE_SESSION_RECORDING)
+    {
+        return result == -ENOENT ? 0 : result;
+    }
+
+    if(storage_journal_read(&checkpoint) == 0 && checkpoint.id == entry.id)
+    {
+        entry.meta = checkpoint.meta;
+    }
+    else
+    {
+        memset(&entry.meta, 0, sizeof(entry.meta));
+    }
+
+    result = storage_take_open(&storage, entry.id, true);
+    if(result == 0)
+    {
+        end = storage_take_size(&storage);
+        result = end < 0 ? end : storage_recover_walk(&entry.meta, end);
+
+        if(result == 0 && entry.meta.size < end)
+        {
+            result = storage_take_truncate(&storage, entry.meta.size);
+        }
+
+        storage_take_close(&storage);
+    }
+    else if(result == -ENOENT)
+    {
+        /* Lost with the directory entry, keep the id */
+        memset(&entry.meta, 0, sizeof(entry.meta));
+        result = 0;
+    }
+
+    if(result != 0)
+    {
+        LOG_ERR("Session %d recover - fail. Result %d", entry.id, result);
+
+        return result;
+    }
+
+    entry.state = STORAGE_SESSION_CLOSED;
+
+    result = storage_index_write(&entry);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    LOG_WRN("Session %d recovered, %d samples, %d bytes", entry.id, entry.meta.count,
+            entry.meta.size);
+
+    return 0;
+}
+
+void storage_init(void)
+{
+    int result = 0;
+    
+    /*
+    *  Note the fatfs library is able to mount only strings inside _VOLUME_STRS
+    *  in ffconf.h
+    */
+    mp.mnt_point = STORAGE_MOUNT_POINT;
+
+    result = fs_mount(&mp);
+    __ASSERT(result == 0, "storage init - fail. Result %d", result);
+
+    result = storage_index_open();
+    __ASSERT(result == 0, "Index open - fail. Result %d", result);
+
+    result = storage_journal_open();
+    __ASSERT(result == 0, "Journal open - fail. Result %d", result);
+
+    result = storage_take_init();
+    __ASSERT(result == 0, "Take storage init - fail. Result %d", result);
+
+    result = storage_recover();
+    if(result != 0)
+    {
+        LOG_ERR("Recover - fail. Result %d", result);
+    }
+
+    for(int i = 0; i < STORAGE_BLOCK_COUNT; i++)
+    {
+        struct storage_block *block = &blocks[i];
+
+        result = k_msgq_put(&storage_free_queue, &block, K_NO_WAIT);
+        __ASSERT(result == 0, "Block pool init - fail. Result %d", result);
+    }
+
+    LOG_INF("Init success, %d sessions", session_count);
+}
+
+/* Closes the take even if its last samples could not be written,
+ * the first error is returned */
+int storage_close(void)
+{
+    int result = 0;
+    int close_result = 0;
+
+    /* Write out pending samples before the file goes away */
+    result = storage_flush();
+    if(result < 0)
+    {
+        LOG_ERR("Flush on close - fail. Result %d", result);
+    }
+
+    close_result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    if(close_result != 0)
+    {
+        LOG_ERR("Lock mutex - fail. Result %d", close_result);
+
+        goto exit;
+    }
+
+    /* The writer may not have had an idle moment since the last block */
+    storage_side_write();
+
+    if(summary_opened == true)
+    {
+        fs_close(&summary_file);
+        summary_opened = false;
+    }
+
+    if(crc_opened == true)
+    {
+        fs_close(&crc_file);
+        crc_opened = false;
+    }
+
+    if(is_opened == true)
+    {
+        close_result = storage_take_close(&storage);
+        if(close_result == 0)
+        {
+            is_opened = false;
+
+            LOG_INF("Close success");
+        }
+    }
+
+    k_mutex_unlock(&storage_mutex);
+
+exit:
+    if(result >= 0)
+    {
+        result = close_result;
+    }
+
+    return result;
+}
+
+/* A take is still recorded if its CRC index cannot be created */
+static void storage_crc_open(uint16_t id)
+{
+    int result = 0;
+    char path[STORAGE_PATH_SIZE];
+    struct record_crc_header header = {
+        .magic      = RECORD_CRC_MAGIC,
+        .version    = RECORD_CRC_VERSION,
+        .entry_size = sizeof(struct record_crc),
+    };
+
+    if(IS_ENABLED(CONFIG_MOCAP_CRC_INDEX) == false)
+    {
+        return;
+    }
+
+    storage_path(path, STORAGE_CRC_PATH, id);
+
+    fs_file_t_init(&crc_file);
+
+    result = fs_open(&crc_file, path, FS_O_RDWR | FS_O_CREATE);
+    if(result == 0)
+    {
+        /* Left over only if the index was lost */
+        result = fs_truncate(&crc_file, 0);
+        if(result == 0)
+        {
+            result = fs_write(&crc_file, &header, sizeof(header));
+            result = (result == sizeof(header)) ? 0 : -EIO;
+        }
+
+        if(result != 0)
+        {
+            fs_close(&crc_file);
+        }
+    }
+
+    if(result != 0)
+    {
+        LOG_ERR("Open %s - fail. Result %d", path, result);
+
+        return;
+    }
+
+    crc_opened = true;
+}
+
+/* Start a new take in a file of its own. Older takes are left alone,
+ * so nothing has to be freed before the first sample is written. */
+int storage_session_create(uint32_t start_time, uint16_t *id)
+{
+    int result = 0;
+
+    result = storage_close();
+    if(result != 0)
+    {
+        LOG_ERR("Fail to close on create. Result %d", result);
+
+        return result;
+    }
+
+    result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    if(result != 0)
+    {
+        LOG_ERR("Lock mutex - fail. Result %d", result);
+
+        return result;
+    }
+
+    if(session_count == STORAGE_SESSION_MAX)
+    {
+        result = -ENOSPC;
+
+        goto exit;
+    }
+
+    memset(&session, 0, sizeof(session));
+    session.id = session_count + 1;
+    session.state = STORAGE_SESSION_RECORDING;
+    session.version = RECORD_VERSION;
+    session.start_time = start_time;
+
+    result = storage_index_write(&session);
+    if(result != 0)
+    {
+        goto exit;
+    }
+
+    session_count++;
+
+    result = storage_take_create(&storage, session.id);
+    if(result != 0)
+    {
+        goto exit;
+    }
+
+    is_opened = true;
+    open_timestamp = k_uptime_get_32();
+    flush_latency_total = 0;
+    checkpoint_latency_total = 0;
+    crc_latency_total = 0;
+    samples_end = 0;
+    samples_lost = 0;
+    write_end = 0;
+    committed = 0;
+    crc_batch_count = 0;
+    checkpoint_pending = false;
+    memset(&stats, 0, sizeof(stats));
+    k_msgq_purge(&storage_summary_queue);
+
+    storage_crc_open(session.id);
+
+    *id = session.id;
+
+    LOG_INF("Session %d created", session.id);
+
+exit:
+    k_mutex_unlock(&storage_mutex);
+
+    return result;
+}
+
+/* Write out the take and record its totals in the index */
+int storage_session_finish(const struct record_meta *meta)
+{
+    int result = 0;
+
+    result = storage_flush();
+    if(result < 0)
+    {
+        LOG_ERR("Flush on finish - fail. Result %d", result);
+
+        return result;
+    }
+
+    result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    if(result != 0)
+    {
+        LOG_ERR("Lock mutex - fail. Result %d", result);
+
+        return result;
+    }
+
+    if(is_opened == false || session.state != STORAGE_SESSION_RECORDING)
+    {
+        result = -EINVAL;
+
+        goto exit;
+    }
+
+    session.meta = *meta;
+    session.state = STORAGE_SESSION_CLOSED;
+
+    result = storage_index_write(&session);
+
+exit:
+    k_mutex_unlock(&storage_mutex);
+
+    return result;
+}
+
+/* Ask for the totals to be journalled once the bytes they cover are
+ * written. Cheap for the caller, the writer thread does the syncing. */
+void storage_checkpoint(const struct record_meta *meta)
+{
+    unsigned int key = irq_lock();
+
+    checkpoint_meta = *meta;
+    checkpoint_pending = true;
+
+    irq_unlock(key);
+}
+
+/* Where reads stop: at the last checkpoint of the take being written,
+ * at the end of any other */
+static uint32_t storage_reader_end(void)
+{
+    if(is_opened == true && session.id == reader_id)
+    {
+        return committed;
+    }
+
+    return UINT32_MAX;
+}
+
+static void storage_reader_close(void)
+{
+    if(reader_opened == true)
+    {
+        storage_take_close(&reader);
+        reader_opened = false;
+    }
+}
+
+/* (Re)open the read handle. It only knows the size the take had then,
+ * so it is opened again once the take has grown past that. */
+static int storage_reader_refresh(void)
+{
+    int result = 0;
+    off_t size = 0;
+
+    storage_reader_close();
+
+    result = storage_take_open(&reader, reader_id, false);
+    if(result != 0)
+    {
+        return result;
+    }
+
+    reader_opened = true;
+    reader_end = storage_reader_end();
+
+    size = storage_take_size(&reader);
+    if(size < 0)
+    {
+        return size;
+    }
+
+    reader_size = size;
+
+    return 0;
+}
+
+/* Select a take for reading, from its first byte. Reads have a handle
+ * and a cursor of their own, so the take being recorded can be read
+ * beside the writer, up to its last checkpoint. */
+int storage_session_open(uint16_t id)
+{
+    int result = 0;
+    struct storage_session entry = {0};
+
+    result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    if(result != 0)
+    {
+        LOG_ERR("Lock mutex - fail. Result %d", result);
+
+        return result;
+    }
+
+    storage_reader_close();
+
+    result = storage_index_read(id, &entry);
+    if(result != 0)
+    {
+        goto exit;
+    }
+
+    /* A take still marked recording is readable only while it is written */
+    if(entry.state != STORAGE_SESSION_CLOSED &&
+       (entry.state != STORAGE_SESSION_RECORDING || is_opened == false ||
+        session.id != entry.id))
+    {
+        result = -ENOENT;
+
+        goto exit;
+    }
+
+    reader_id = entry.id;
+
+    result = storage_reader_refresh();
+    if(result == 0)
+    {
+        LOG_INF("Session %d opened", entry.id);
+    }
+
+exit:
+    k_mutex_unlock(&storage_mutex);
+
+    return result;
+}
+
+int storage_session_close(void)
+{
+    int result = 0;
+
+    result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    if(result != 0)
+    {
+        LOG_ERR("Lock mutex - fail. Result %d", result);
+
+        return result;
+    }
+
+    storage_reader_close();
+
+    k_mutex_unlock(&storage_mutex);
+
+    return 0;
+}
+
+int storage_session_get(uint16_t id, struct storage_session *out)
+{
+    int result = 0;
+
+    result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    if(result != 0)
+    {
+        LOG_ERR("Lock mutex - fail. Result %d", result);
+
+        return result;
+    }
+
+    result = storage_index_read(id, out);
+
+    k_mutex_unlock(&storage_mutex);
+
+    return result;
+}
+
+int storage_session_delete(uint16_t id)
+{
+    int result = 0;
+    char path[STORAGE_PATH_SIZE];
+    struct storage_session entry = {0};
+
+    result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    if(result != 0)
+    {
+        LOG_ERR("Lock mutex - fail. Result %d", result);
+
+        return result;
+    }
+
+    result = storage_index_read(id, &entry);
+    if(result != 0)
+    {
+        goto exit;
+    }
+
+    if((is_opened == true && session.id == entry.id) ||
+       (reader_opened == true && reader_id == entry.id))
+    {
+        result = -EBUSY;
+
+        goto exit;
+    }
+
+    if(entry.state == STORAGE_SESSION_DELETED)
+    {
+        result = -ENOENT;
+
+        goto exit;
+    }
+
+    /* Mark the entry first, a crash in between only leaves an orphan file */
+    entry.state = STORAGE_SESSION_DELETED;
+
+    result = storage_index_write(&entry);
+    if(result != 0)
+    {
+        goto exit;
+    }
+
+    result = storage_take_remove(entry.id);
+    if(result != 0)
+    {
+        LOG_ERR("Remove session %d - fail. Result %d", entry.id, result);
+    }
 
-static bool is_opened = false;
+    /* Takes recorded without side files have none to remove */
+    storage_path(path, STORAGE_SUMMARY_PATH, entry.id);
+    fs_unlink(path);
 
-void storage_init(void)
-{
-    int result = 0;
-    
-    /*
-    *  Note the fatfs library is able to mount only strings inside _VOLUME_STRS
-    *  in ffconf.h
-    */
-    mp.mnt_point = "/SD:";
+    storage_path(path, STORAGE_CRC_PATH, entry.id);
+    fs_unlink(path);
 
-    result = fs_mount(&mp);
-    __ASSERT(result == 0, "storage init - fail. Result %d", result);
+exit:
+    k_mutex_unlock(&storage_mutex);
 
-    LOG_INF("Init success");
+    return result;
 }
 
-static int storage_open_mocap_file(void)
+/* Pack data into the current block. Full blocks are queued to the
+ * writer thread, so the file only ever sees whole block writes. The
+ * data holds samples [first, end), which the blocks it lands in note
+ * for the CRC index. */
+static ssize_t storage_write_range(void *data, size_t size, uint32_t first, uint32_t end)
 {
     int result = 0;
-    static const char path[] = "/SD:/MOCAP.DAT";
+    size_t chunk = 0;
+    size_t written = 0;
+    uint32_t sync = 0;
 
-    fs_file_t_init(&storage);
-
-    result = fs_open(&storage, path, FS_O_RDWR | FS_O_CREATE);
+    result = k_mutex_lock(&storage_block_mutex, K_FOREVER);
     if(result != 0)
     {
-        LOG_ERR("Open %s - fail. Result %d", path, result);
+        LOG_ERR("Lock mutex - fail. Result %d", result);
 
         return result;
     }
 
+    if(writer_result < 0)
+    {
+        result = writer_result;
+
+        goto exit;
+    }
+
+    /* Every write is one block record, or the record header */
+    sync = write_end;
+
+    while(written < size)
+    {
+        if(fill_block == NULL)
+        {
+            /* Waits here only if the writer thread is behind by a whole buffer */
+            result = k_msgq_get(&storage_free_queue, &fill_block, K_FOREVER);
+            if(result != 0)
+            {
+                LOG_ERR("Get free block - fail. Result %d", result);
+
+                goto exit;
+            }
+        }
+
+        if(fill_block->len == 0)
+        {
+            fill_block->first = samples_end;
+            fill_block->end = samples_end;
+        }
+
+        if(first != end)
+        {
+            if(fill_block->first == fill_block->end)
+            {
+                fill_block->first = first;
+            }
+
+            fill_block->end = end;
+        }
+
+        /* Blocks this one only runs through keep the last sync point */
+        fill_block->sync = sync;
+        fill_block->index = first + samples_lost;
+
+        chunk = MIN(size - written, STORAGE_BLOCK_SIZE - fill_block->len);
+        memcpy(&fill_block->data[fill_block->len], (uint8_t *)data + written, chunk);
+        fill_block->len += chunk;
+        written += chunk;
+        write_end += chunk;
+
+        if(fill_block->len == STORAGE_BLOCK_SIZE)
+        {
+            result = k_msgq_put(&storage_flush_queue, &fill_block, K_FOREVER);
+            if(result != 0)
+            {
+                LOG_ERR("Queue block - fail. Result %d", result);
+
+                goto exit;
+            }
+
+            fill_block = NULL;
+        }
+    }
+
+    if(first != end)
+    {
+        samples_end = end;
+    }
+
+    result = written;
+
+exit:
+    k_mutex_unlock(&storage_block_mutex);
+
     return result;
 }
 
-static int storage_open_meta_file(void)
+ssize_t storage_write(void *data, size_t size)
 {
-    int result = 0;
-    static const char path[] = "/SD:/META.DAT";
+    return storage_write_range(data, size, samples_end, samples_end);
+}
 
-    fs_file_t_init(&meta);
+/* Samples are stored sample indices, for the CRC index */
+ssize_t storage_samples_write(void *data, size_t size, uint32_t first, uint32_t end)
+{
+    return storage_write_range(data, size, first, end);
+}
 
-    result = fs_open(&meta, path, FS_O_RDWR | FS_O_CREATE);
-    if(result != 0)
-    {
-        LOG_ERR("Open %s - fail. Result %d", path, result);
+/* A gap block, the samples it stands for count on the timeline */
+ssize_t storage_gap_write(void *data, size_t size, uint32_t lost)
+{
+    ssize_t result = storage_write_range(data, size, samples_end, samples_end);
 
-        return result;
+    if(result >= 0)
+    {
+        samples_lost += lost;
     }
 
     return result;
 }
 
-int storage_close(void)
+void storage_stats_get(struct storage_stats *out)
 {
-    int result = 0;
+    uint32_t elapsed = 0;
 
-    result = k_mutex_lock(&storage_mutex, K_FOREVER);
-    if(result != 0)
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    *out = stats;
+
+    if(stats.flush_count > 0)
     {
-        LOG_ERR("Lock mutex - fail. Result %d", result);
+        out->flush_latency_mean = flush_latency_total / stats.flush_count;
+    }
 
-        return result;
+    if(flush_latency_total > 0)
+    {
+        out->write_rate = ((uint64_t)stats.bytes_written * USEC_PER_SEC) / flush_latency_total;
     }
 
-    if(is_opened == true)
+    if(stats.checkpoint_count > 0)
     {
-        result = fs_close(&storage);
-        if(result == 0)
-        {
-            result = fs_close(&meta);
-            if(result == 0)
-            {
-                is_opened = false;
+        out->checkpoint_latency_mean = checkpoint_latency_total / stats.checkpoint_count;
+        out->checkpoint_share = checkpoint_latency_total * 1000 /
+                                (flush_latency_total + checkpoint_latency_total);
+    }
 
-                LOG_INF("Close success");
-            }
-        }
+    if(stats.crc_count > 0)
+    {
+        out->crc_latency_mean = crc_latency_total / stats.crc_count;
+        out->crc_share = crc_latency_total * 1000 /
+                         (flush_latency_total + checkpoint_latency_total + crc_latency_total);
+    }
+
+    elapsed = k_uptime_get_32() - open_timestamp;
+    if(elapsed > 0)
+    {
+        out->throughput = ((uint64_t)stats.bytes_written * MSEC_PER_SEC) / elapsed;
     }
 
     k_mutex_unlock(&storage_mutex);
+}
 
-    return result;
+/* Writes go first: a read waits a bounded time for queued blocks to
+ * reach the card, true if it had to */
+static bool storage_read_wait(void)
+{
+    if(k_msgq_num_used_get(&storage_flush_queue) == 0)
+    {
+        return false;
+    }
+
+    /* Once only, a writer that is never idle must not starve the reader */
+    k_sem_take(&storage_write_idle, STORAGE_READ_WAIT);
+
+    return true;
 }
 
-int storage_open(void)
+/* Called with the storage mutex held */
+static ssize_t storage_read_chunk(off_t offset, void *data, size_t size)
 {
     int result = 0;
+    uint32_t end = 0;
 
-    result = k_mutex_lock(&storage_mutex, K_FOREVER);
-    if(result != 0)
+    if(reader_opened == false)
     {
-        LOG_ERR("Lock mutex - fail. Result %d", result);
-
-        return result;
+        return -EBADF;
     }
 
-    /* close storage first if it is already opened */
-    if(is_opened == true)
+    end = storage_reader_end();
+
+    /* Committed more or finished since the handle was opened */
+    if(end != reader_end && (uint32_t)offset + size > reader_size)
     {
-        result = storage_close();
+        result = storage_reader_refresh();
         if(result != 0)
         {
-            LOG_ERR("Fail to close on open. Result %d", result);
-            goto exit;
+            return result;
         }
     }
 
-    result = storage_open_mocap_file();
-    if(result == 0)
+    if((uint32_t)offset >= end)
     {
-        result = storage_open_meta_file();
-        if(result == 0)
+        return 0;
+    }
+
+    return storage_take_read(&reader, offset, data, MIN(size, end - offset));
+}
+
+/* Reads are addressed, so a download can resume or skip ranges
+ * no matter where the previous read left the file cursor. The mutex is
+ * held for one sector at a time, so a block that comes up meanwhile
+ * waits for one sector read at most. */
+ssize_t storage_read(off_t offset, void *data, size_t size)
+{
+    int result = 0;
+    size_t done = 0;
+    size_t chunk = 0;
+    bool waited = false;
+
+    while(done < size)
+    {
+        waited = storage_read_wait();
+
+        result = k_mutex_lock(&storage_mutex, K_FOREVER);
+        if(result != 0)
+        {
+            LOG_ERR("Lock mutex - fail. Result %d", result);
+
+            return result;
+        }
+
+        chunk = MIN(size - done, STORAGE_SECTOR_SIZE - (offset + done) % STORAGE_SECTOR_SIZE);
+
+        result = storage_read_chunk(offset + done, (uint8_t *)data + done, chunk);
+        if(result > 0)
+        {
+            stats.read_bytes += result;
+        }
+
+        if(waited == true)
+        {
+            stats.read_waits++;
+        }
+
+        k_mutex_unlock(&storage_mutex);
+
+        if(result <= 0)
         {
-            is_opened = true;
+            break;
+        }
+
+        done += result;
 
-            LOG_INF("Open success");
+        if(result < chunk)
+        {
+            break;
         }
     }
-    
-exit:
-    k_mutex_unlock(&storage_mutex);
 
-    return result;
+    if(result < 0)
+    {
+        LOG_ERR("Read - fail. Result %d", result);
+
+        return result;
+    }
+
+    return done;
 }
 
-int storage_clear(void)
+/* Queue a block record of the side index. Never blocks, the writer
+ * thread appends it after its next block. */
+int storage_summary_put(const struct record_stats *block)
 {
-    int result = 0; 
+    return k_msgq_put(&storage_summary_queue, block, K_NO_WAIT);
+}
+
+/* Write the side index of the take being recorded in place, after the
+ * queued block records. The first write of a take creates the file. */
+int storage_summary_write(off_t offset, const void *data, size_t size)
+{
+    int result = 0;
+    char path[STORAGE_PATH_SIZE];
 
     result = k_mutex_lock(&storage_mutex, K_FOREVER);
     if(result != 0)
@@ -161,32 +1716,76 @@ int storage_clear(void)
         return result;
     }
 
-    /* Truncate to zero (clear all previous data)*/
-    result = fs_truncate(&storage, 0);
-    if(result != 0)
+    if(is_opened == false || session.state != STORAGE_SESSION_RECORDING)
     {
-        LOG_ERR("Truncate storage - fail. Result %d", result);
+        result = -EINVAL;
 
         goto exit;
     }
 
-    result = fs_truncate(&meta, 0);
+    if(summary_opened == false)
+    {
+        storage_path(path, STORAGE_SUMMARY_PATH, session.id);
+
+        fs_file_t_init(&summary_file);
+
+        result = fs_open(&summary_file, path, FS_O_RDWR | FS_O_CREATE);
+        if(result != 0)
+        {
+            LOG_ERR("Open %s - fail. Result %d", path, result);
+
+            goto exit;
+        }
+
+        /* Left over only if the index was lost */
+        result = fs_truncate(&summary_file, 0);
+        if(result != 0)
+        {
+            fs_close(&summary_file);
+
+            goto exit;
+        }
+
+        summary_opened = true;
+    }
+
+    storage_summary_drain();
+
+    result = fs_seek(&summary_file, offset, FS_SEEK_SET);
     if(result != 0)
     {
-        LOG_ERR("Truncate meta - fail. Result %d", result);
+        LOG_ERR("Summary seek - fail. Result %d", result);
+
+        goto exit;
+    }
+
+    /* Not synced, closing the take writes it out */
+    result = fs_write(&summary_file, data, size);
+    if(result != size)
+    {
+        LOG_ERR("Summary write - fail. Result %d", result);
+
+        result = result < 0 ? result : -EIO;
 
         goto exit;
     }
 
+    result = 0;
+
 exit:
     k_mutex_unlock(&storage_mutex);
 
     return result;
 }
 
-ssize_t storage_write(void *data, size_t size)
+/* Read a side file of a finished take, also while another one records */
+static ssize_t storage_side_read(const char *format, uint16_t id, off_t offset, void *data,
+                                 size_t size)
 {
     int result = 0;
+    char path[STORAGE_PATH_SIZE];
+    struct fs_file_t file;
+    struct storage_session entry = {0};
 
     result = k_mutex_lock(&storage_mutex, K_FOREVER);
     if(result != 0)
@@ -196,94 +1795,190 @@ ssize_t storage_write(void *data, size_t size)
         return result;
     }
 
-    result = fs_write(&storage, data, size);
-    if(result < 0)
+    result = storage_index_read(id, &entry);
+    if(result != 0)
+    {
+        goto exit;
+    }
+
+    if(entry.state != STORAGE_SESSION_CLOSED)
     {
-        LOG_ERR("Write - fail. Result %d", result);
+        result = (entry.state == STORAGE_SESSION_RECORDING) ? -EBUSY : -ENOENT;
+
+        goto exit;
+    }
 
+    storage_path(path, format, entry.id);
+
+    fs_file_t_init(&file);
+
+    result = fs_open(&file, path, FS_O_READ);
+    if(result != 0)
+    {
         goto exit;
     }
 
+    result = fs_seek(&file, offset, FS_SEEK_SET);
+    if(result == 0)
+    {
+        result = fs_read(&file, data, size);
+    }
+
+    fs_close(&file);
+
 exit:
     k_mutex_unlock(&storage_mutex);
 
     return result;
 }
 
-ssize_t storage_read(void *data, size_t size)
+ssize_t storage_summary_read(uint16_t id, off_t offset, void *data, size_t size)
 {
-    int result = 0;
+    return storage_side_read(STORAGE_SUMMARY_PATH, id, offset, data, size);
+}
 
-    result = k_mutex_lock(&storage_mutex, K_FOREVER);
-    if(result != 0)
-    {
-        LOG_ERR("Lock mutex - fail. Result %d", result);
+/* Entries [first, first + count) of a take's CRC index, returns bytes read.
+ * An index of another layout is not misread as this one. */
+ssize_t storage_crc_read(uint16_t id, uint32_t first, struct record_crc *entries, size_t count)
+{
+    ssize_t result = 0;
+    struct record_crc_header header = {0};
 
+    result = storage_side_read(STORAGE_CRC_PATH, id, 0, &header, sizeof(header));
+    if(result < 0)
+    {
         return result;
     }
 
-    result = fs_read(&storage, data, size);
-    if(result < 0)
+    if(result != sizeof(header) || header.magic != RECORD_CRC_MAGIC ||
+       header.version != RECORD_CRC_VERSION || header.entry_size != sizeof(*entries))
     {
-        LOG_ERR("Read - fail. Result %d", result);
-
-        goto exit;
+        return -ENOTSUP;
     }
 
-exit:
-    k_mutex_unlock(&storage_mutex);
-
-    return result;
+    return storage_side_read(STORAGE_CRC_PATH, id,
+                             sizeof(header) + (off_t)first * sizeof(*entries), entries,
+                             count * sizeof(*entries));
 }
 
-ssize_t storage_meta_write(void *data, size_t size)
+#ifdef CONFIG_MOCAP_STORAGE_RAWLOG
+/* Copy a finished take from the raw log to R<id>.DAT on the FAT volume,
+ * so the card can be read on a computer. Holds the storage for as long
+ * as it takes, so not while recording. */
+int storage_session_export(uint16_t id)
 {
     int result = 0;
+    ssize_t size = 0;
+    off_t offset = 0;
+    char path[STORAGE_PATH_SIZE];
+    struct fs_file_t file;
+    struct rawlog_file take = {0};
+    struct storage_session entry = {0};
+    struct storage_block *block = NULL;
+
+    /* Any idle block will do as the copy buffer */
+    if(k_msgq_get(&storage_free_queue, &block, K_NO_WAIT) != 0)
+    {
+        return -EBUSY;
+    }
 
     result = k_mutex_lock(&storage_mutex, K_FOREVER);
     if(result != 0)
     {
         LOG_ERR("Lock mutex - fail. Result %d", result);
 
-        return result;
+        goto release;
     }
 
-    result = fs_write(&meta, data, size);
-    if(result < 0)
+    if(is_opened == true && session.state == STORAGE_SESSION_RECORDING)
     {
-        LOG_ERR("Meta write - fail. Result %d", result);
+        result = -EBUSY;
 
         goto exit;
     }
 
-exit:
-    k_mutex_unlock(&storage_mutex);
+    result = storage_index_read(id, &entry);
+    if(result != 0)
+    {
+        goto exit;
+    }
 
-    return result;
-}
+    if(entry.state != STORAGE_SESSION_CLOSED)
+    {
+        result = -ENOENT;
 
-ssize_t storage_meta_read(void *data, size_t size)
-{
-    int result = 0;
+        goto exit;
+    }
 
-    result = k_mutex_lock(&storage_mutex, K_FOREVER);
+    result = rawlog_open(&take, entry.id, false);
     if(result != 0)
     {
-        LOG_ERR("Lock mutex - fail. Result %d", result);
+        goto exit;
+    }
 
-        return result;
+    storage_path(path, STORAGE_SESSION_PATH, entry.id);
+
+    fs_file_t_init(&file);
+
+    result = fs_open(&file, path, FS_O_RDWR | FS_O_CREATE);
+    if(result != 0)
+    {
+        LOG_ERR("Open %s - fail. Result %d", path, result);
+
+        goto exit;
     }
 
-    result = fs_read(&meta, data, size);
-    if(result < 0)
+    result = fs_truncate(&file, 0);
+
+    while(result == 0)
+    {
+        size = rawlog_read(&take, offset, block->data, STORAGE_BLOCK_SIZE);
+        if(size <= 0)
+        {
+            result = size;
+
+            break;
+        }
+
+        result = fs_write(&file, block->data, size);
+        if(result != size)
+        {
+            result = result < 0 ? result : -ENOSPC;
+
+            break;
+        }
+
+        offset += size;
+        result = 0;
+    }
+
+    fs_close(&file);
+
+    if(result != 0)
     {
-        LOG_ERR("Meta read - fail. Result %d", result);
+        LOG_ERR("Export %s - fail. Result %d", path, result);
+
+        /* No half copy that looks like a take */
+        fs_unlink(path);
 
         goto exit;
     }
 
+    LOG_INF("Session %d exported, %d bytes", entry.id, (int)offset);
+
 exit:
     k_mutex_unlock(&storage_mutex);
 
+release:
+    block->len = 0;
+    k_msgq_put(&storage_free_queue, &block, K_NO_WAIT);
+
     return result;
-}
\ No newline at end of file
+}
+#else
+/* Takes already are files on the FAT volume */
+int storage_session_export(uint16_t id)
+{
+    return -ENOTSUP;
+}
+#endif
\ No newline at end of file
@@ -2,14 +2,73 @@
 #define STORAGE_H
 
 #include <sys/types.h>
+#include <stdint.h>
+
+#include "record.h"
+
+enum
+{
+    STORAGE_SESSION_EMPTY     = 0,
+    STORAGE_SESSION_RECORDING = 1, // Never closed, e.g. power loss
+    STORAGE_SESSION_CLOSED    = 2,
+    STORAGE_SESSION_DELETED   = 3,
+};
+
+/* One entry per take in INDEX.DAT. Entries are never moved, so the
+ * session id is the entry position plus one. Id 0 means the latest. */
+struct storage_session
+{
+    uint16_t id;
+    uint8_t state;
+    uint8_t reserved;
+    uint16_t version;    /* Record format version */
+    uint16_t reserved2;
+    uint32_t start_time; /* ms uptime at record start */
+    struct record_meta meta;
+};
+
+/* Block writer counters. Latencies are in microseconds,
+ * rates in bytes per second. */
+struct storage_stats
+{
+    uint32_t flush_count;
+    uint32_t flush_latency_min;
+    uint32_t flush_latency_max;
+    uint32_t flush_latency_mean;
+    uint32_t flush_latency_last;
+    uint32_t bytes_written;
+    uint32_t write_rate;    /* while the card is busy */
+    uint32_t throughput;    /* sustained, since storage was opened */
+    uint32_t checkpoint_count;
+    uint32_t checkpoint_latency_max;
+    uint32_t checkpoint_latency_mean;
+    uint32_t checkpoint_share; /* checkpoint part of the card busy time, in 0.1 % */
+    uint32_t crc_count;        /* CRC index entries */
+    uint32_t crc_latency_max;  /* Index write of one batch of entries */
+    uint32_t crc_latency_mean; /* Per entry */
+    uint32_t crc_share;        /* CRC index part of the card busy time, in 0.1 % */
+    uint32_t read_bytes;       /* Read back, also while recording */
+    uint32_t read_waits;       /* Reads held back for queued blocks */
+};
 
 void storage_init(void);
-int storage_open(void);
-int storage_clear(void);
+int storage_session_create(uint32_t start_time, uint16_t *id);
+int storage_session_finish(const struct record_meta *meta);
+void storage_checkpoint(const struct record_meta *meta);
+int storage_session_open(uint16_t id);
+int storage_session_close(void);
+int storage_session_get(uint16_t id, struct storage_session *session);
+int storage_session_delete(uint16_t id);
+int storage_session_export(uint16_t id);
 ssize_t storage_write(void *data, size_t size);
-ssize_t storage_read(void *data, size_t size);
-ssize_t storage_meta_write(void *data, size_t size);
-ssize_t storage_meta_read(void *data, size_t size);
+ssize_t storage_samples_write(void *data, size_t size, uint32_t first, uint32_t end);
+ssize_t storage_gap_write(void *data, size_t size, uint32_t lost);
+ssize_t storage_read(off_t offset, void *data, size_t size);
 int storage_close(void);
+void storage_stats_get(struct storage_stats *stats);
+int storage_summary_put(const struct record_stats *block);
+int storage_summary_write(off_t offset, const void *data, size_t size);
+ssize_t storage_summary_read(uint16_t id, off_t offset, void *data, size_t size);
+ssize_t storage_crc_read(uint16_t id, uint32_t first, struct record_crc *entries, size_t count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,298 @@
+#include <zephyr.h>
+#include <string.h>
+
+#include "summary.h"
+
+/* Running statistics of the stored samples, per sensor over fixed size
+ * blocks and over the whole take. Sums are kept around the first value
+ * of the span, so the variance does not drown in the square of a 1 g
+ * mean. A finished block is folded into the take totals and into a
+ * coarse activity envelope that halves its resolution when it fills up. */
+
+#define SUMMARY_AXES          6
+#define SUMMARY_BLOCK_SAMPLES CONFIG_MOCAP_SUMMARY_BLOCK
+#define SUMMARY_ACTIVITY_SHIFT 7 // Deviation to 1/256 of full scale
+
+struct summary_axis
+{
+    int16_t min;
+    int16_t max;
+    int16_t ref;    // First value of the span
+    int64_t sum;    // Of value - ref
+    uint64_t sum2;  // Of (value - ref)^2
+};
+
+struct summary_span
+{
+    struct summary_axis axes[SUMMARY_AXES];
+    uint32_t index; // First sample
+    uint32_t count;
+};
+
+struct summary_sensor
+{
+    struct summary_span block;
+    struct summary_span take;
+};
+
+static struct summary_sensor sensors[ACCEL_SENSOR_COUNT];
+static uint32_t block_count = 0; // Block records handed out
+static uint8_t block_activity = 0; // Largest of the sensors in the current block
+static uint8_t envelope[RECORD_ENVELOPE_SIZE];
+static uint8_t envelope_count = 0;
+static uint32_t envelope_span = 1;
+static uint32_t envelope_fill = 0; // Blocks in the last point
+
+void summary_reset(void)
+{
+    memset(sensors, 0, sizeof(sensors));
+    memset(envelope, 0, sizeof(envelope));
+
+    block_count = 0;
+    block_activity = 0;
+    envelope_count = 0;
+    envelope_span = 1;
+    envelope_fill = 0;
+}
+
+static void summary_axes_get(const struct accel_entry *entry, int16_t *axes)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        axes[i] = entry->accel[i];
+        axes[i + 3] = entry->gyro[i];
+    }
+}
+
+static uint32_t summary_sqrt(uint64_t value)
+{
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while(bit > value)
+    {
+        bit >>= 2;
+    }
+
+    while(bit != 0)
+    {
+        if(value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+/* Mean in Q8 and mean square in Q16 around ref, so the variance keeps
+ * its fraction. Only runs once per block and axis. */
+static void summary_axis_stats(const struct summary_axis *axis, uint32_t count,
+                               struct record_axis_stats *stats)
+{
+    int64_t mean = 0;
+    uint64_t square = 0;
+    uint64_t mean2 = 0;
+
+    stats->min = axis->min;
+    stats->max = axis->max;
+
+    mean = axis->sum * 256 / (int64_t)count;
+    square = ((axis->sum2 / count) << 16) + (((axis->sum2 % count) << 16) / count);
+    mean2 = (uint64_t)(mean * mean);
+
+    stats->mean = CLAMP(axis->ref + ((mean + 128) >> 8), INT16_MIN, INT16_MAX);
+    stats->deviation = MIN(summary_sqrt(square > mean2 ? square - mean2 : 0) >> 8, UINT16_MAX);
+}
+
+static void summary_span_stats(const struct summary_span *span, uint8_t sensor,
+                               struct record_stats *stats)
+{
+    uint16_t deviation = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    stats->index = span->index;
+    stats->count = span->count;
+    stats->sensor = sensor;
+
+    if(span->count == 0)
+    {
+        return;
+    }
+
+    for(int i = 0; i < SUMMARY_AXES; i++)
+    {
+        summary_axis_stats(&span->axes[i], span->count, &stats->axes[i]);
+        deviation = MAX(deviation, stats->axes[i].deviation);
+    }
+
+    stats->activity = MIN(deviation >> SUMMARY_ACTIVITY_SHIFT, UINT8_MAX);
+}
+
+/* Sums around the take reference: (x - R) = (x - r) + (r - R) */
+static void summary_span_merge(struct summary_span *take, const struct summary_span *block)
+{
+    struct summary_axis *to = NULL;
+    const struct summary_axis *from = NULL;
+    int64_t shift = 0;
+
+    if(block->count == 0)
+    {
+        return;
+    }
+
+    for(int i = 0; i < SUMMARY_AXES; i++)
+    {
+        to = &take->axes[i];
+        from = &block->axes[i];
+
+        if(take->count == 0)
+        {
+            *to = *from;
+
+            continue;
+        }
+
+        shift = (int64_t)from->ref - to->ref;
+
+        to->min = MIN(to->min, from->min);
+        to->max = MAX(to->max, from->max);
+        to->sum2 += from->sum2 + 2 * shift * from->sum + (uint64_t)(shift * shift) * block->count;
+        to->sum += from->sum + shift * block->count;
+    }
+
+    take->count += block->count;
+}
+
+/* One point per envelope_span blocks, pairs merge when all points are used */
+static void summary_envelope_put(uint8_t activity)
+{
+    if(envelope_fill == 0)
+    {
+        if(envelope_count == RECORD_ENVELOPE_SIZE)
+        {
+            for(int i = 0; i < RECORD_ENVELOPE_SIZE / 2; i++)
+            {
+                envelope[i] = MAX(envelope[2 * i], envelope[2 * i + 1]);
+            }
+
+            memset(&envelope[RECORD_ENVELOPE_SIZE / 2], 0, RECORD_ENVELOPE_SIZE / 2);
+            envelope_count = RECORD_ENVELOPE_SIZE / 2;
+            envelope_span *= 2;
+        }
+
+        envelope[envelope_count++] = activity;
+    }
+    else
+    {
+        envelope[envelope_count - 1] = MAX(envelope[envelope_count - 1], activity);
+    }
+
+    envelope_fill = (envelope_fill + 1) % envelope_span;
+}
+
+/* The block of a sensor ends, its record goes to block */
+static void summary_block_end(uint8_t sensor, struct record_stats *block)
+{
+    struct summary_sensor *state = &sensors[sensor];
+
+    summary_span_stats(&state->block, sensor, block);
+    summary_span_merge(&state->take, &state->block);
+
+    block_count++;
+    block_activity = MAX(block_activity, block->activity);
+
+    /* Sensors are in lockstep, the last one closes the block of all */
+    if(sensor == ACCEL_SENSOR_COUNT - 1)
+    {
+        summary_envelope_put(block_activity);
+        block_activity = 0;
+    }
+
+    state->block.index += state->block.count;
+    state->block.count = 0;
+}
+
+/* True with a block record in block once the sensor has a whole block */
+bool summary_put(uint8_t sensor, const struct accel_entry *entry, struct record_stats *block)
+{
+    struct summary_span *span = &sensors[sensor].block;
+    struct summary_axis *axis = NULL;
+    int16_t axes[SUMMARY_AXES];
+    int32_t value = 0;
+
+    summary_axes_get(entry, axes);
+
+    for(int i = 0; i < SUMMARY_AXES; i++)
+    {
+        axis = &span->axes[i];
+
+        if(span->count == 0)
+        {
+            axis->min = axes[i];
+            axis->max = axes[i];
+            axis->ref = axes[i];
+            axis->sum = 0;
+            axis->sum2 = 0;
+
+            continue;
+        }
+
+        value = (int32_t)axes[i] - axis->ref;
+
+        axis->min = MIN(axis->min, axes[i]);
+        axis->max = MAX(axis->max, axes[i]);
+        axis->sum += value;
+        axis->sum2 += (uint32_t)value * (uint32_t)value; // Exact, the square fits in 32 bits
+    }
+
+    if(++span->count < SUMMARY_BLOCK_SAMPLES)
+    {
+        return false;
+    }
+
+    summary_block_end(sensor, block);
+
+    return true;
+}
+
+/* The partial block at the end of the take, if there is one */
+bool summary_flush(uint8_t sensor, struct record_stats *block)
+{
+    if(sensors[sensor].block.count == 0)
+    {
+        return false;
+    }
+
+    summary_block_end(sensor, block);
+
+    return true;
+}
+
+void summary_get(struct record_summary *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+
+    summary->magic = RECORD_SUMMARY_MAGIC;
+    summary->version = RECORD_SUMMARY_VERSION;
+    summary->header_size = sizeof(*summary) + ACCEL_SENSOR_COUNT * sizeof(struct record_stats);
+    summary->block_samples = SUMMARY_BLOCK_SAMPLES;
+    summary->sensors = ACCEL_SENSOR_COUNT;
+    summary->blocks = block_count;
+    summary->envelope_span = envelope_span;
+    summary->envelope_count = envelope_count;
+    memcpy(summary->envelope, envelope, sizeof(envelope));
+}
+
+void summary_totals_get(uint8_t sensor, struct record_stats *totals)
+{
+    summary_span_stats(&sensors[sensor].take, sensor, totals);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "accel.h"
+#include "record.h"
+
+#ifdef CONFIG_MOCAP_SUMMARY
+
+void summary_reset(void);
+bool summary_put(uint8_t sensor, const struct accel_entry *entry, struct record_stats *block);
+bool summary_flush(uint8_t sensor, struct record_stats *block);
+void summary_get(struct record_summary *summary);
+void summary_totals_get(uint8_t sensor, struct record_stats *totals);
+
+#else
+
+static inline void summary_reset(void) {}
+
+static inline bool summary_put(uint8_t sensor, const struct accel_entry *entry,
+                               struct record_stats *block)
+{
+    return false;
+}
+
+static inline bool summary_flush(uint8_t sensor, struct record_stats *block)
+{
+    return false;
+}
+
+static inline void summary_get(struct record_summary *summary) {}
+static inline void summary_totals_get(uint8_t sensor, struct record_stats *totals) {}
+
+#endif
+
+#endif
\ No newline at end of file
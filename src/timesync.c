@@ -0,0 +1,133 @@
+#include <zephyr.h>
+#include <logging/log.h>
+
+#include "timesync.h"
+
+LOG_MODULE_REGISTER(timesync);
+
+#define TIMESYNC_BURST_US     (2 * USEC_PER_SEC)  // Exchanges this close are one measurement
+#define TIMESYNC_DRIFT_MIN_US (10 * USEC_PER_SEC) // Shortest span to measure drift over
+#define TIMESYNC_RESOLUTION_US ((USEC_PER_SEC + CONFIG_SYS_CLOCK_TICKS_PER_SEC - 1) / \
+                                CONFIG_SYS_CLOCK_TICKS_PER_SEC) // One device clock tick
+
+static struct timesync_request last_request = {0};
+static struct timesync_reply last_reply = {0};
+static bool pending = false;
+
+/* Best exchange of the first and of the latest measurement */
+static struct record_sync anchor = {0};
+static struct record_sync current = {0};
+static uint64_t burst_start = 0;
+static bool synced = false;
+
+K_MUTEX_DEFINE(timesync_mutex);
+
+uint64_t timesync_now_us(void)
+{
+    return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+/* Device time of a recent cycle counter value */
+uint64_t timesync_cycles_to_us(uint32_t cycles)
+{
+    uint32_t now = k_cycle_get_32();
+    uint64_t now_us = timesync_now_us();
+
+    return now_us - k_cyc_to_us_floor64(now - cycles);
+}
+
+/* The true offset lies within half the round trip of the midpoint estimate.
+ * Of the exchanges in a burst the one with the shortest round trip is kept. */
+static void timesync_sample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4)
+{
+    struct record_sync sample = {0};
+    int64_t rtt = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+
+    if(rtt < 0)
+    {
+        /* Host clock stepped between the two */
+        return;
+    }
+
+    sample.offset_us = ((int64_t)(t1 - t2) + (int64_t)(t4 - t3)) / 2;
+    sample.sync_us = t2 + (t3 - t2) / 2;
+    sample.error_us = MIN(rtt / 2, UINT32_MAX - TIMESYNC_RESOLUTION_US) + TIMESYNC_RESOLUTION_US;
+
+    k_mutex_lock(&timesync_mutex, K_FOREVER);
+
+    if(synced == false || sample.sync_us - burst_start > TIMESYNC_BURST_US)
+    {
+        /* New measurement */
+        if(synced == false)
+        {
+            anchor = sample;
+        }
+
+        burst_start = sample.sync_us;
+        current = sample;
+        synced = true;
+    }
+    else if(sample.error_us < current.error_us)
+    {
+        current = sample;
+
+        /* Still in the first burst */
+        if(anchor.sync_us >= burst_start)
+        {
+            anchor = sample;
+        }
+    }
+
+    if(current.sync_us - anchor.sync_us >= TIMESYNC_DRIFT_MIN_US)
+    {
+        current.drift_ppb = (current.offset_us - anchor.offset_us) * NSEC_PER_SEC /
+                            (int64_t)(current.sync_us - anchor.sync_us);
+    }
+
+    k_mutex_unlock(&timesync_mutex);
+
+    LOG_DBG("Offset %lld us, error %u us, drift %d ppb", sample.offset_us, sample.error_us,
+            current.drift_ppb);
+}
+
+/* Runs in the command thread, rx_cycles is when the write came in */
+void timesync_request(const struct timesync_request *request, uint32_t rx_cycles,
+                      struct timesync_reply *reply)
+{
+    /* The host only knows t4 of the previous request */
+    if(pending == true && request->host_rx != 0 && request->seq == (uint8_t)(last_request.seq + 1))
+    {
+        timesync_sample(last_request.host_tx, last_reply.device_rx, last_reply.device_tx,
+                        request->host_rx);
+    }
+
+    last_request = *request;
+
+    reply->seq = request->seq;
+    reply->device_rx = timesync_cycles_to_us(rx_cycles);
+    reply->device_tx = timesync_now_us();
+
+    last_reply = *reply;
+    pending = true;
+}
+
+/* -ENODATA until a full exchange has been made */
+int timesync_get(struct record_sync *sync)
+{
+    int result = 0;
+
+    k_mutex_lock(&timesync_mutex, K_FOREVER);
+
+    if(synced == false)
+    {
+        result = -ENODATA;
+    }
+    else
+    {
+        *sync = current;
+    }
+
+    k_mutex_unlock(&timesync_mutex);
+
+    return result;
+}
\ No newline at end of file
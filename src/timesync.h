@@ -0,0 +1,32 @@
+#ifndef TIMESYNC_H
+#define TIMESYNC_H
+
+#include <stdint.h>
+
+#include "record.h"
+
+/* NTP-style exchange with the host. The host sends its time t1, the device
+ * notes t2 when the request came in and t3 when it replies, and the host
+ * notes t4 when the reply arrives. t4 comes back with the next request,
+ * so the device can keep its own estimate. All times are in us. */
+struct timesync_request
+{
+    uint8_t seq;      // Consecutive requests make an exchange
+    uint64_t host_tx; // t1
+    uint64_t host_rx; // t4 of the previous request, 0 if none
+} __packed;
+
+struct timesync_reply
+{
+    uint8_t seq;
+    uint64_t device_rx; // t2
+    uint64_t device_tx; // t3
+} __packed;
+
+uint64_t timesync_now_us(void);
+uint64_t timesync_cycles_to_us(uint32_t cycles);
+void timesync_request(const struct timesync_request *request, uint32_t rx_cycles,
+                      struct timesync_reply *reply);
+int timesync_get(struct record_sync *sync);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,168 @@
+#include <zephyr.h>
+#include <drivers/uart.h>
+#include <logging/log.h>
+#include <string.h>
+
+#include "trace.h"
+#include "ble.h"
+
+LOG_MODULE_REGISTER(trace);
+
+#define TRACE_STACK_SIZE  1024
+#define TRACE_PRIORITY    K_LOWEST_APPLICATION_THREAD_PRIO
+#define TRACE_RING_SIZE   CONFIG_MOCAP_TRACE_RING_SIZE
+#define TRACE_RETRY       K_MSEC(100) // Wait for a subscriber or radio buffers
+#define TRACE_SYNC        0xA5
+
+BUILD_ASSERT((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "Trace ring size must be a power of two");
+
+static struct trace_record ring[TRACE_RING_SIZE];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static uint16_t seq = 0;
+static uint32_t dropped = 0;
+
+static void trace_entry(void *p1, void *p2, void *p3);
+
+K_SEM_DEFINE(trace_pending, 0, 1);
+K_THREAD_DEFINE(trace, TRACE_STACK_SIZE, trace_entry, NULL, NULL, NULL,
+                TRACE_PRIORITY, 0, 0);
+
+/* Callable from any context, costs a copy of at most 20 bytes with
+ * interrupts locked. Never blocks, drops the event when the ring is full. */
+void trace_put(uint8_t event, const void *data, uint8_t len)
+{
+    struct trace_record *record = NULL;
+    uint32_t cycles = k_cycle_get_32();
+    bool wake = false;
+    unsigned int key = 0;
+
+    len = MIN(len, TRACE_DATA_SIZE);
+
+    key = irq_lock();
+
+    if(head - tail < TRACE_RING_SIZE)
+    {
+        record = &ring[head & (TRACE_RING_SIZE - 1)];
+        record->event = event;
+        record->len = len;
+        record->seq = sys_cpu_to_le16(seq);
+        record->cycles = sys_cpu_to_le32(cycles);
+        memcpy(record->data, data, len);
+
+        wake = (head == tail);
+        head++;
+    }
+    else
+    {
+        dropped++;
+    }
+
+    seq++;
+
+    irq_unlock(key);
+
+    if(wake == true)
+    {
+        k_sem_give(&trace_pending);
+    }
+}
+
+uint32_t trace_dropped_get(void)
+{
+    return dropped;
+}
+
+static bool trace_peek(struct trace_record *record)
+{
+    bool found = false;
+    unsigned int key = irq_lock();
+
+    if(head != tail)
+    {
+        *record = ring[tail & (TRACE_RING_SIZE - 1)];
+        found = true;
+    }
+
+    irq_unlock(key);
+
+    return found;
+}
+
+static void trace_release(void)
+{
+    unsigned int key = irq_lock();
+
+    tail++;
+
+    irq_unlock(key);
+}
+
+#ifdef CONFIG_MOCAP_TRACE_UART
+
+static const struct device *uart = NULL;
+
+/* Sync byte, the record and an XOR of the record bytes, so the
+ * host finds frames between the console text on the same port */
+static int trace_send(const struct trace_record *record)
+{
+    const uint8_t *byte = (const uint8_t *)record;
+    uint8_t check = 0;
+
+    uart_poll_out(uart, TRACE_SYNC);
+
+    for(size_t i = 0; i < sizeof(*record); i++)
+    {
+        uart_poll_out(uart, byte[i]);
+        check ^= byte[i];
+    }
+
+    uart_poll_out(uart, check);
+
+    return 0;
+}
+
+static void trace_backend_init(void)
+{
+    uart = device_get_binding(CONFIG_MOCAP_TRACE_UART_DEV);
+    __ASSERT(uart != NULL, "Fail to find trace UART");
+}
+
+#else
+
+/* Records wait in the ring until a client subscribes */
+static int trace_send(const struct trace_record *record)
+{
+    return ble_trace_send(record, sizeof(*record));
+}
+
+static void trace_backend_init(void) {}
+
+#endif
+
+/* Lowest priority, the output only ever takes idle time */
+static void trace_entry(void *p1, void *p2, void *p3)
+{
+    int result = 0;
+    struct trace_record record = {0};
+
+    trace_backend_init();
+
+    while(true)
+    {
+        k_sem_take(&trace_pending, K_FOREVER);
+
+        while(trace_peek(&record) == true)
+        {
+            result = trace_send(&record);
+            if(result != 0)
+            {
+                k_sleep(TRACE_RETRY);
+
+                continue;
+            }
+
+            trace_release();
+        }
+    }
+}
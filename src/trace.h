@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <zephyr.h>
+#include <sys/byteorder.h>
+#include <stdint.h>
+
+/* Events of the binary trace. Apart from samples each one carries
+ * up to three little endian uint32 arguments. */
+enum trace_event
+{
+    TRACE_SAMPLE = 1, // Raw int16 accel x, y, z and gyro x, y, z
+    TRACE_START,      // Session id, sample rate, start latency us
+    TRACE_STOP,       // Samples stored, samples lost, gaps
+    TRACE_GAP,        // Sample index, lost, sample rate after the gap
+    TRACE_BLOCK,      // Block type, bytes, storage_write() cycles
+    TRACE_FLUSH,      // Bytes, fs_write() latency us
+    TRACE_COMMAND,    // Command id, length, cycles spent in the queue
+    TRACE_CHECKPOINT, // Session id, bytes covered, latency us
+    TRACE_TRIGGER,    // Session id, samples of history, trigger to commit us
+};
+
+#define TRACE_DATA_SIZE 12
+
+/* One event, the size of a default MTU notification. The sequence
+ * number counts every event, a gap means the ring was full. */
+struct trace_record
+{
+    uint8_t event;
+    uint8_t len;
+    uint16_t seq;
+    uint32_t cycles;
+    uint8_t data[TRACE_DATA_SIZE];
+} __packed;
+
+#ifdef CONFIG_MOCAP_TRACE
+
+void trace_put(uint8_t event, const void *data, uint8_t len);
+uint32_t trace_dropped_get(void);
+
+static inline void trace_value(uint8_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    uint32_t args[3] = {
+        sys_cpu_to_le32(arg0),
+        sys_cpu_to_le32(arg1),
+        sys_cpu_to_le32(arg2),
+    };
+
+    trace_put(event, args, sizeof(args));
+}
+
+#else
+
+static inline void trace_put(uint8_t event, const void *data, uint8_t len) {}
+static inline uint32_t trace_dropped_get(void) { return 0; }
+static inline void trace_value(uint8_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2) {}
+
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 Nordic Semiconductor ASA
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+"""Check the on-device decimation filter against a floating-point FIR.
+
+Usage: decim_ref.py R00001.DAT --ratio 4 [--csv FILE]
+       decim_ref.py --taps
+
+Runs a bit-exact model of src/decim.c and a float64 filter with the
+unquantized taps over the raw samples of a take recorded without
+decimation, and reports the difference per axis in raw LSB. It fails if
+the difference is above what Q15 taps and output rounding can explain.
+--taps prints the tap tables of src/decim.c.
+"""
+
+import argparse
+import math
+import sys
+
+import mocap_decode as mocap
+
+RATIOS = (2, 4, 8)
+TAPS_PER_RATIO = 8
+Q15_ONE = 1 << 15
+AXES = ('ax', 'ay', 'az', 'gx', 'gy', 'gz')
+
+
+def design(ratio):
+    """Hamming windowed sinc, cut off at the output Nyquist frequency."""
+    n = TAPS_PER_RATIO * ratio
+    fc = 0.5 / ratio
+    mid = (n - 1) / 2.0
+    taps = []
+    for i in range(n):
+        t = i - mid
+        sinc = 2 * fc * math.sin(2 * math.pi * fc * t) / (2 * math.pi * fc * t)
+        window = 0.54 - 0.46 * math.cos(2 * math.pi * i / (n - 1))
+        taps.append(sinc * window)
+    total = sum(taps)
+    return [v / total for v in taps]
+
+
+def quantize(taps):
+    """Q15 taps that sum to exactly one, so DC passes unchanged."""
+    q = [int(round(v * Q15_ONE)) for v in taps]
+    # The taps are symmetric, fix the sum on the middle pair
+    error = Q15_ONE - sum(q)
+    mid = len(q) // 2
+    q[mid - 1] += error // 2
+    q[mid] += error - error // 2
+    return q
+
+
+def print_taps():
+    for ratio in RATIOS:
+        q = quantize(design(ratio))
+        half = q[:len(q) // 2]
+        print('static const int16_t taps_%d[%d] = {' % (ratio, len(half)))
+        for i in range(0, len(half), 8):
+            print('    %s,' % ', '.join('%d' % v for v in half[i:i + 8]))
+        print('};')
+
+
+class Fixed:
+    """Same arithmetic as decim_put(): int32 sums of symmetric pairs
+    times Q15 taps, rounded and saturated to int16."""
+
+    def __init__(self, ratio, first):
+        self.taps = quantize(design(ratio))
+        self.ratio = ratio
+        self.history = [list(first) for _ in self.taps]
+        self.pos = 0
+        self.phase = 0
+
+    def put(self, axes):
+        n = len(self.taps)
+        self.history[self.pos] = list(axes)
+        newest = self.pos
+        self.pos = (self.pos + 1) % n
+        self.phase += 1
+        if self.phase < self.ratio:
+            return None
+        self.phase = 0
+        out = []
+        for a in range(6):
+            acc = 0
+            for k in range(n // 2):
+                x = self.history[(newest - k) % n][a] + self.history[(newest - (n - 1 - k)) % n][a]
+                acc += self.taps[k] * x
+            out.append(max(-32768, min(32767, (acc + (1 << 14)) >> 15)))
+        return out
+
+
+class Reference:
+    def __init__(self, ratio, first):
+        self.taps = design(ratio)
+        self.ratio = ratio
+        self.history = [list(first) for _ in self.taps]
+        self.phase = 0
+
+    def put(self, axes):
+        self.history = [list(axes)] + self.history[:-1]
+        self.phase += 1
+        if self.phase < self.ratio:
+            return None
+        self.phase = 0
+        return [sum(h * x[a] for h, x in zip(self.taps, self.history)) for a in range(6)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('file', nargs='?')
+    parser.add_argument('--ratio', type=int, choices=RATIOS, default=4)
+    parser.add_argument('--sensor', type=int, default=0)
+    parser.add_argument('--csv', help='write device model and reference outputs here')
+    parser.add_argument('--taps', action='store_true', help='print the C tap tables')
+    args = parser.parse_args()
+
+    if args.taps:
+        print_taps()
+        return
+    if args.file is None:
+        parser.error('a recording is needed')
+
+    with open(args.file, 'rb') as f:
+        data = f.read()
+
+    header = mocap.Header(data)
+    if header.decimation > 1:
+        sys.exit('take is already decimated by %d, record one without' % header.decimation)
+
+    samples = []
+    for kind, payload, count in mocap.blocks(data, header.header_size):
+        if kind == mocap.RECORD_BLOCK_SAMPLES:
+            for sensor, _, *axes in mocap.decode_entries(payload, count, header.sensors):
+                if sensor == args.sensor:
+                    samples.append(axes)
+
+    if not samples:
+        sys.exit('no samples')
+
+    fixed = Fixed(args.ratio, samples[0])
+    ref = Reference(args.ratio, samples[0])
+
+    # Q15 taps are off by at most half a step each, the output is rounded once
+    taps = design(args.ratio)
+    tap_error = sum(abs(q / Q15_ONE - t) for q, t in zip(quantize(taps), taps))
+    peak = max(abs(v) for axes in samples for v in axes)
+    bound = 0.5 + peak * tap_error
+
+    out = open(args.csv, 'w') if args.csv else None
+    if out:
+        out.write('index,%s,%s\n' % (','.join(AXES), ','.join('ref_' + a for a in AXES)))
+
+    errors = [[] for _ in AXES]
+    index = 0
+    for axes in samples:
+        device = fixed.put(axes)
+        expected = ref.put(axes)
+        if device is None:
+            continue
+        for a in range(6):
+            errors[a].append(abs(device[a] - expected[a]))
+        if out:
+            out.write('%d,%s,%s\n' % (index, ','.join(str(v) for v in device),
+                                      ','.join('%.3f' % v for v in expected)))
+        index += 1
+
+    print('ratio %d, %d taps, %d -> %d samples, bound %.2f LSB'
+          % (args.ratio, len(taps), len(samples), index, bound))
+    worst = 0.0
+    for name, e in zip(AXES, errors):
+        rms = math.sqrt(sum(v * v for v in e) / len(e))
+        worst = max(worst, max(e))
+        print('%s error rms %.3f, max %.3f LSB' % (name, rms, max(e)))
+
+    if worst > bound:
+        sys.exit('error above bound')
+
+
+if __name__ == '__main__':
+    main()
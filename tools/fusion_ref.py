@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 Nordic Semiconductor ASA
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+"""Check the on-device orientation against a floating-point Mahony filter.
+
+Usage: fusion_ref.py R00001.DAT [--kp 1.0] [--csv FILE]
+
+Runs the reference filter over the raw samples of a recording, starting
+from the same identity orientation and with the same gain as the firmware
+(CONFIG_MOCAP_FUSION_KP / 1000), and reports the angle between the stored
+quaternions and the reference at the same sample.
+"""
+
+import argparse
+import math
+import sys
+
+import mocap_decode as mocap
+
+ACCEL_NORM_MIN = 1 << 20
+
+
+class Mahony:
+    def __init__(self, kp, gyro_range):
+        self.kp = kp
+        self.gyro_scale = gyro_range / 32768.0 * math.pi / 180.0
+        self.q = [1.0, 0.0, 0.0, 0.0]
+
+    def update(self, delta_us, accel, gyro):
+        dt = delta_us * 1e-6
+        g = [v * self.gyro_scale for v in gyro]
+        q0, q1, q2, q3 = self.q
+
+        norm = sum(v * v for v in accel)
+        if norm >= ACCEL_NORM_MIN:
+            ax, ay, az = (v / math.sqrt(norm) for v in accel)
+            vx = 2 * (q1 * q3 - q0 * q2)
+            vy = 2 * (q0 * q1 + q2 * q3)
+            vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3
+            g[0] += self.kp * (ay * vz - az * vy)
+            g[1] += self.kp * (az * vx - ax * vz)
+            g[2] += self.kp * (ax * vy - ay * vx)
+
+        hx, hy, hz = (v * 0.5 * dt for v in g)
+        q = [q0 - q1 * hx - q2 * hy - q3 * hz,
+             q1 + q0 * hx + q2 * hz - q3 * hy,
+             q2 + q0 * hy - q1 * hz + q3 * hx,
+             q3 + q0 * hz + q1 * hy - q2 * hx]
+        n = math.sqrt(sum(v * v for v in q))
+        self.q = [v / n for v in q]
+
+
+def angle(a, b):
+    """Rotation angle between two quaternions in degrees."""
+    na = math.sqrt(sum(v * v for v in a))
+    nb = math.sqrt(sum(v * v for v in b))
+    dot = abs(sum(x * y for x, y in zip(a, b))) / (na * nb)
+    return math.degrees(2 * math.acos(min(dot, 1.0)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('file')
+    parser.add_argument('--kp', type=float, default=1.0,
+                        help='correction gain, CONFIG_MOCAP_FUSION_KP / 1000')
+    parser.add_argument('--csv', help='write index, device and reference quaternions here')
+    args = parser.parse_args()
+
+    with open(args.file, 'rb') as f:
+        data = f.read()
+
+    header = mocap.Header(data)
+    samples = []
+    device = {}
+    for kind, payload, count in mocap.blocks(data, header.header_size):
+        if kind == mocap.RECORD_BLOCK_SAMPLES:
+            samples.extend(mocap.decode_samples(payload, count, header.sensors))
+        elif kind == mocap.RECORD_BLOCK_QUAT:
+            for index, *q in mocap.decode_quats(payload, count):
+                device[index] = q
+
+    if not device:
+        sys.exit('no quaternion blocks, was CONFIG_MOCAP_FUSION enabled?')
+
+    ref = Mahony(args.kp, header.gyro_range)
+    out = open(args.csv, 'w') if args.csv else None
+    if out:
+        out.write('index,w,x,y,z,ref_w,ref_x,ref_y,ref_z\n')
+
+    errors = []
+    for index, (delta, *axes) in enumerate(samples):
+        ref.update(delta * header.tick_us, axes[:3], axes[3:])
+        if index in device:
+            errors.append(angle(device[index], ref.q))
+            if out:
+                out.write('%d,%s\n' % (index, ','.join('%.5f' % v for v in device[index] + ref.q)))
+
+    errors.sort()
+    print('quaternions %d, error mean %.4f deg, p99 %.4f deg, max %.4f deg'
+          % (len(errors), sum(errors) / len(errors),
+             errors[int(len(errors) * 0.99)], errors[-1]))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,293 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 Nordic Semiconductor ASA
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+"""Decode a session recording (R<id>.DAT) into CSV.
+
+Usage: mocap_decode.py R00001.DAT [--raw] [--stats] [--quat] [--host-time]
+       mocap_decode.py S00001.DAT --summary
+       mocap_decode.py R00001.DAT --verify C00001.DAT
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+RECORD_MAGIC = 0x5041434D
+RECORD_VERSIONS = (2, 3)
+
+HEADER = struct.Struct('<IHHHHHHHBB')
+HEADER_SENSORS = struct.Struct('<HH')
+BLOCK = struct.Struct('<BBHH')
+ENTRY = struct.Struct('<H6h')
+GAP = struct.Struct('<IIHH')
+QUAT_HEADER = struct.Struct('<IHH')
+QUAT = struct.Struct('<4h')
+QUAT_ONE = 16384.0
+SYNC = struct.Struct('<qQQiI')
+SUMMARY = struct.Struct('<IHHHHIIB3x64s')
+STATS = struct.Struct('<IIBBH' + 'hhhH' * 6)
+SUMMARY_MAGIC = 0x4D55534D
+CRC_HEADER = struct.Struct('<IHH')
+CRC_MAGIC = 0x4352434D
+CRC_VERSION = 1
+CRC = struct.Struct('<IIIII')
+CRC_BLOCK_SIZE = 512
+
+RECORD_BLOCK_SAMPLES = 1
+RECORD_BLOCK_GAP = 2
+RECORD_BLOCK_QUAT = 3
+RECORD_BLOCK_SYNC = 4
+
+
+class Header:
+    def __init__(self, data):
+        (self.magic, self.version, self.header_size, self.entry_size,
+         self.sample_rate, self.accel_range, self.gyro_range, self.tick_us,
+         self.dlpf, self.divider) = HEADER.unpack_from(data)
+
+        if self.magic != RECORD_MAGIC:
+            raise ValueError('not a mocap recording')
+        if self.version not in RECORD_VERSIONS:
+            raise ValueError('unsupported format version %d' % self.version)
+
+        # Version 2 recordings are single sensor, older ones not decimated
+        self.sensors = 1
+        self.decimation = 1
+        if self.header_size >= HEADER.size + HEADER_SENSORS.size:
+            self.sensors, decimation = HEADER_SENSORS.unpack_from(data, HEADER.size)
+            self.decimation = max(decimation, 1)
+
+
+def varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if byte < 0x80:
+            return value, pos
+
+
+def zigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode_entries(payload, count, sensors=1):
+    """Yield (sensor, delta, ax, ay, az, gx, gy, gz) tuples from one sample block.
+
+    Each sensor is predicted from its own previous entry, the first
+    entry of every sensor is stored verbatim."""
+    prev = []
+    pos = 0
+    for sensor in range(min(sensors, count)):
+        prev.append(list(ENTRY.unpack_from(payload, pos)))
+        pos += ENTRY.size
+        yield (sensor, *prev[sensor])
+
+    for k in range(sensors, count):
+        entry = prev[k % sensors]
+        for axis in range(7):
+            value, pos = varint(payload, pos)
+            entry[axis] += zigzag(value)
+        yield (k % sensors, *entry)
+
+
+def decode_samples(payload, count, sensors=1):
+    """Yield (delta, ax, ay, az, gx, gy, gz) tuples of the first sensor."""
+    for sensor, *entry in decode_entries(payload, count, sensors):
+        if sensor == 0:
+            yield tuple(entry)
+
+
+def decode_quats(payload, count):
+    """Yield (sample index, w, x, y, z) tuples from one quaternion block."""
+    index, decimation, _ = QUAT_HEADER.unpack_from(payload)
+    for k in range(count):
+        w, x, y, z = QUAT.unpack_from(payload, QUAT_HEADER.size + k * QUAT.size)
+        yield (index + k * decimation, w / QUAT_ONE, x / QUAT_ONE, y / QUAT_ONE, z / QUAT_ONE)
+
+
+def blocks(data, offset):
+    while offset + BLOCK.size <= len(data):
+        kind, _, size, count = BLOCK.unpack_from(data, offset)
+        offset += BLOCK.size
+        yield kind, data[offset:offset + size], count
+        offset += size
+
+
+class Sync:
+    """Device clock against the host clock, see struct record_sync"""
+
+    def __init__(self, payload):
+        (self.offset_us, self.sync_us, self.start_us, self.drift_ppb,
+         self.error_us) = SYNC.unpack_from(payload)
+
+    def host_time(self, time_us):
+        device_us = self.start_us + time_us
+        return (device_us + self.offset_us +
+                (device_us - self.sync_us) * self.drift_ppb // 1000000000)
+
+
+def find_sync(data, offset):
+    for kind, payload, _ in blocks(data, offset):
+        if kind == RECORD_BLOCK_SYNC:
+            return Sync(payload)
+    return None
+
+
+def summary(data, out):
+    """Print the block records of a side index, totals and envelope to stderr"""
+    (magic, _, header_size, block_samples, sensors, count, span, envelope_count,
+     envelope) = SUMMARY.unpack_from(data)
+    if magic != SUMMARY_MAGIC:
+        raise ValueError('not a summary')
+    if count == 0:
+        sys.stderr.write('take was not finished, block records only\n')
+
+    axes = ['%s_%s' % (a, f) for a in ('ax', 'ay', 'az', 'gx', 'gy', 'gz')
+            for f in ('min', 'max', 'mean', 'dev')]
+    out.write('index,count,sensor,activity,%s\n' % ','.join(axes))
+    for pos in range(header_size, len(data) - STATS.size + 1, STATS.size):
+        index, n, sensor, activity, _, *values = STATS.unpack_from(data, pos)
+        out.write('%d,%d,%d,%d,%s\n' % (index, n, sensor, activity,
+                                         ','.join(str(v) for v in values)))
+
+    for sensor in range(sensors if count > 0 else 0):
+        _, n, _, activity, _, *values = STATS.unpack_from(data, SUMMARY.size + sensor * STATS.size)
+        sys.stderr.write('sensor %d: %d samples, activity %d, %s\n'
+                         % (sensor, n, activity, ' '.join(str(v) for v in values)))
+    sys.stderr.write('%d samples per block, envelope of %d blocks per point: %s\n'
+                     % (block_samples, span, ' '.join(str(v) for v in envelope[:envelope_count])))
+
+
+def crc_blocks(index):
+    """Entries in a CRC index, after checking its header"""
+    magic, version, entry_size = CRC_HEADER.unpack_from(index)
+    if magic != CRC_MAGIC or version != CRC_VERSION or entry_size != CRC.size:
+        raise ValueError('not a CRC index of this version')
+    return (len(index) - CRC_HEADER.size) // CRC.size
+
+
+def verify(data, index):
+    """Yield (block, first sample, end sample) of every block whose CRC does
+    not match. Blocks missing from the download do not match either."""
+    for k in range(crc_blocks(index)):
+        crc, first, end, _, _ = CRC.unpack_from(index, CRC_HEADER.size + k * CRC.size)
+        if zlib.crc32(data[k * CRC_BLOCK_SIZE:(k + 1) * CRC_BLOCK_SIZE]) != crc:
+            yield k, first, end
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('file')
+    parser.add_argument('--raw', action='store_true',
+                        help='print raw sensor words instead of g and deg/s')
+    parser.add_argument('--stats', action='store_true',
+                        help='print compression statistics to stderr')
+    parser.add_argument('--quat', action='store_true',
+                        help='print the on-device orientation instead of samples')
+    parser.add_argument('--host-time', action='store_true',
+                        help='print times on the host clock the device was synced to')
+    parser.add_argument('--summary', action='store_true',
+                        help='decode a side index (S<id>.DAT) instead of a recording')
+    parser.add_argument('--verify', metavar='CRC_INDEX',
+                        help='check the recording against its CRC index (C<id>.DAT)')
+    args = parser.parse_args()
+
+    with open(args.file, 'rb') as f:
+        data = f.read()
+
+    if args.summary:
+        summary(data, sys.stdout)
+        return
+
+    if args.verify:
+        with open(args.verify, 'rb') as f:
+            index = f.read()
+        bad = list(verify(data, index))
+        for k, first, end in bad:
+            sys.stderr.write('block %d, bytes %d-%d, samples %d-%d: bad\n'
+                             % (k, k * CRC_BLOCK_SIZE, (k + 1) * CRC_BLOCK_SIZE - 1, first, end))
+        blocks = crc_blocks(index)
+        sys.stderr.write('%d of %d blocks bad\n' % (len(bad), blocks))
+        if len(data) > blocks * CRC_BLOCK_SIZE:
+            sys.stderr.write('%d bytes past the index not checked\n'
+                             % (len(data) - blocks * CRC_BLOCK_SIZE))
+        sys.exit(1 if bad else 0)
+
+    header = Header(data)
+    accel_scale = header.accel_range / 32768.0
+    gyro_scale = header.gyro_range / 32768.0
+
+    out = sys.stdout
+
+    sync = find_sync(data, header.header_size)
+    if args.host_time and sync is None:
+        raise ValueError('recording has no time sync block')
+
+    if args.quat:
+        out.write('index,w,x,y,z\n')
+        for kind, payload, count in blocks(data, header.header_size):
+            if kind == RECORD_BLOCK_QUAT:
+                for index, *q in decode_quats(payload, count):
+                    out.write('%d,%s\n' % (index, ','.join('%.5f' % v for v in q)))
+        return
+
+    multi = header.sensors > 1
+    out.write('%s,%sax,ay,az,gx,gy,gz\n' % ('host_us' if args.host_time else 'time_us',
+                                            'sensor,' if multi else ''))
+
+    time_us = 0
+    samples = 0
+    lost = 0
+    gaps = 0
+    for kind, payload, count in blocks(data, header.header_size):
+        if kind == RECORD_BLOCK_GAP:
+            timestamp, index, gap_lost, rate = GAP.unpack_from(payload)
+            sys.stderr.write('gap at %d ms after sample %d: %d lost, %d Hz\n'
+                             % (timestamp, index, gap_lost, rate))
+            lost += gap_lost
+            gaps += 1
+            continue
+
+        if kind != RECORD_BLOCK_SAMPLES:
+            continue
+
+        # Every sensor of a sample shares the time of the first one
+        for sensor, delta, *axes in decode_entries(payload, count, header.sensors):
+            time_us += delta * header.tick_us
+            if sensor == 0:
+                samples += 1
+            if args.raw:
+                values = axes
+            else:
+                values = ['%.5f' % (v * accel_scale) for v in axes[:3]] + \
+                         ['%.3f' % (v * gyro_scale) for v in axes[3:]]
+            if multi:
+                values = [sensor] + values
+            time = sync.host_time(time_us) if args.host_time else time_us
+            out.write('%d,%s\n' % (time, ','.join(str(v) for v in values)))
+
+    if args.stats and samples > 0:
+        raw_size = samples * header.sensors * header.entry_size
+        size = len(data) - header.header_size
+        sys.stderr.write('samples %d of %d sensors, rate %d Hz, %d -> %d bytes, ratio %.2f, '
+                         '%.2f bytes/sample\n'
+                         % (samples, header.sensors, header.sample_rate, raw_size, size,
+                            raw_size / size, size / samples))
+        if header.decimation > 1:
+            sys.stderr.write('decimated by %d on the device\n' % header.decimation)
+        sys.stderr.write('lost %d samples in %d gaps\n' % (lost, gaps))
+        if sync is not None:
+            sys.stderr.write('synced, offset %d us +/- %d us, drift %d ppb\n'
+                             % (sync.offset_us, sync.error_us, sync.drift_ppb))
+
+
+if __name__ == '__main__':
+    main()
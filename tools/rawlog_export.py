@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 Nordic Semiconductor ASA
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+"""Copy takes out of the raw log of a card into R<id>.DAT files.
+
+Usage: rawlog_export.py /dev/sdX [--list] [--take ID] [--out DIR]
+       rawlog_export.py card.img --first SECTOR
+
+Reads the raw log that CONFIG_MOCAP_STORAGE_RAWLOG builds keep after the
+FAT volume (layout in src/rawlog.c), from a card reader or an image of
+the card. Without --first the log is looked for on every 4 MiB boundary,
+and at sector 0 for a log on a disk of its own. Takes still marked
+recording are copied up to their last sync.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import zlib
+
+SECTOR_SIZE = 512
+ALIGN = 8192  # Sectors, as STORAGE_RAWLOG_ALIGN
+MAGIC = 0x474F4C52
+SEGMENT_MAGIC = 0x544E4753
+VERSION = 1
+SUPER = struct.Struct('<IHHII')
+SEGMENT = struct.Struct('<IIHBBII')
+STATES = {1: 'recording', 2: 'closed', 3: 'deleted'}
+
+
+def read_sector(f, index):
+    f.seek(index * SECTOR_SIZE)
+    return f.read(SECTOR_SIZE)
+
+
+def parse_super(data):
+    if len(data) < SUPER.size + 4:
+        return None
+    magic, version, segments, sectors, generation = SUPER.unpack_from(data)
+    crc, = struct.unpack_from('<I', data, SUPER.size)
+    if magic != MAGIC or crc != zlib.crc32(data[:SUPER.size]):
+        return None
+    if version != VERSION:
+        raise ValueError('unsupported log version %d' % version)
+    return segments, sectors, generation
+
+
+def find(f):
+    f.seek(0, os.SEEK_END)
+    end = f.tell() // SECTOR_SIZE
+    for first in range(0, end, ALIGN):
+        if parse_super(read_sector(f, first)):
+            return first
+    return None
+
+
+def segments(f, first):
+    count, sectors, generation = parse_super(read_sector(f, first))
+    for slot in range(count):
+        data = read_sector(f, first + 1 + slot)
+        magic, gen, take, state, _, start, size = SEGMENT.unpack_from(data)
+        crc, = struct.unpack_from('<I', data, SEGMENT.size)
+        if magic != SEGMENT_MAGIC or gen != generation or crc != zlib.crc32(data[:SEGMENT.size]):
+            break
+        yield slot, take, state, start, size
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('device', help='card device or image')
+    parser.add_argument('--first', type=int, help='first sector of the log')
+    parser.add_argument('--list', action='store_true', help='list the takes only')
+    parser.add_argument('--take', type=int, help='copy this take only')
+    parser.add_argument('--out', default='.', help='directory of the copies')
+    args = parser.parse_args()
+
+    with open(args.device, 'rb') as f:
+        first = args.first if args.first is not None else find(f)
+        if first is None or parse_super(read_sector(f, first)) is None:
+            sys.exit('no raw log found')
+
+        # The newest segment of a take wins, as on the device
+        takes = {}
+        for slot, take, state, start, size in segments(f, first):
+            if state != 3:
+                takes[take] = (slot, state, start, size)
+
+        for take, (slot, state, start, size) in sorted(takes.items()):
+            print('take %d, segment %d, %s, %d bytes at sector %d'
+                  % (take, slot, STATES.get(state, '?'), size, first + start))
+            if args.list or (args.take is not None and take != args.take):
+                continue
+
+            f.seek((first + start) * SECTOR_SIZE)
+            data = f.read(size)
+            if len(data) != size:
+                sys.exit('take %d runs past the end of %s' % (take, args.device))
+            with open(os.path.join(args.out, 'R%05d.DAT' % take), 'wb') as out:
+                out.write(data)
+
+
+if __name__ == '__main__':
+    main()
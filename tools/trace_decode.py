@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019 Nordic Semiconductor ASA
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+"""Decode the binary trace (CONFIG_MOCAP_TRACE) into text.
+
+Usage: trace_decode.py capture.bin [--ble] [--hz 32768]
+
+By default the input is a UART capture: frames of a sync byte, a 20-byte
+record and an XOR check byte, mixed with console text that is skipped.
+With --ble the input is the trace notifications written back to back.
+"""
+
+import argparse
+import struct
+import sys
+
+TRACE_SYNC = 0xA5
+
+RECORD = struct.Struct('<BBHI12s')
+ARGS = struct.Struct('<III')
+SAMPLE = struct.Struct('<6h')
+
+# Event id: (name, argument names), from enum trace_event in src/trace.h
+EVENTS = {
+    1: ('sample', None),
+    2: ('start', ('session', 'rate_hz', 'latency_us')),
+    3: ('stop', ('count', 'lost', 'gaps')),
+    4: ('gap', ('index', 'lost', 'rate_hz')),
+    5: ('block', ('type', 'bytes', 'cycles')),
+    6: ('flush', ('bytes', 'latency_us')),
+    7: ('command', ('cmd', 'len', 'queued_cycles')),
+    8: ('checkpoint', ('session', 'bytes', 'latency_us')),
+    9: ('trigger', ('session', 'history', 'latency_us')),
+}
+
+
+def uart_records(data):
+    """Yield the records of all frames with a valid check byte."""
+    pos = 0
+    size = RECORD.size
+    while pos + size + 2 <= len(data):
+        if data[pos] != TRACE_SYNC:
+            pos += 1
+            continue
+
+        record = data[pos + 1:pos + 1 + size]
+        check = 0
+        for byte in record:
+            check ^= byte
+
+        if check != data[pos + 1 + size]:
+            pos += 1
+            continue
+
+        yield record
+        pos += size + 2
+
+
+def ble_records(data):
+    for pos in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        yield data[pos:pos + RECORD.size]
+
+
+def describe(event, length, payload):
+    name, fields = EVENTS.get(event, ('event %d' % event, None))
+
+    if event == 1:
+        return '%s %s' % (name, ' '.join(str(v) for v in SAMPLE.unpack_from(payload)))
+
+    if fields is None:
+        return '%s %s' % (name, payload[:length].hex())
+
+    values = ARGS.unpack_from(payload)
+    return '%s %s' % (name, ' '.join('%s=%d' % (f, v) for f, v in zip(fields, values)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('file')
+    parser.add_argument('--ble', action='store_true',
+                        help='input is raw trace notifications instead of a UART capture')
+    parser.add_argument('--hz', type=int, default=32768,
+                        help='kernel cycle counter frequency, 32768 on the nRF51')
+    args = parser.parse_args()
+
+    with open(args.file, 'rb') as f:
+        data = f.read()
+
+    records = ble_records(data) if args.ble else uart_records(data)
+
+    out = sys.stdout
+    last = None
+    elapsed = 0
+    prev_seq = None
+    dropped = 0
+    total = 0
+
+    for record in records:
+        event, length, seq, cycles, payload = RECORD.unpack(record)
+
+        if prev_seq is not None and seq != (prev_seq + 1) & 0xffff:
+            lost = (seq - prev_seq - 1) & 0xffff
+            dropped += lost
+            out.write('-- %d events dropped\n' % lost)
+        prev_seq = seq
+
+        # The 32-bit counter wraps, keep the timeline monotonic
+        if last is not None:
+            elapsed += (cycles - last) & 0xffffffff
+        last = cycles
+
+        out.write('%12.6f %5d %s\n' % (elapsed / args.hz, seq, describe(event, length, payload)))
+        total += 1
+
+    sys.stderr.write('%d events, %d dropped\n' % (total, dropped))
+
+
+if __name__ == '__main__':
+    main()